@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+// share length bytes of a file at one offset with another file at another
+int main(int argc, char *argv[])
+{
+    struct file_clone_range range;
+    unsigned long long soff, doff, len;
+    int dfile;
+
+    if (argc != 6)
+    {
+        printf("usage : clone <source> <offset> <dest> <offset> <length>\n");
+        return 1;
+    }
+
+    if (sscanf(argv[2],"%llu",&soff) != 1 || sscanf(argv[4],"%llu",&doff) != 1 ||
+        sscanf(argv[5],"%llu",&len) != 1)
+    {
+        printf("Problem with number format\n");
+        return 1;
+    }
+
+    range.src_fd = open(argv[1],O_RDONLY);
+    dfile = open(argv[3],O_RDWR|O_CREAT,0644);
+    if (range.src_fd < 0 || dfile < 0)
+    {
+        printf("Problem with open\n");
+        return 1;
+    }
+    range.src_offset = soff;
+    range.src_length = len;
+    range.dest_offset = doff;
+
+    if (ioctl(dfile,FICLONERANGE,&range))
+    {
+        printf("Problem with FICLONERANGE\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -8,15 +8,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <linux/fs.h>
 // #include <linux/stat.h>
 
 #include "vvsfs.h"
 
 char* device_name;
 int device;
+unsigned int blocksize = VVSFS_DEFAULT_BLOCKSIZE;
 
 static void die(char *mess)
 {
@@ -26,55 +31,196 @@ static void die(char *mess)
 
 static void usage(void)
 {
-    die("Usage : mkfs.vvsfs <device name>)");
+    die("Usage : mkfs.vvsfs [-b block size] [-i inodes] [-j journal blocks] <device name>)");
+}
+
+// the number of blocks on the device (or in the image file)
+static unsigned long long device_blocks(void)
+{
+    struct stat st;
+    unsigned long long bytes;
+
+    if (fstat(device,&st))
+        die("stat failed");
+    if (S_ISBLK(st.st_mode))
+    {
+        if (ioctl(device,BLKGETSIZE64,&bytes))
+            die("unable to get device size");
+    }
+    else
+        bytes = st.st_size;
+    return bytes / blocksize;
+}
+
+static void write_block(unsigned long long block, void *data)
+{
+    off_t pos = block * blocksize;
+
+     // move the file pointer to the correct block
+    if (pos != lseek(device,pos,SEEK_SET))
+        die("seek set failed");
+     // write the block
+    if (blocksize != write(device,data,blocksize))
+        die("block write failed");
 }
 
 int main(int argc, char ** argv)
 {
-    int k;
+    int opt;
+    unsigned long long blocks, inodes = 0, bits_per_block, inodes_per_block, counts_per_block;
+    unsigned long long b, rest;
+    long long journal = -1;
+    struct vvsfs_super_block *sb;
+    char block[VVSFS_MAX_BLOCKSIZE];
 
-    if (argc != 2) usage();
+    while ((opt = getopt(argc,argv,"b:i:j:")) != -1)
+    {
+        if (opt == 'b')
+            blocksize = strtoul(optarg,NULL,0);
+        else if (opt == 'i')
+            inodes = strtoull(optarg,NULL,0);
+        else if (opt == 'j')
+            journal = strtoll(optarg,NULL,0);
+        else
+            usage();
+    }
+    if (optind != argc - 1) usage();
+    if (blocksize < VVSFS_MIN_BLOCKSIZE || blocksize > VVSFS_MAX_BLOCKSIZE ||
+        (blocksize & (blocksize - 1)))
+        die("block size must be 512, 1024, 2048 or 4096");
 
     // open the device for reading and writing
-    device_name = argv[1];
+    device_name = argv[optind];
     device = open(device_name,O_RDWR);
+    if (device < 0)
+        die("unable to open device");
+
+    blocks = device_blocks();
+    if (blocks > 0xffffffffULL)
+        blocks = 0xffffffffULL;
+    bits_per_block = blocksize * 8;
+    inodes_per_block = blocksize / VVSFS_INODE_SIZE;
+    counts_per_block = blocksize / sizeof(__u16);
+
+    // by default there is an inode for every 4 KiB of the device
+    if (inodes == 0)
+        inodes = blocks * blocksize / 4096;
+    if (inodes < 2)
+        die("device too small");
+
+    // by default one block in 64 goes to the journal; -j 0 leaves it out
+    if (journal < 0)
+        journal = blocks / 64 < 1024 ? blocks / 64 : 1024;
+    if (journal > 0 && journal < VVSFS_JOURNAL_MIN)
+        journal = VVSFS_JOURNAL_MIN;
+
+    memset(block,0,blocksize);
+    sb = (struct vvsfs_super_block *)block;
+    sb->s_magic = VVSFS_MAGIC;
+    sb->s_version = VVSFS_VERSION;
+    sb->s_block_size = blocksize;
+    sb->s_block_count = blocks;
+    sb->s_inode_count = inodes;
+    sb->s_imap_start = VVSFS_SUPER_BLOCK + 1;
+    sb->s_imap_blocks = (inodes + bits_per_block - 1) / bits_per_block;
+    sb->s_itable_start = sb->s_imap_start + sb->s_imap_blocks;
+    sb->s_itable_blocks = (inodes + inodes_per_block - 1) / inodes_per_block;
+    if ((unsigned long long)sb->s_itable_start + sb->s_itable_blocks + journal + 2 > blocks)
+        die("too many inodes for the device");
 
-    off_t pos=0;
-    struct vvsfs_inode inode;
-
-    int i;
-    for (i = 0; i < NUMBLOCKS; i++)
-    {  // write each of the blocks
-        printf("writing : %d\n",i);
-        if (i == 0)
-        {  // the first block is an empty directory
-            inode.is_empty = 0;
-            inode.is_directory = 1;
-            inode.i_mode = 0777|S_IFDIR;
+    // the rest is split between the data bitmap, the reference counts and
+    // the data blocks; each data block costs a bit and a __u16 besides
+    // itself
+    rest = blocks - sb->s_itable_start - sb->s_itable_blocks - journal;
+    sb->s_bmap_start = sb->s_itable_start + sb->s_itable_blocks;
+    sb->s_data_blocks = rest * bits_per_block / (bits_per_block + 1 + 8 * sizeof(__u16));
+    for (;;)
+    {
+        sb->s_bmap_blocks = (sb->s_data_blocks + bits_per_block - 1) / bits_per_block;
+        sb->s_refcount_blocks = (sb->s_data_blocks + counts_per_block - 1) / counts_per_block;
+        if ((unsigned long long)sb->s_data_blocks + sb->s_bmap_blocks + sb->s_refcount_blocks <= rest)
+            break;
+        sb->s_data_blocks--;
+    }
+    sb->s_refcount_start = sb->s_bmap_start + sb->s_bmap_blocks;
+    sb->s_journal_start = sb->s_refcount_start + sb->s_refcount_blocks;
+    sb->s_journal_blocks = journal;
+    sb->s_data_start = sb->s_journal_start + sb->s_journal_blocks;
+
+    // inode 0 and the root are the only objects in use
+    sb->s_free_inodes = inodes - 2;
+    sb->s_free_blocks = sb->s_data_blocks;
+    sb->s_state = VVSFS_STATE_CLEAN;
+
+    printf("block size : %u blocks : %llu inodes : %llu data blocks : %u journal blocks : %u\n",
+           blocksize,blocks,inodes,sb->s_data_blocks,sb->s_journal_blocks);
+    write_block(VVSFS_SUPER_BLOCK,block);
+
+    // the inode bitmap, the reserved inode 0 and the root are in use
+    for (b = 0; b < sb->s_imap_blocks; b++)
+    {
+        char map[VVSFS_MAX_BLOCKSIZE];
+        memset(map,0,blocksize);
+        if (b == 0)
+            map[0] = (1 << 0) | (1 << VVSFS_ROOT_INO);
+        write_block(sb->s_imap_start + b,map);
+    }
+
+    struct vvsfs_inode *inode;
+    char table[VVSFS_MAX_BLOCKSIZE];
+    if (sizeof(struct vvsfs_inode) != VVSFS_INODE_SIZE)
+        die("bad inode size");
+
+    for (b = 0; b < sb->s_itable_blocks * inodes_per_block; b++)
+    {  // write each of the inodes, a block of them at a time
+        if (b % inodes_per_block == 0)
+            memset(table,0,blocksize);
+        inode = (struct vvsfs_inode *)(table + (b % inodes_per_block) * VVSFS_INODE_SIZE);
+        if (b == VVSFS_ROOT_INO)
+        {  // the root is an empty directory
+            inode->is_empty = 0;
+            inode->is_directory = 1;
+            inode->i_mode = 0777|S_IFDIR;
+            inode->i_flags = VVSFS_INODE_INLINE;
         }
         else
         {
-            inode.is_empty = 1;
-            inode.is_directory = 0;
-            inode.i_mode = 0;
+            inode->is_empty = (b != 0);
+            inode->is_directory = 0;
+            inode->i_mode = 0;
         }
-        inode.i_gid = 0;
-        inode.i_uid = 0;
-        inode.size = 0;
-        for (k = 0;k< MAXFILESIZE;k++)
-            inode.data[k] = 0;
-
-         // move the file pointer to the correct block
-        if (pos != lseek(device,pos,SEEK_SET))
-            die("seek set failed");
-         // write the block
-        if (sizeof(struct vvsfs_inode) !=
-                write(device,&inode,sizeof(struct vvsfs_inode)))
-            die("inode write failed");
-        pos += sizeof(struct vvsfs_inode);
+        inode->i_gid = 0;
+        inode->i_uid = 0;
+        inode->size = 0;
+
+        if (b % inodes_per_block == inodes_per_block - 1)
+            write_block(sb->s_itable_start + b / inodes_per_block,table);
+    }
+
+    // no data blocks are in use yet
+    for (b = 0; b < sb->s_bmap_blocks; b++)
+    {
+        char map[VVSFS_MAX_BLOCKSIZE];
+        memset(map,0,blocksize);
+        write_block(sb->s_bmap_start + b,map);
+    }
+
+    // no data block is shared yet
+    for (b = 0; b < sb->s_refcount_blocks; b++)
+    {
+        char counts[VVSFS_MAX_BLOCKSIZE];
+        memset(counts,0,blocksize);
+        write_block(sb->s_refcount_start + b,counts);
+    }
+
+    // an empty journal holds no descriptor
+    for (b = 0; b < sb->s_journal_blocks; b++)
+    {
+        char log[VVSFS_MAX_BLOCKSIZE];
+        memset(log,0,blocksize);
+        write_block(sb->s_journal_start + b,log);
     }
 
     close(device);
     return 0;
 }
-
@@ -0,0 +1,42 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// where the next data and the next hole are from an offset in a file
+int main(int argc, char *argv[])
+{
+    long long offset, pos;
+    int dfile;
+
+    if (argc != 3)
+    {
+        printf("usage : seek <name> <offset>\n");
+        return 1;
+    }
+
+    dfile = open(argv[1],O_RDONLY);
+
+    if (sscanf(argv[2],"%lld",&offset) != 1)
+    {
+        printf("Problem with number format\n");
+        return 1;
+    }
+
+    pos = lseek(dfile,offset,SEEK_DATA);
+    if (pos < 0)
+        printf("data %s\n", errno == ENXIO ? "ENXIO" : "error");
+    else
+        printf("data %lld\n",pos);
+
+    pos = lseek(dfile,offset,SEEK_HOLE);
+    if (pos < 0)
+        printf("hole %s\n", errno == ENXIO ? "ENXIO" : "error");
+    else
+        printf("hole %lld\n",pos);
+
+    return 0;
+}
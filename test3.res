@@ -0,0 +1,11 @@
+----------
+108894 big
+20000
+----------
+1000 big
+0000000   2   7   7  \n
+0000004
+----------
+4000 big
+0
+----------
@@ -0,0 +1,17 @@
+----------
+300
+1
+150
+300
+----------
+150
+file1 removed
+2
+300
+----------
+big not empty
+----------
+256
+name too long
+41
+----------
@@ -0,0 +1,10 @@
+----------
+----------
+40
+1
+40
+big intact
+big
+----------
+0
+----------
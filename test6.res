@@ -0,0 +1,9 @@
+----------
+8893 b
+b shares a
+----------
+b copied
+a copied
+b on disk
+a on disk
+----------
@@ -0,0 +1,19 @@
+----------
+48894 holes
+16384
+data 0
+hole 8192
+data 24576
+hole 8192
+data 24576
+hole 48894
+data ENXIO
+hole ENXIO
+----------
+57344 holes
+data ENXIO
+hole 49152
+data 53248
+hole 49152
+x
+----------
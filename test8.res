@@ -0,0 +1,10 @@
+----------
+2000
+file1999 found
+----------
+1000
+file1999 removed
+1000
+file2000 found
+----------
+----------
@@ -16,6 +16,7 @@
 
 char* device_name;
 int device;
+unsigned int blocksize = VVSFS_MIN_BLOCKSIZE; // until the super block is read
 
 static void die(char *mess)
 {
@@ -28,6 +29,16 @@ static void usage(void)
     die("Usage : view.vvsfs <device name>)");
 }
 
+static void read_block(unsigned long long block, void *data)
+{
+    off_t pos = block * blocksize;
+
+    if (pos != lseek(device,pos,SEEK_SET))
+        die("seek set failed");
+    if (blocksize != read(device,data,blocksize))
+        die("block read failed");
+}
+
 int main(int argc, char ** argv)
 {
     if (argc != 2) usage();
@@ -35,61 +46,155 @@ int main(int argc, char ** argv)
     // open the device for reading
     device_name = argv[1];
     device = open(device_name,O_RDONLY);
+    if (device < 0)
+        die("unable to open device");
+
+    struct vvsfs_super_block sb;
+    char block[VVSFS_MAX_BLOCKSIZE];
 
-    off_t pos=0;
+    read_block(VVSFS_SUPER_BLOCK,block);
+    sb = *(struct vvsfs_super_block *)block;
+    if (sb.s_magic != VVSFS_MAGIC)
+        die("not a vvsfs file system");
+    if (sb.s_version != VVSFS_VERSION || sb.s_block_size < VVSFS_MIN_BLOCKSIZE ||
+        sb.s_block_size > VVSFS_MAX_BLOCKSIZE)
+        die("unsupported vvsfs version");
+    blocksize = sb.s_block_size;
+
+    printf("version : %u block size : %u blocks : %u inodes : %u\n",
+           sb.s_version, sb.s_block_size, sb.s_block_count, sb.s_inode_count);
+    printf("inode bitmap : %u+%u inode table : %u+%u\n",
+           sb.s_imap_start, sb.s_imap_blocks,
+           sb.s_itable_start, sb.s_itable_blocks);
+    printf("data bitmap : %u+%u refcounts : %u+%u journal : %u+%u data : %u+%u\n",
+           sb.s_bmap_start, sb.s_bmap_blocks,
+           sb.s_refcount_start, sb.s_refcount_blocks,
+           sb.s_journal_start, sb.s_journal_blocks,
+           sb.s_data_start, sb.s_data_blocks);
+    printf("files : %u dirs : %u bytes : %llu\n",
+           sb.s_files, sb.s_dirs, (unsigned long long)sb.s_bytes);
+    printf("free inodes : %u free blocks : %u state : %s\n",
+           sb.s_free_inodes, sb.s_free_blocks,
+           (sb.s_state & VVSFS_STATE_CLEAN) ? "clean" : "not clean");
+
+    // blocks with a nonzero count are shared by more than one file
+    unsigned int shared = 0;
+    __u16 counts[VVSFS_MAX_BLOCKSIZE / sizeof(__u16)];
+    unsigned int per_count_block = blocksize / sizeof(__u16), d;
+    for (d = 0; d < sb.s_data_blocks; d++)
+    {
+        if (d % per_count_block == 0)
+            read_block(sb.s_refcount_start + d / per_count_block,counts);
+        if (counts[d % per_count_block])
+            shared++;
+    }
+    printf("shared blocks : %u\n", shared);
+
+    // the reserved inode 0 heads the orphan list
     struct vvsfs_inode inode;
-    int i;
-    for (i = 0; i < NUMBLOCKS; i++)
-    {  // read each of the blocks
-
-        if (pos != lseek(device,pos,SEEK_SET))
-            die("seek set failed");
-        if (sizeof(struct vvsfs_inode) != read(device,
-                                               &inode,
-                                               sizeof(struct vvsfs_inode)))
-            die("inode read failed");
-
-        printf("%2d : empty : %s dir : %s size : %i uid : %i gid : %i mode: %i data : ",
+    char table[VVSFS_MAX_BLOCKSIZE];
+    unsigned int per_block = blocksize / VVSFS_INODE_SIZE;
+    read_block(sb.s_itable_start,table);
+    inode = *(struct vvsfs_inode *)table;
+    printf("orphan list : %u\n", inode.i_orphan_next);
+
+    unsigned char map[VVSFS_MAX_BLOCKSIZE];
+    unsigned int i, used = 0;
+    for (i = 0; i < sb.s_inode_count; i++)
+    {  // read each of the inodes in use
+        if (i % (blocksize * 8) == 0)
+            read_block(sb.s_imap_start + i / (blocksize * 8),map);
+        if (!(map[(i / 8) % blocksize] & (1 << (i % 8))))
+            continue;
+        used++;
+        if (i == 0)
+            continue;
+
+        read_block(sb.s_itable_start + i / per_block,table);
+        inode = *(struct vvsfs_inode *)(table + (i % per_block) * VVSFS_INODE_SIZE);
+
+        printf("%2d : empty : %s dir : %s size : %llu uid : %i gid : %i mode: %i data : ",
                i,
                (inode.is_empty?"T":"F"),
                (inode.is_directory?"T":"F"),
-               inode.size,
+               (unsigned long long)inode.size,
                inode.i_uid,
                inode.i_gid,
                inode.i_mode);
 
 
-        if (inode.is_directory)
+        if (!(inode.i_flags & VVSFS_INODE_INLINE))
+        {
+            unsigned int k;
+            if (inode.i_flags & VVSFS_INODE_INDEX)
+                printf("indexed ");
+            if (inode.i_flags & VVSFS_INODE_REFLINK)
+                printf("reflink ");
+            if (inode.i_flags & VVSFS_INODE_PREALLOC)
+                printf("prealloc ");
+            printf("blocks : %u extents :", inode.i_blocks);
+            for (k = 0; k < inode.i_extent_count && k < VVSFS_N_EXTENTS; k++)
+                printf(" %u@%u+%u%s", inode.i_extents[k].e_lblk,
+                       inode.i_extents[k].e_pblk, inode.i_extents[k].e_len,
+                       (inode.i_extents[k].e_flags & VVSFS_EXTENT_UNWRITTEN) ? "u" : "");
+            if (inode.i_extent_count > VVSFS_N_EXTENTS)
+                printf(" ... (%u more in overflow blocks from %u)",
+                       inode.i_extent_count - VVSFS_N_EXTENTS, inode.i_extent_block);
+            printf("\n");
+        }
+        else if (inode.is_directory)
         {
-            int k, nodirs;
-            struct vvsfs_dir_entry *dent = (struct vvsfs_dir_entry *)inode.data;
-            nodirs = inode.size/sizeof(struct vvsfs_dir_entry);
-            for (k=0;k<nodirs;k++)
+            unsigned int off;
+            struct vvsfs_dir_entry *dent;
+            for (off = 0; off + sizeof(*dent) <= inode.size; off += dent->rec_len)
             {
-                printf("%s : %d ",dent->name, dent->inode_number);
-                dent++;
+                dent = (struct vvsfs_dir_entry *)(inode.data + off);
+                if (dent->rec_len < VVSFS_DIR_REC_LEN(dent->name_len))
+                    break;
+                if (dent->inode_number)
+                    printf("%.*s : %d ",dent->name_len, dent->name, dent->inode_number);
             }
             printf("\n");
         }
         else
         {
-            int j;
-            for (j=0;j< inode.size;j++)
+            unsigned int j, len = MIN(inode.size, MAXINLINE);
+            char *data = inode.data;
+            char tail[VVSFS_MAX_BLOCKSIZE];
+            if (inode.i_flags & VVSFS_INODE_TAIL)
+            {  // the data is in a slot of a shared tail block
+                struct vvsfs_tail_block *tb = (struct vvsfs_tail_block *)tail;
+                struct vvsfs_tail_slot *ts;
+                unsigned int k;
+                read_block(inode.i_extent_block,tail);
+                printf("tail in block %u : ", inode.i_extent_block);
+                len = 0;
+                for (k = 0; tb->tb_magic == VVSFS_TAIL_MAGIC && k < tb->tb_count &&
+                     sizeof(*tb) + (k + 1) * sizeof(*ts) <= blocksize; k++)
+                {
+                    ts = &tb->tb_slots[k];
+                    if (ts->ts_ino == i && ts->ts_off + ts->ts_len <= blocksize)
+                    {
+                        data = tail + ts->ts_off;
+                        len = MIN(ts->ts_len, inode.size);
+                    }
+                }
+            }
+            for (j=0;j< len;j++)
             {
-                if (inode.data[j] == '\n')
+                if (data[j] == '\n')
                 {
                     printf("\\n");
                 }
                 else
                 {
-                    printf("%lc",inode.data[j]);
+                    printf("%lc",data[j]);
                 }
             }
             printf("\n");
         }
-        pos += sizeof(struct vvsfs_inode);
     }
+    printf("inodes in use : %u of %u\n", used, sb.s_inode_count);
     close(device);
     return 0;
 }
-
@@ -14,7 +14,7 @@
  * (may need to copy vvsfs.ko to a local filesystem first)
  *
  * to make a suitable filesystem:
- *    dd of=myvvsfs.raw if=/dev/zero bs=512 count=100
+ *    dd of=myvvsfs.raw if=/dev/zero bs=512 count=1024
  *    ./mkfs.vvsfs myvvsfs.raw
  * (could also use a USB device etc.)
  *
@@ -51,6 +51,7 @@
 #include <linux/fs.h>
 #include <linux/proc_fs.h>
 #include <linux/mm.h>
+#include <linux/sched/mm.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/errno.h>
@@ -59,329 +60,4707 @@
 #include <linux/statfs.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
 #include <linux/kernel.h>
 #include <linux/version.h>
 #include <asm/uaccess.h>
 #include <linux/seq_file.h>
+#include <linux/parser.h>
+#include <linux/sort.h>
+#include <linux/percpu_counter.h>
+#include <linux/crc32.h>
+#include <linux/random.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/iomap.h>
+#include <linux/falloc.h>
 
 #include "vvsfs.h"
 
-#define DEBUG 1
+#define CREATE_TRACE_POINTS
+#include "vvsfs_trace.h"
 
 static struct inode_operations vvsfs_file_inode_operations;
 static struct file_operations vvsfs_file_operations;
 static struct inode_operations vvsfs_dir_inode_operations;
 static struct file_operations vvsfs_dir_operations;
 static struct super_operations vvsfs_ops;
+static const struct address_space_operations vvsfs_aops;
+static int vvsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
 struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino);
+static struct buffer_head *vvsfs_dir_bread(struct inode *dir, u32 lblk, int create);
+static int vvsfs_check_entry(struct inode *dir, struct vvsfs_dir_entry *dent,
+                             unsigned int off, unsigned int size);
+static struct vvsfs_dir_entry *vvsfs_find_entry(struct inode *dir,
+                                                const struct qstr *name,
+                                                struct buffer_head **bhp);
+
+// Per-mount statistics, shown in /proc/fs/vvsfs/<device>/stats. The first
+// three are saved in the super block so they survive a remount.
+enum
+{
+    VVSFS_STAT_BYTES,       // bytes of file data
+    VVSFS_STAT_FILES,       // files other than directories
+    VVSFS_STAT_DIRS,        // directories other than the root
+    VVSFS_STAT_READS,       // blocks read from the device
+    VVSFS_STAT_WRITES,      // blocks written (or dirtied for writeback)
+    VVSFS_STAT_HITS,        // metadata blocks found in the buffer cache
+    VVSFS_STAT_ALLOC_FAIL,  // inode or block allocations that found no space
+    VVSFS_STAT_NR
+};
+
+static const char *const vvsfs_stat_names[VVSFS_STAT_NR] = {
+    "bytes", "files", "dirs", "block_reads", "block_writes",
+    "cache_hits", "alloc_failures"};
+
+static struct proc_dir_entry *vvsfs_proc_root; // /proc/fs/vvsfs
 
-// For storing total data size for proc
-struct vvsfs_info
+// Operations timed by the latency histograms (mount -o latency), shown in
+// /proc/fs/vvsfs/<device>/latency. Bucket k counts the calls that took
+// less than 2^k ns and at least 2^(k-1) ns; the last bucket takes the rest.
+enum
 {
-    int size;
-    int file_count;
-    int dir_count;
+    VVSFS_OP_LOOKUP,
+    VVSFS_OP_CREATE,
+    VVSFS_OP_MKDIR,
+    VVSFS_OP_UNLINK,
+    VVSFS_OP_RMDIR,
+    VVSFS_OP_RENAME,
+    VVSFS_OP_READ,
+    VVSFS_OP_WRITE,
+    VVSFS_OP_FSYNC,
+    VVSFS_OP_NR
 };
 
-static struct vvsfs_info vvsfs_info;
+static const char *const vvsfs_op_names[VVSFS_OP_NR] = {
+    "lookup", "create", "mkdir", "unlink", "rmdir", "rename", "read", "write", "fsync"};
 
-static void vvsfs_put_super(struct super_block *sb)
+#define VVSFS_LAT_BUCKETS 40
+
+struct vvsfs_latency
 {
-    if (DEBUG)
-        printk("vvsfs - put_super\n");
-    return;
+    u64 count[VVSFS_OP_NR][VVSFS_LAT_BUCKETS];
+};
+
+// An allocation group: the objects tracked by one bitmap block. Each group
+// has its own lock, search hint and free count, and allocations in
+// different groups share neither a lock nor a buffer.
+struct vvsfs_group
+{
+    spinlock_t lock;        // protects the group's bits, hint and free count
+    unsigned long hint;     // lowest bit in the group that may be clear
+    long free;              // clear bits in the group, or -1 until counted
+} ____cacheline_aligned_in_smp;
+
+// An allocation bitmap, one bit per object, held in buffer heads that stay
+// pinned for the life of the mount and split into allocation groups.
+struct vvsfs_bitmap
+{
+    struct buffer_head **bh;
+    struct vvsfs_group *groups;       // one per bitmap block
+    unsigned long blocks;             // bitmap blocks, and so groups
+    unsigned long bits;               // objects tracked
+    unsigned long per_block;          // bits held by each block
+    struct percpu_counter free;       // clear bits in the whole bitmap
+    unsigned int __percpu *cpu_group; // group each CPU allocates from when
+                                      // it has no goal
+};
+
+// The metadata journal. Every change to a metadata block is made inside a
+// handle, and the changed blocks join the running transaction instead of
+// being marked dirty, so nothing reaches its home block before the
+// transaction commits. A commit waits for the open handles to close,
+// copies the blocks into the log buffers, writes the log and its commit
+// block, and then writes the copies to their home blocks, so after a crash
+// and a replay of the log every block of a transaction is either all old
+// or all new. Operations running while a commit writes join the next
+// transaction, and so share its commit.
+//
+// A transaction never outgrows the log. It is measured in credits: one per
+// block, and one per j_tags blocks of each run it freed (for the revoke
+// records). Each handle reserves VVSFS_HANDLE_BLOCKS credits when it opens,
+// committing the running transaction first if that much is not left, and
+// no operation uses more: those that would (freeing a large file, punching
+// a large hole) close their handle part way and carry on in a new one.
+struct vvsfs_journal
+{
+    struct super_block *j_sb;
+    struct rw_semaphore j_barrier;  // shared by handles, taken exclusively
+                                    // by a commit while it copies the blocks
+    struct mutex j_commit_mutex;    // one commit at a time
+    spinlock_t j_lock;              // protects j_bh, j_freed, their counts
+                                    // and the credits
+    struct buffer_head **j_bh;      // blocks changed in the running transaction
+    unsigned int j_count;
+    struct vvsfs_freed *j_freed;    // metadata blocks it freed
+    unsigned int j_nfreed;
+    unsigned int j_room;            // credits a transaction can take; j_bh and
+                                    // j_freed have this many entries
+    unsigned int j_used;            // credits the running transaction has taken
+    unsigned int j_reserved;        // credits held by open handles, not yet used
+    struct buffer_head **j_ckpt;    // blocks of the committing transaction,
+                                    // held until they are on disk
+    struct vvsfs_freed *j_ckpt_freed;
+    int j_aborted;                  // a commit failed or a transaction
+                                    // outgrew the log; nothing more is
+                                    // logged
+    u32 j_seq;                      // sequence of the running transaction
+    sector_t j_start;               // first block of the log
+    unsigned int j_blocks;
+    unsigned int j_tags;            // home blocks named per descriptor
+    struct buffer_head **j_log;     // the log blocks, pinned
+    struct buffer_head **j_home;    // the same memory, mapped to the home
+                                    // block of each logged copy
+    struct delayed_work j_work;     // periodic commit under writeback=async
+};
+
+// A run of metadata blocks freed by the running transaction. They stay set
+// in the bitmap in memory until the transaction has committed, so that they
+// cannot be reused (and written as file data) while a replay could still
+// copy their old contents back. The commit clears them in its copy of the
+// bitmap, and revokes them in the log.
+struct vvsfs_freed
+{
+    sector_t f_block;
+    unsigned long f_count;
+};
+
+// A handle, hung off current->journal_info while an operation runs. Handles
+// nest: an allocation inside create, or the eviction of an inode on an
+// error path, joins the handle of the operation around it.
+struct vvsfs_handle
+{
+    struct vvsfs_journal *h_journal;
+    int h_ref;
+    unsigned int h_credits; // left of those reserved when it opened
+    u32 h_seq;          // the transaction the operation's changes are in
+    void *h_saved;      // journal_info of whatever called us
+};
+
+#define VVSFS_COMMIT_INTERVAL (5 * HZ)
+
+// set on a buffer while it is in the running transaction
+enum
+{
+    BH_VvsfsJournal = BH_PrivateStart,
+};
+BUFFER_FNS(VvsfsJournal, vvsfs_journal)
+TAS_BUFFER_FNS(VvsfsJournal, vvsfs_journal)
+
+// An inode on the orphan list. The list in memory is in the same order as
+// the chain on disk, so the inode before one being taken off the list is
+// known without a read. An orphan is freed by the orphan worker once it has
+// been evicted (or straight away if it was found by a mount after a crash).
+struct vvsfs_orphan
+{
+    struct list_head o_list;
+    unsigned long o_ino;
+    int o_evicted;      // ready for the orphan worker
+};
+
+// In-memory state kept for the life of a mount. The geometry comes from the
+// on-disk super block, and the bitmaps are read once in fill_super so
+// allocation never has to go back to the inode table.
+struct vvsfs_sb_info
+{
+    struct buffer_head *s_sbh;      // super block
+    struct vvsfs_super_block *s_vs; // points into s_sbh
+    unsigned long s_itable_start;
+    unsigned int s_inodes_per_block;
+    unsigned long s_data_start;
+    struct vvsfs_bitmap s_imap;     // inode allocation bitmap
+    struct vvsfs_bitmap s_bmap;     // data block bitmap
+    unsigned long s_refcount_start;
+    unsigned long s_mount_opt;
+    unsigned int s_inode_ra;        // inode table blocks read ahead on a miss
+    struct percpu_counter s_stats[VVSFS_STAT_NR];
+    struct vvsfs_latency __percpu *s_lat; // NULL unless mounted -o latency
+    struct proc_dir_entry *s_proc;  // /proc/fs/vvsfs/<device>
+    struct vvsfs_journal *s_journal; // NULL if the file system has none
+    struct super_block *s_sb;
+    struct mutex s_orphan_mutex;    // protects s_orphans and the chain on disk
+    struct list_head s_orphans;     // vvsfs_orphan, first on the chain first
+    struct workqueue_struct *s_orphan_wq;
+    struct work_struct s_orphan_work;
+    spinlock_t s_end_io_lock;       // protects s_end_io
+    struct buffer_head *s_end_io;   // written buffers over unwritten blocks,
+                                    // chained through b_private
+    struct workqueue_struct *s_end_io_wq;
+    struct work_struct s_end_io_work;
+    struct mutex s_tail_mutex;      // protects s_tail, and tail blocks from
+                                    // being freed while a tail goes in
+    sector_t s_tail;                // tail block new tails go to, or 0
+};
+
+// mount options
+#define VVSFS_MOUNT_ASYNC 0x1   // leave dirty metadata to writeback
+#define VVSFS_MOUNT_LATENCY 0x2 // keep latency histograms
+#define VVSFS_MOUNT_NOTAIL 0x4  // make no new tails
+
+#define VVSFS_INODE_RA_DEFAULT 32 // blocks; inode_readahead= changes it
+
+// In-memory inode, allocated from vvsfs_inode_cachep. It holds the decoded
+// on-disk inode so that the hot paths never go back to the inode block;
+// vvsfs_write_inode_block rebuilds the block from it. Everything here is
+// protected by i_meta_sem: readers (block lookups, writeback) share it, and
+// anything that changes the extents, the inline data or the flags holds it
+// for writing. Directory entries are also under the VFS i_rwsem of the
+// directory, which every change to them holds exclusively.
+struct vvsfs_inode_info
+{
+    struct rw_semaphore i_meta_sem;
+    struct rw_semaphore i_mpage_sem; // shared by mpage writeback, which knows
+                                     // nothing of unwritten blocks; taken
+                                     // exclusively to set VVSFS_INODE_PREALLOC
+    __u32 i_flags;
+    __u32 i_blocks;       // data and extent blocks held
+    __u32 i_extent_block; // first overflow block for extents past
+                          // VVSFS_N_EXTENTS
+    int i_extent_count;
+    int i_extent_room;    // entries in i_ext
+    struct vvsfs_extent *i_ext; // i_ext_small, or an array of their own once
+                                // the extents outgrow it
+    struct vvsfs_orphan *i_orphan; // set once the last link has gone
+    loff_t i_trim_size;   // size kept on disk while a truncate is part way
+                          // through freeing blocks, or 0
+    union
+    {
+        struct vvsfs_extent i_ext_small[MAXINLINE / sizeof(struct vvsfs_extent)];
+        char i_data[MAXINLINE]; // inline file data or directory entries
+    };
+    struct inode vfs_inode;
+};
+
+static struct kmem_cache *vvsfs_inode_cachep;
+
+#define VVSFS_BITS_PER_BLOCK(sb) ((sb)->s_blocksize * 8)
+#define VVSFS_COUNTS_PER_BLOCK(sb) ((sb)->s_blocksize / sizeof(__u16))
+
+static inline struct vvsfs_sb_info *VVSFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
 }
 
-static int vvsfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+// vvsfs_sectors - the 512-byte sectors that n blocks take, for i_blocks
+static inline blkcnt_t vvsfs_sectors(struct super_block *sb, u32 n)
 {
-    if (DEBUG)
-        printk("vvsfs - statfs\n");
+    return (blkcnt_t)n << (sb->s_blocksize_bits - 9);
+}
 
-    buf->f_namelen = MAXNAME;
-    return 0;
+static inline struct vvsfs_inode_info *VVSFS_I(struct inode *inode)
+{
+    return container_of(inode, struct vvsfs_inode_info, vfs_inode);
 }
 
-// vvsfs_readblock - reads a block from the block device (this will copy over
-//                   the top of inode)
-static int vvsfs_readblock(struct super_block *sb,
-                           int inum,
-                           struct vvsfs_inode *inode)
+static inline void vvsfs_stat_add(struct super_block *sb, int stat, s64 n)
 {
-    struct buffer_head *bh;
+    percpu_counter_add(&VVSFS_SB(sb)->s_stats[stat], n);
+}
+
+// vvsfs_lat_start - the start time of an operation, or 0 if the mount keeps
+//                   no latency histograms
+static inline u64 vvsfs_lat_start(struct super_block *sb)
+{
+    return VVSFS_SB(sb)->s_lat ? ktime_get_ns() : 0;
+}
 
-    if (DEBUG)
-        printk("vvsfs - readblock : %d\n", inum);
+// vvsfs_lat_end - count an operation that started at start in its bucket
+static inline void vvsfs_lat_end(struct super_block *sb, int op, u64 start)
+{
+    u64 ns;
 
-    bh = sb_bread(sb, inum);
-    memcpy((void *)inode, (void *)bh->b_data, BLOCKSIZE);
-    brelse(bh);
-    if (DEBUG)
-        printk("vvsfs - readblock done : %d\n", inum);
-    return BLOCKSIZE;
+    if (!start)
+        return;
+    ns = ktime_get_ns() - start;
+    this_cpu_inc(VVSFS_SB(sb)->s_lat->count[op][min(fls64(ns), VVSFS_LAT_BUCKETS - 1)]);
 }
 
-// vvsfs_writeblock - write a block from the block device(this will just mark the block
-//                    as dirtycopy)
-static int vvsfs_writeblock(struct super_block *sb,
-                            int inum,
-                            struct vvsfs_inode *inode)
+// vvsfs_bread - sb_bread, counting buffer cache hits and device reads
+static struct buffer_head *vvsfs_bread(struct super_block *sb, sector_t block)
 {
-    struct buffer_head *bh;
+    struct buffer_head *bh = sb_getblk(sb, block);
+
+    if (!bh)
+        return NULL;
+    if (buffer_uptodate(bh))
+    {
+        vvsfs_stat_add(sb, VVSFS_STAT_HITS, 1);
+        trace_vvsfs_readblock(sb, block, 1);
+        return bh;
+    }
+    vvsfs_stat_add(sb, VVSFS_STAT_READS, 1);
+    trace_vvsfs_readblock(sb, block, 0);
+    lock_buffer(bh);
+    if (bh_submit_read(bh))
+    {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
 
-    if (DEBUG)
-        printk("vvsfs - writeblock : %d\n", inum);
+// vvsfs_sync_metadata - whether metadata changes are made durable before
+//                       the operation returns: unless the file system was
+//                       mounted with writeback=async (or the mount is -o sync)
+static inline int vvsfs_sync_metadata(struct super_block *sb)
+{
+    return !(VVSFS_SB(sb)->s_mount_opt & VVSFS_MOUNT_ASYNC) ||
+           (sb->s_flags & SB_SYNCHRONOUS);
+}
 
-    bh = sb_bread(sb, inum);
-    memcpy(bh->b_data, inode, BLOCKSIZE);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+// vvsfs_journal_room - the most blocks a transaction can have and still fit
+//                      in the log, with its descriptors and commit block
+static inline unsigned int vvsfs_journal_room(struct vvsfs_journal *j)
+{
+    return (j->j_blocks - 1) * j->j_tags / (j->j_tags + 1);
+}
 
-    if (DEBUG)
-        printk("vvsfs - writeblock done: %d\n", inum);
-    return BLOCKSIZE;
+// vvsfs_journal_slot_is_desc - whether log block k holds a descriptor
+static inline int vvsfs_journal_slot_is_desc(struct vvsfs_journal *j, unsigned int k)
+{
+    return k % (j->j_tags + 1) == 0;
 }
 
-// vvsfs_readdir - reads a directory and places the result using filldir
+// vvsfs_journal_write - start a write of a buffer that only the commit uses
+static void vvsfs_journal_write(struct buffer_head *bh, int op_flags)
+{
+    lock_buffer(bh);
+    set_buffer_uptodate(bh);
+    get_bh(bh);
+    bh->b_end_io = end_buffer_write_sync;
+    submit_bh(REQ_OP_WRITE, REQ_SYNC | op_flags, bh);
+}
 
-static int
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
-vvsfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
-#else
-vvsfs_readdir(struct file *filp, struct dir_context *ctx)
-#endif
+// vvsfs_journal_wait - wait for writes started by vvsfs_journal_write
+static int vvsfs_journal_wait(struct buffer_head **bh, unsigned int count)
 {
-    struct inode *i;
-    struct vvsfs_inode dirdata;
-    int num_dirs;
-    struct vvsfs_dir_entry *dent;
-    int error, k;
+    unsigned int k;
+    int err = 0;
 
-    if (DEBUG)
-        printk("vvsfs - readdir\n");
+    for (k = 0; k < count; k++)
+    {
+        wait_on_buffer(bh[k]);
+        if (!buffer_uptodate(bh[k]))
+            err = -EIO;
+    }
+    return err;
+}
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
-    i = filp->f_dentry->d_inode;
-#else
-    i = file_inode(filp);
-#endif
-    vvsfs_readblock(i->i_sb, i->i_ino, &dirdata);
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
+// vvsfs_journal_abort - stop committing after a failure that leaves the
+//                       running transaction unable to commit whole. The file
+//                       system goes read-only, and the log on disk is left
+//                       alone, so the next mount replays the last
+//                       transaction that did commit.
+static void vvsfs_journal_abort(struct vvsfs_journal *j, const char *why)
+{
+    if (xchg(&j->j_aborted, 1))
+        return;
+    printk("vvsfs - %s, the file system is now read-only\n", why);
+    j->j_sb->s_flags |= SB_RDONLY;
+}
 
-    if (DEBUG)
-        printk("Number of entries %d fpos %Ld\n", num_dirs, filp->f_pos);
+// vvsfs_journal_charge - take credits for the running transaction, out of
+//                        the current handle's reservation as far as it goes.
+//                        Fails if the transaction would then outgrow the log.
+//                        The caller holds j_lock.
+static int vvsfs_journal_charge(struct vvsfs_journal *j, unsigned int credits)
+{
+    struct vvsfs_handle *h = current->journal_info;
+    unsigned int own = 0;
 
-    error = 0;
-    k = 0;
-    dent = (struct vvsfs_dir_entry *)&dirdata.data;
-    while (!error && filp->f_pos < dirdata.size && k < num_dirs)
+    if (h && h->h_journal == j)
+        own = min(credits, h->h_credits);
+    if (j->j_used + j->j_reserved + credits - own > j->j_room)
+        return 0;
+    if (own)
     {
-        printk("adding name : %s ino : %d\n", dent->name, dent->inode_number);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
-        error = filldir(dirent,
-                        dent->name, strlen(dent->name), filp->f_pos, dent->inode_number, DT_REG);
-        if (error)
-            break;
-        filp->f_pos += sizeof(struct vvsfs_dir_entry);
-#else
-        if (dent->inode_number)
+        h->h_credits -= own;
+        j->j_reserved -= own;
+    }
+    j->j_used += credits;
+    return 1;
+}
+
+// vvsfs_journal_dirty - add a changed metadata block to the running
+//                       transaction. As every handle reserves room up front,
+//                       a block that does not fit means an operation went
+//                       past VVSFS_HANDLE_BLOCKS, and the journal is aborted
+//                       rather than let the transaction lose its atomicity.
+static void vvsfs_journal_dirty(struct vvsfs_journal *j, struct buffer_head *bh)
+{
+    if (test_set_buffer_vvsfs_journal(bh))
+        return;
+
+    spin_lock(&j->j_lock);
+    if (!vvsfs_journal_charge(j, 1))
+    {
+        spin_unlock(&j->j_lock);
+        clear_buffer_vvsfs_journal(bh);
+        vvsfs_journal_abort(j, "transaction too big for the journal");
+        return;
+    }
+    get_bh(bh);
+    j->j_bh[j->j_count++] = bh;
+    spin_unlock(&j->j_lock);
+}
+
+// vvsfs_journal_forget - take a block that is being freed out of the
+//                        running transaction, so that the commit does not
+//                        write its old contents over whatever reuses it.
+//                        The caller holds a handle.
+static void vvsfs_journal_forget(struct vvsfs_journal *j, struct buffer_head *bh)
+{
+    unsigned int k;
+    int found = 0;
+
+    if (!test_clear_buffer_vvsfs_journal(bh))
+        return;
+    spin_lock(&j->j_lock);
+    for (k = 0; k < j->j_count; k++)
+    {
+        if (j->j_bh[k] == bh)
         {
-            if (!dir_emit(ctx, dent->name, strnlen(dent->name, MAXNAME),
-                          dent->inode_number, DT_UNKNOWN))
-                return 0;
+            j->j_bh[k] = j->j_bh[--j->j_count];
+            found = 1;
+            break;
         }
-        ctx->pos += sizeof(struct vvsfs_dir_entry);
-#endif
-        k++;
-        dent++;
     }
-    // update_atime(i);
-    printk("done readdir\n");
+    spin_unlock(&j->j_lock);
+    if (found)
+        brelse(bh);
+}
 
-    return 0;
+// vvsfs_journal_defer_free - note count metadata blocks from block as freed
+//                            by the running transaction. Their revoke
+//                            records take credits like blocks do.
+static void vvsfs_journal_defer_free(struct vvsfs_journal *j, sector_t block,
+                                     unsigned long count)
+{
+    spin_lock(&j->j_lock);
+    if (!vvsfs_journal_charge(j, DIV_ROUND_UP(count, j->j_tags)))
+    {
+        spin_unlock(&j->j_lock);
+        vvsfs_journal_abort(j, "transaction too big for the journal");
+        return;
+    }
+    j->j_freed[j->j_nfreed].f_block = block;
+    j->j_freed[j->j_nfreed++].f_count = count;
+    spin_unlock(&j->j_lock);
 }
 
-// vvsfs_lookup - A directory name in a directory. It basically attaches the inode
-//                of the file to the directory entry.
-static struct dentry *vvsfs_lookup(struct inode *dir,
-                                   struct dentry *dentry,
-                                   unsigned int flags)
+static void vvsfs_bitmap_clear(struct vvsfs_bitmap *map, unsigned long first,
+                               unsigned long count);
+
+// vvsfs_journal_unpin - let the blocks freed by a transaction be reused, now
+//                       that no replay can write their old contents back
+static void vvsfs_journal_unpin(struct vvsfs_journal *j, struct vvsfs_freed *freed,
+                                unsigned int nfreed)
 {
-    int num_dirs;
-    int k;
-    struct vvsfs_inode dirdata;
-    struct inode *inode = NULL;
-    struct vvsfs_dir_entry *dent;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(j->j_sb);
+    unsigned int k;
 
-    if (DEBUG)
-        printk("vvsfs - lookup\n");
+    for (k = 0; k < nfreed; k++)
+        vvsfs_bitmap_clear(&sbi->s_bmap, freed[k].f_block - sbi->s_data_start,
+                           freed[k].f_count);
+}
 
-    vvsfs_readblock(dir->i_sb, dir->i_ino, &dirdata);
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
+// vvsfs_journal_log_free - clear a run of freed blocks in the log's copies
+//                          of the bitmap blocks, which are in log blocks
+//                          before end
+static void vvsfs_journal_log_free(struct vvsfs_journal *j, unsigned int end,
+                                   struct vvsfs_freed *f)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(j->j_sb);
+    struct vvsfs_bitmap *map = &sbi->s_bmap;
+    unsigned long first = f->f_block - sbi->s_data_start, count = f->f_count;
+    unsigned long g, off, n, b;
+    unsigned int k;
 
-    for (k = 0; k < num_dirs; k++)
+    for (; count; first += n, count -= n)
     {
-        dent = (struct vvsfs_dir_entry *)((dirdata.data) + k * sizeof(struct vvsfs_dir_entry));
+        g = first / map->per_block;
+        off = first % map->per_block;
+        n = min(count, map->per_block - off);
+        for (k = 0; k < end; k++)
+        {
+            if (vvsfs_journal_slot_is_desc(j, k) ||
+                j->j_home[k]->b_blocknr != map->bh[g]->b_blocknr)
+                continue;
+            for (b = off; b < off + n; b++)
+                __clear_bit_le(b, j->j_log[k]->b_data);
+            break;
+        }
+    }
+}
 
-        if ((strlen(dent->name) == dentry->d_name.len) &&
-            strncmp(dent->name, dentry->d_name.name, dentry->d_name.len) == 0)
+// vvsfs_journal_do_commit - commit the running transaction. The caller
+//                           holds j_commit_mutex. The transaction's buffers
+//                           stay held until its copies are on disk, so the
+//                           page cache cannot drop them and read the old
+//                           home blocks back in the meantime. A failed write
+//                           aborts the journal.
+static int vvsfs_journal_do_commit(struct vvsfs_journal *j)
+{
+    struct super_block *sb = j->j_sb;
+    struct vvsfs_journal_desc *desc = NULL;
+    struct vvsfs_journal_revoke *revoke = NULL;
+    struct vvsfs_journal_commit *commit;
+    struct vvsfs_freed *freed;
+    struct buffer_head *bh;
+    unsigned int count, nfreed, k, pos = 0, end;
+    unsigned long revokes = 0, r = 0, b;
+    u32 seq, crc = ~0;
+    int err;
+
+    // copy the blocks while no operation is changing them
+    down_write(&j->j_barrier);
+    count = j->j_count;
+    nfreed = j->j_nfreed;
+    seq = j->j_seq;
+    if (j->j_aborted || (!count && !nfreed))
+    {
+        // blocks forgotten since they joined leave credits behind
+        if (!j->j_aborted)
+            j->j_used = 0;
+        up_write(&j->j_barrier);
+        return j->j_aborted ? -EROFS : 0;
+    }
+    spin_lock(&j->j_lock);
+    swap(j->j_bh, j->j_ckpt);
+    swap(j->j_freed, j->j_ckpt_freed);
+    j->j_count = j->j_nfreed = j->j_used = 0;
+    spin_unlock(&j->j_lock);
+    freed = j->j_ckpt_freed;
+    for (k = 0; k < nfreed; k++)
+        revokes += freed[k].f_count;
+    for (k = 0; k < count; k++)
+    {
+        bh = j->j_ckpt[k];
+        if (k % j->j_tags == 0)
+        {
+            desc = (struct vvsfs_journal_desc *)j->j_log[pos++]->b_data;
+            memset(desc, 0, sb->s_blocksize);
+            desc->d_header.h_magic = VVSFS_JOURNAL_MAGIC;
+            desc->d_header.h_type = VVSFS_JOURNAL_DESC;
+            desc->d_header.h_seq = seq;
+            desc->d_header.h_count = min_t(unsigned int, count - k, j->j_tags);
+        }
+        desc->d_blocks[k % j->j_tags] = bh->b_blocknr;
+        memcpy(j->j_log[pos]->b_data, bh->b_data, sb->s_blocksize);
+        j->j_home[pos++]->b_blocknr = bh->b_blocknr;
+        // free to join the next transaction, but still held
+        clear_buffer_vvsfs_journal(bh);
+    }
+    j->j_seq++;
+    up_write(&j->j_barrier);
+
+    // The freed blocks are clear in the log's copy of the bitmap, but stay
+    // set in memory until the transaction is on disk. They are revoked
+    // after the copies.
+    end = pos;
+    for (k = 0; k < nfreed; k++)
+        vvsfs_journal_log_free(j, end, &freed[k]);
+    for (k = 0; k < nfreed; k++)
+    {
+        for (b = 0; b < freed[k].f_count; b++, r++)
         {
-            inode = vvsfs_iget(dir->i_sb, dent->inode_number);
+            if (r % j->j_tags == 0)
+            {
+                revoke = (struct vvsfs_journal_revoke *)j->j_log[pos++]->b_data;
+                memset(revoke, 0, sb->s_blocksize);
+                revoke->r_header.h_magic = VVSFS_JOURNAL_MAGIC;
+                revoke->r_header.h_type = VVSFS_JOURNAL_REVOKE;
+                revoke->r_header.h_seq = seq;
+                revoke->r_header.h_count = min_t(unsigned long, revokes - r,
+                                                 j->j_tags);
+            }
+            revoke->r_blocks[r % j->j_tags] = freed[k].f_block + b;
+        }
+    }
 
-            if (!inode)
-                return ERR_PTR(-EACCES);
+    commit = (struct vvsfs_journal_commit *)j->j_log[pos]->b_data;
+    memset(commit, 0, sb->s_blocksize);
+    commit->c_header.h_magic = VVSFS_JOURNAL_MAGIC;
+    commit->c_header.h_type = VVSFS_JOURNAL_COMMIT;
+    commit->c_header.h_seq = seq;
+    commit->c_header.h_count = count;
+    for (k = 0; k < pos; k++)
+        crc = crc32_le(crc, j->j_log[k]->b_data, sb->s_blocksize);
+    commit->c_crc = crc;
+
+    // The log is about to overwrite the last transaction, so the first
+    // write flushes that transaction's home blocks out of the device cache.
+    // The commit block goes only once the rest of the log is stable.
+    for (k = 0; k < pos; k++)
+        vvsfs_journal_write(j->j_log[k], k ? 0 : REQ_PREFLUSH);
+    err = vvsfs_journal_wait(j->j_log, pos);
+    if (!err)
+    {
+        vvsfs_journal_write(j->j_log[pos], REQ_PREFLUSH | REQ_FUA);
+        err = vvsfs_journal_wait(j->j_log + pos, 1);
+    }
+    if (err)
+    {
+        // the changes are in memory only, and cannot be committed whole
+        vvsfs_journal_abort(j, "unable to write the journal");
+        goto out;
+    }
 
-            d_add(dentry, inode);
-            return NULL;
-        }
+    // checkpoint: the copies go to their home blocks
+    for (k = 0; k < end; k++)
+        if (!vvsfs_journal_slot_is_desc(j, k))
+            vvsfs_journal_write(j->j_home[k], 0);
+    for (k = 0; k < end; k++)
+        if (!vvsfs_journal_slot_is_desc(j, k) && vvsfs_journal_wait(j->j_home + k, 1))
+            err = -EIO;
+    vvsfs_stat_add(sb, VVSFS_STAT_WRITES, pos + 1 + count);
+    if (err)
+    {
+        // the log holds the transaction, and must stay as it is for the
+        // replay that will finish the checkpoint
+        vvsfs_journal_abort(j, "unable to write metadata blocks");
+        goto out;
     }
-    d_add(dentry, inode);
-    return NULL;
+    vvsfs_journal_unpin(j, freed, nfreed);
+
+out:
+    for (k = 0; k < count; k++)
+        brelse(j->j_ckpt[k]);
+    trace_vvsfs_commit(sb, seq, count, err);
+    return err;
+}
+
+// vvsfs_journal_commit - commit transaction seq, unless that has been done
+//                        already. Must not be called with a handle open.
+static int vvsfs_journal_commit(struct vvsfs_journal *j, u32 seq)
+{
+    int err = 0;
+
+    mutex_lock(&j->j_commit_mutex);
+    if (seq == j->j_seq)
+        err = vvsfs_journal_do_commit(j);
+    mutex_unlock(&j->j_commit_mutex);
+    return err;
+}
+
+// vvsfs_commit - commit whatever has been changed so far; a no-op without a
+//                journal
+static int vvsfs_commit(struct super_block *sb)
+{
+    struct vvsfs_journal *j = VVSFS_SB(sb)->s_journal;
+
+    if (!j)
+        return 0;
+    return vvsfs_journal_commit(j, READ_ONCE(j->j_seq));
+}
+
+static void vvsfs_journal_work(struct work_struct *work)
+{
+    struct vvsfs_journal *j = container_of(to_delayed_work(work),
+                                           struct vvsfs_journal, j_work);
+
+    vvsfs_journal_commit(j, READ_ONCE(j->j_seq));
+}
+
+// vvsfs_journal_start - open a handle around an operation that changes
+//                       metadata, reserving VVSFS_HANDLE_BLOCKS credits for
+//                       it. A handle must not be held while waiting for a
+//                       page lock, as the holder of the page lock may be
+//                       waiting here for a commit.
+static void vvsfs_journal_start(struct super_block *sb)
+{
+    struct vvsfs_journal *j = VVSFS_SB(sb)->s_journal;
+    struct vvsfs_handle *h = current->journal_info;
+
+    if (!j)
+        return;
+    if (h && h->h_journal == j)
+    {
+        h->h_ref++;
+        return;
+    }
+
+    // a transaction without room for one more operation is committed
+    // first; the commit waits for the handles holding credits to close
+    spin_lock(&j->j_lock);
+    while (!j->j_aborted &&
+           j->j_used + j->j_reserved + VVSFS_HANDLE_BLOCKS > j->j_room)
+    {
+        spin_unlock(&j->j_lock);
+        vvsfs_journal_commit(j, READ_ONCE(j->j_seq));
+        spin_lock(&j->j_lock);
+    }
+    j->j_reserved += VVSFS_HANDLE_BLOCKS;
+    spin_unlock(&j->j_lock);
+
+    h = kmalloc(sizeof(struct vvsfs_handle), GFP_NOFS | __GFP_NOFAIL);
+    h->h_journal = j;
+    h->h_ref = 1;
+    h->h_credits = VVSFS_HANDLE_BLOCKS;
+    h->h_saved = current->journal_info;
+    down_read(&j->j_barrier);
+    h->h_seq = j->j_seq;
+    current->journal_info = h;
+}
+
+// vvsfs_journal_stop - close a handle, giving back the credits it did not
+//                      use. Under writeback=sync the operation's
+//                      transaction is committed before this returns;
+//                      otherwise it is left for the periodic commit.
+static void vvsfs_journal_stop(struct super_block *sb)
+{
+    struct vvsfs_journal *j = VVSFS_SB(sb)->s_journal;
+    struct vvsfs_handle *h = current->journal_info;
+    u32 seq;
+
+    if (!j || --h->h_ref)
+        return;
+    seq = h->h_seq;
+    spin_lock(&j->j_lock);
+    j->j_reserved -= h->h_credits;
+    spin_unlock(&j->j_lock);
+    current->journal_info = h->h_saved;
+    up_read(&j->j_barrier);
+    kfree(h);
+
+    if (vvsfs_sync_metadata(sb))
+        vvsfs_journal_commit(j, seq);
+    else if (READ_ONCE(j->j_count))
+        schedule_delayed_work(&j->j_work, VVSFS_COMMIT_INTERVAL);
+}
+
+// vvsfs_journal_full - whether a long operation should close its handle and
+//                      go on in a new one before its next step: once it has
+//                      used half of its credits, the rest being kept for the
+//                      extents and inode it writes before it stops. A
+//                      nested handle cannot be closed, and never reports
+//                      full.
+static int vvsfs_journal_full(struct super_block *sb)
+{
+    struct vvsfs_journal *j = VVSFS_SB(sb)->s_journal;
+    struct vvsfs_handle *h = current->journal_info;
+
+    return j && h && h->h_journal == j && h->h_ref == 1 &&
+           h->h_credits < VVSFS_HANDLE_BLOCKS / 2;
+}
+
+// vvsfs_journal_restart - close the handle of a long operation that
+//                         vvsfs_journal_full says should carry on in a new
+//                         one, and open the new one. The caller holds no
+//                         lock that handles are taken under.
+static void vvsfs_journal_restart(struct super_block *sb)
+{
+    vvsfs_journal_stop(sb);
+    vvsfs_journal_start(sb);
+}
+
+// vvsfs_dirty_metadata - note a change to a metadata buffer. With a journal
+//                        the buffer joins the running transaction (once the
+//                        journal has aborted, the change stays in memory).
+//                        Without one it is marked dirty, and written out
+//                        straight away unless the file system was mounted
+//                        with writeback=async (or the mount is -o sync).
+static void vvsfs_dirty_metadata(struct super_block *sb, struct buffer_head *bh)
+{
+    struct vvsfs_journal *j = VVSFS_SB(sb)->s_journal;
+    int sync = vvsfs_sync_metadata(sb);
+
+    trace_vvsfs_writeblock(sb, bh->b_blocknr, sync);
+    if (j)
+    {
+        if (!READ_ONCE(j->j_aborted))
+            vvsfs_journal_dirty(j, bh);
+        return;
+    }
+    // a buffer that is already dirty is written once for both changes
+    if (!buffer_dirty(bh))
+        vvsfs_stat_add(sb, VVSFS_STAT_WRITES, 1);
+    mark_buffer_dirty(bh);
+    if (sync)
+        sync_dirty_buffer(bh);
+}
+
+static void vvsfs_bitmap_release(struct vvsfs_bitmap *map)
+{
+    unsigned long k;
+
+    if (!map->bh)
+        return;
+    for (k = 0; k < map->blocks; k++)
+        brelse(map->bh[k]);
+    kfree(map->bh);
+    map->bh = NULL;
+    kfree(map->groups);
+    free_percpu(map->cpu_group);
+    percpu_counter_destroy(&map->free);
+}
+
+// vvsfs_journal_release - drop the journal's buffers
+static void vvsfs_journal_release(struct vvsfs_journal *j)
+{
+    unsigned int k;
+
+    if (!j)
+        return;
+    cancel_delayed_work_sync(&j->j_work);
+    for (k = 0; k < j->j_count; k++)
+    {
+        clear_buffer_vvsfs_journal(j->j_bh[k]);
+        brelse(j->j_bh[k]);
+    }
+    for (k = 0; j->j_home && k < j->j_blocks; k++)
+        if (j->j_home[k])
+            free_buffer_head(j->j_home[k]);
+    for (k = 0; j->j_log && k < j->j_blocks; k++)
+        brelse(j->j_log[k]);
+    kfree(j->j_home);
+    kfree(j->j_log);
+    kvfree(j->j_bh);
+    kvfree(j->j_ckpt);
+    kvfree(j->j_freed);
+    kvfree(j->j_ckpt_freed);
+    kfree(j);
 }
 
-// vvsfs_empty_inode - finds the first free inode (returns -1 is unable to find one)
-static int vvsfs_empty_inode(struct super_block *sb)
+static void vvsfs_release_sbi(struct super_block *sb, struct vvsfs_sb_info *sbi)
 {
-    struct vvsfs_inode block;
+    struct vvsfs_orphan *o, *tmp;
     int k;
-    for (k = 0; k < NUMBLOCKS; k++)
+
+    if (sbi->s_proc)
+        remove_proc_subtree(sb->s_id, vvsfs_proc_root);
+    // orphans still listed are freed by the next mount
+    if (sbi->s_orphan_wq)
+        destroy_workqueue(sbi->s_orphan_wq);
+    if (sbi->s_end_io_wq)
+        destroy_workqueue(sbi->s_end_io_wq);
+    list_for_each_entry_safe(o, tmp, &sbi->s_orphans, o_list)
+        kfree(o);
+    vvsfs_journal_release(sbi->s_journal);
+    vvsfs_bitmap_release(&sbi->s_imap);
+    vvsfs_bitmap_release(&sbi->s_bmap);
+    brelse(sbi->s_sbh);
+    for (k = 0; k < VVSFS_STAT_NR; k++)
+        percpu_counter_destroy(&sbi->s_stats[k]);
+    free_percpu(sbi->s_lat);
+    kfree(sbi);
+}
+
+static int vvsfs_bitmap_sync(struct vvsfs_bitmap *map, int wait);
+
+// vvsfs_save_stats - copy the statistics and free counts that persist into
+//                    the super block
+static void vvsfs_save_stats(struct super_block *sb)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_super_block *vs = sbi->s_vs;
+
+    vs->s_files = percpu_counter_sum_positive(&sbi->s_stats[VVSFS_STAT_FILES]);
+    vs->s_dirs = percpu_counter_sum_positive(&sbi->s_stats[VVSFS_STAT_DIRS]);
+    vs->s_bytes = percpu_counter_sum_positive(&sbi->s_stats[VVSFS_STAT_BYTES]);
+    vs->s_free_inodes = percpu_counter_sum_positive(&sbi->s_imap.free);
+    vs->s_free_blocks = percpu_counter_sum_positive(&sbi->s_bmap.free);
+    mark_buffer_dirty(sbi->s_sbh);
+}
+
+static void vvsfs_put_super(struct super_block *sb)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+
+    if (sbi)
     {
-        vvsfs_readblock(sb, k, &block);
-        if (block.is_empty)
-            return k;
+        if (!sb_rdonly(sb))
+        {
+            // the evicted orphans are freed before the final commit
+            flush_workqueue(sbi->s_orphan_wq);
+            // the counts are only marked exact, and the journal as not
+            // needing a replay, once everything they describe is on disk
+            if (sbi->s_journal)
+                cancel_delayed_work_sync(&sbi->s_journal->j_work);
+            // metadata blocks freed by the running transaction only count
+            // as free once it has committed
+            vvsfs_commit(sb);
+            vvsfs_save_stats(sb);
+            if (!vvsfs_commit(sb) &&
+                !vvsfs_bitmap_sync(&sbi->s_imap, 1) &&
+                !vvsfs_bitmap_sync(&sbi->s_bmap, 1))
+                sbi->s_vs->s_state |= VVSFS_STATE_CLEAN;
+            __sync_dirty_buffer(sbi->s_sbh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+        }
+        vvsfs_release_sbi(sb, sbi);
+        sb->s_fs_info = NULL;
     }
-    return -1;
+    return;
 }
 
-// vvsfs_new_inode - find and construct a new inode.
-// Modified by Yutian Zhao, Hong Wang
-struct inode *vvsfs_new_inode(const struct inode *dir, umode_t mode, int is_dir)
+// vvsfs_statfs - report the sizes from the super block and the free counts
+//                kept by the allocators, without reading the bitmaps
+static int vvsfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
-    struct vvsfs_inode block;
-    struct super_block *sb;
-    struct inode *inode;
-    int newinodenumber;
+    struct super_block *sb = dentry->d_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+    buf->f_type = VVSFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = sbi->s_vs->s_data_blocks;
+    buf->f_bfree = percpu_counter_sum_positive(&sbi->s_bmap.free);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sbi->s_vs->s_inode_count;
+    buf->f_ffree = percpu_counter_sum_positive(&sbi->s_imap.free);
+    buf->f_namelen = MAXNAME;
+    buf->f_fsid.val[0] = (u32)id;
+    buf->f_fsid.val[1] = (u32)(id >> 32);
+    return 0;
+}
 
-    if (DEBUG)
-        printk("vvsfs - new inode\n");
+// vvsfs_inode_block - the block in the inode table that holds inode inum
+static inline sector_t vvsfs_inode_block(struct super_block *sb, int inum)
+{
+    return VVSFS_SB(sb)->s_itable_start + inum / VVSFS_SB(sb)->s_inodes_per_block;
+}
 
-    if (!dir)
-        return NULL;
-    sb = dir->i_sb;
+// vvsfs_get_inode - read the block that holds on-disk inode inum into *bhp
+//                   and return the inode within it, or NULL on error. The
+//                   block is shared with other inodes, so changes to it are
+//                   made under the buffer lock.
+static struct vvsfs_inode *vvsfs_get_inode(struct super_block *sb,
+                                           unsigned long inum,
+                                           struct buffer_head **bhp)
+{
+    struct buffer_head *bh = vvsfs_bread(sb, vvsfs_inode_block(sb, inum));
 
-    /* get an vfs inode */
-    inode = new_inode(sb);
-    if (!inode)
+    *bhp = bh;
+    if (!bh)
         return NULL;
+    return (struct vvsfs_inode *)(bh->b_data +
+                                  (inum % VVSFS_SB(sb)->s_inodes_per_block) * VVSFS_INODE_SIZE);
+}
 
-    inode_init_owner(inode, dir, mode);
-    /* find a spare inode in the vvsfs */
-    newinodenumber = vvsfs_empty_inode(sb);
-    if (newinodenumber == -1)
+static inline int vvsfs_bitmap_test(struct vvsfs_bitmap *map, unsigned long bit);
+
+// vvsfs_inode_readahead - if the block of inode ino is not cached, start
+//                         reads of it and of the blocks of the other inodes
+//                         in use in its window of the inode table. They go
+//                         out under one plug, so neighbours merge into large
+//                         requests and a walk of the tree (ls -lR) reads the
+//                         table in a few large reads rather than a block at
+//                         a time.
+static void vvsfs_inode_readahead(struct super_block *sb, unsigned long ino)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long span, first, last, k;
+    sector_t block, prev = 0;
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    int cached;
+
+    if (!sbi->s_inode_ra)
+        return;
+    bh = sb_find_get_block(sb, vvsfs_inode_block(sb, ino));
+    cached = bh && buffer_uptodate(bh);
+    brelse(bh);
+    if (cached)
+        return;
+
+    span = (unsigned long)sbi->s_inode_ra * sbi->s_inodes_per_block;
+    first = ino - ino % span;
+    last = min_t(unsigned long, first + span, sbi->s_imap.bits);
+    blk_start_plug(&plug);
+    for (k = first; k < last; k++)
     {
-        printk("vvsfs - inode table is full.\n");
-        return NULL;
+        if (k != ino && !vvsfs_bitmap_test(&sbi->s_imap, k))
+            continue;
+        block = vvsfs_inode_block(sb, k);
+        if (block != prev)
+            sb_breadahead(sb, block);
+        prev = block;
     }
+    blk_finish_plug(&plug);
+}
 
-    // initialize block
-    block.is_empty = false;
-    block.size = 0;
-    block.is_directory = is_dir;
-    block.i_mode = mode;
-    block.i_uid = inode->i_uid.val;
-    block.i_gid = inode->i_gid.val;
+// vvsfs_extent_room - make room in i_ext for n more extents, moving them to
+//                     a larger array of their own if need be. -ENOSPC if the
+//                     file would have more than VVSFS_MAX_EXTENTS. The caller
+//                     holds i_meta_sem for writing (or has the inode to
+//                     itself).
+static int vvsfs_extent_room(struct super_block *sb, struct vvsfs_inode_info *ei,
+                             int n)
+{
+    int want = ei->i_extent_count + n, limit = VVSFS_MAX_EXTENTS(sb->s_blocksize);
+    struct vvsfs_extent *grown;
+    unsigned int nofs;
 
-    vvsfs_writeblock(sb, newinodenumber, &block);
-    if (DEBUG)
-        printk("vvsfs - new inode finish writing\n");
+    if (want <= ei->i_extent_room)
+        return 0;
+    if (want > limit)
+        return -ENOSPC;
+    want = min(max(want, 2 * ei->i_extent_room), limit);
+    // large lists fall back to vmalloc, which only takes GFP_KERNEL
+    nofs = memalloc_nofs_save();
+    grown = kvmalloc_array(want, sizeof(struct vvsfs_extent), GFP_KERNEL);
+    memalloc_nofs_restore(nofs);
+    if (!grown)
+        return -ENOMEM;
+    memcpy(grown, ei->i_ext, ei->i_extent_count * sizeof(struct vvsfs_extent));
+    if (ei->i_ext != ei->i_ext_small)
+        kvfree(ei->i_ext);
+    ei->i_ext = grown;
+    ei->i_extent_room = want;
+    return 0;
+}
 
-    inode_init_owner(inode, dir, mode);
-    inode->i_ino = newinodenumber;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
-    inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
+// vvsfs_read_inode - decode the on-disk inode (and its extent overflow
+//                    blocks) into a new in-memory inode
+static int vvsfs_read_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct vvsfs_extent_block *eb;
+    struct buffer_head *bh, *ebh;
+    struct vvsfs_inode *di;
+    sector_t block;
+    int n, count;
+
+    vvsfs_inode_readahead(sb, inode->i_ino);
+    di = vvsfs_get_inode(sb, inode->i_ino, &bh);
+    if (!di)
+        return -EIO;
+
+    i_uid_write(inode, di->i_uid);
+    i_gid_write(inode, di->i_gid);
+    inode->i_mode = di->i_mode;
+    inode->i_size = di->size;
+    ei->i_flags = di->i_flags;
+    ei->i_blocks = di->i_blocks;
+    ei->i_extent_block = di->i_extent_block;
+    ei->i_extent_count = 0;
+    inode->i_blocks = vvsfs_sectors(sb, ei->i_blocks);
+
+    if ((ei->i_flags & VVSFS_INODE_TAIL) &&
+        (!(ei->i_flags & VVSFS_INODE_INLINE) || !S_ISREG(inode->i_mode)))
+        goto io_error;
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+    {
+        memcpy(ei->i_data, di->data, MAXINLINE);
+        brelse(bh);
+        return 0;
+    }
+
+    count = di->i_extent_count;
+    if (count < 0 || count > VVSFS_MAX_EXTENTS(sb->s_blocksize))
+        goto io_error;
+    if (vvsfs_extent_room(sb, ei, count))
+    {
+        brelse(bh);
+        return -ENOMEM;
+    }
+    n = min(count, VVSFS_N_EXTENTS);
+    memcpy(ei->i_ext, di->i_extents, n * sizeof(struct vvsfs_extent));
+    block = ei->i_extent_block;
+    while (n < count)
+    {
+        ebh = block ? vvsfs_bread(sb, block) : NULL;
+        if (!ebh)
+            goto io_error;
+        eb = (struct vvsfs_extent_block *)ebh->b_data;
+        if (!eb->eb_count || eb->eb_count > count - n ||
+            eb->eb_count > VVSFS_EXTENTS_PER_BLOCK(sb->s_blocksize))
+        {
+            brelse(ebh);
+            goto io_error;
+        }
+        memcpy(ei->i_ext + n, eb->eb_extents, eb->eb_count * sizeof(struct vvsfs_extent));
+        n += eb->eb_count;
+        block = eb->eb_next;
+        brelse(ebh);
+    }
+    ei->i_extent_count = count;
+    brelse(bh);
+    return 0;
+
+io_error:
+    brelse(bh);
+    return -EIO;
+}
+
+// vvsfs_write_inode_block - rebuild the on-disk inode from the in-memory one
+//                           and write it (waiting for it if wait is set).
+//                           The caller holds i_meta_sem.
+static int vvsfs_write_inode_block(struct inode *inode, int wait)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+    __u32 next;
+    int err = 0;
+
+    di = vvsfs_get_inode(sb, inode->i_ino, &bh);
+    if (!di)
+        return -EIO;
+
+    // the orphan link is kept up by the orphan list code, under the buffer
+    // lock
+    lock_buffer(bh);
+    next = di->i_orphan_next;
+    memset(di, 0, sizeof(struct vvsfs_inode));
+    di->i_orphan_next = next;
+    di->is_empty = false;
+    di->is_directory = S_ISDIR(inode->i_mode);
+    di->i_mode = inode->i_mode;
+    di->i_flags = ei->i_flags;
+    di->i_uid = i_uid_read(inode);
+    di->i_gid = i_gid_read(inode);
+    di->size = max(inode->i_size, ei->i_trim_size);
+    di->i_blocks = ei->i_blocks;
+    di->i_extent_block = ei->i_extent_block;
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+        memcpy(di->data, ei->i_data, MAXINLINE);
+    else
+    {
+        di->i_extent_count = ei->i_extent_count;
+        memcpy(di->i_extents, ei->i_ext,
+               min(ei->i_extent_count, VVSFS_N_EXTENTS) * sizeof(struct vvsfs_extent));
+    }
+    unlock_buffer(bh);
+
+    vvsfs_dirty_metadata(sb, bh);
+    if (wait)
+    {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh))
+            err = -EIO;
+    }
+    brelse(bh);
+    return err;
+}
+
+// vvsfs_update_inode - note a change to an in-memory inode. It is written
+//                      straight away unless the file system is mounted with
+//                      writeback=async, in which case it is left to
+//                      vvsfs_write_inode. The caller holds i_meta_sem
+//                      for writing.
+static int vvsfs_update_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+
+    if (vvsfs_sync_metadata(sb))
+        return vvsfs_write_inode_block(inode, 0);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+// vvsfs_readdir - reads a directory and places the result using filldir
+
+static int
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
+vvsfs_readdir(struct file *filp, void *dirent, filldir_t filldir)
+#else
+vvsfs_readdir(struct file *filp, struct dir_context *ctx)
+#endif
+{
+    struct inode *i;
+    struct vvsfs_dir_entry *dent;
+    struct buffer_head *bh;
+    unsigned int off;
+    u32 lblk, nblocks;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
+    i = filp->f_dentry->d_inode;
+#else
+    i = file_inode(filp);
+#endif
+    if (VVSFS_I(i)->i_flags & VVSFS_INODE_INDEX)
+        goto indexed;
+
+    // the position is the offset of the next inline entry; entries before
+    // it are walked over rather than trusted, as a create that compacts the
+    // entries moves them
+    for (off = 0; off < i->i_size; off += dent->rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(VVSFS_I(i)->i_data + off);
+        if (!vvsfs_check_entry(i, dent, off, i->i_size))
+            return -EIO;
+        if (off < ctx->pos || !dent->inode_number)
+            continue;
+        if (!dir_emit(ctx, dent->name, dent->name_len,
+                      dent->inode_number, dent->file_type))
+            return 0;
+        ctx->pos = off + dent->rec_len;
+    }
+    // update_atime(i);
+    return 0;
+
+indexed:
+    // walk the leaves in block order; the position is the byte offset of
+    // the next entry, and block 0 (the index root) is skipped
+    nblocks = i->i_size / i->i_sb->s_blocksize;
+    for (lblk = max_t(u32, 1, ctx->pos / i->i_sb->s_blocksize); lblk < nblocks; lblk++)
+    {
+        bh = vvsfs_dir_bread(i, lblk, 0);
+        if (IS_ERR(bh))
+            return PTR_ERR(bh);
+        for (off = 0; off < i->i_sb->s_blocksize; off += dent->rec_len)
+        {
+            dent = (struct vvsfs_dir_entry *)(bh->b_data + off);
+            if (!vvsfs_check_entry(i, dent, off, i->i_sb->s_blocksize))
+            {
+                brelse(bh);
+                return -EIO;
+            }
+            if ((loff_t)lblk * i->i_sb->s_blocksize + off < ctx->pos || !dent->inode_number)
+                continue;
+            if (!dir_emit(ctx, dent->name, dent->name_len,
+                          dent->inode_number, dent->file_type))
+            {
+                brelse(bh);
+                return 0;
+            }
+            ctx->pos = (loff_t)lblk * i->i_sb->s_blocksize + off + dent->rec_len;
+        }
+        brelse(bh);
+        ctx->pos = (loff_t)(lblk + 1) * i->i_sb->s_blocksize;
+    }
+    return 0;
+}
+
+// vvsfs_lookup - A directory name in a directory. It basically attaches the inode
+//                of the file to the directory entry.
+static struct dentry *vvsfs_lookup(struct inode *dir,
+                                   struct dentry *dentry,
+                                   unsigned int flags)
+{
+    u64 start = vvsfs_lat_start(dir->i_sb);
+    struct inode *inode = NULL;
+    struct vvsfs_dir_entry *dent;
+    struct buffer_head *bh;
+    unsigned long ino = 0;
+    struct dentry *ret = NULL;
+
+    dent = vvsfs_find_entry(dir, &dentry->d_name, &bh);
+    if (IS_ERR(dent))
+    {
+        ret = ERR_CAST(dent);
+        goto out;
+    }
+    if (dent)
+    {
+        ino = dent->inode_number;
+        brelse(bh);
+        inode = vvsfs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode))
+        {
+            ret = ERR_CAST(inode);
+            goto out;
+        }
+    }
+    d_add(dentry, inode);
+
+out:
+    trace_vvsfs_lookup(dir, dentry, ino, PTR_ERR_OR_ZERO(ret));
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_LOOKUP, start);
+    return ret;
+}
+
+// vvsfs_group_bits - the objects tracked by group g
+static inline unsigned long vvsfs_group_bits(struct vvsfs_bitmap *map,
+                                             unsigned long g)
+{
+    return min_t(unsigned long, map->per_block, map->bits - g * map->per_block);
+}
+
+// vvsfs_group_count - count the clear bits of group g
+static long vvsfs_group_count(struct vvsfs_bitmap *map, unsigned long g)
+{
+    unsigned long b, nbits = vvsfs_group_bits(map, g);
+    unsigned long used;
+
+    used = memweight(map->bh[g]->b_data, nbits / 8);
+    for (b = nbits & ~7UL; b < nbits; b++)
+        used += test_bit_le(b, map->bh[g]->b_data);
+    return nbits - used;
+}
+
+// vvsfs_bitmap_load - read and pin the blocks of an allocation bitmap. free
+//                     is the saved count of clear bits if it can be trusted,
+//                     in which case the groups are counted as they are first
+//                     used; otherwise (free < 0) every group is counted now.
+static int vvsfs_bitmap_load(struct super_block *sb, struct vvsfs_bitmap *map,
+                             unsigned long start, unsigned long blocks,
+                             unsigned long bits, long free)
+{
+    unsigned long k;
+    long total = 0;
+    int cpu, err;
+
+    err = percpu_counter_init(&map->free, 0, GFP_KERNEL);
+    if (err)
+        return err;
+    map->blocks = blocks;
+    map->bits = bits;
+    map->per_block = VVSFS_BITS_PER_BLOCK(sb);
+    map->bh = kcalloc(blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    map->groups = kcalloc(blocks, sizeof(struct vvsfs_group), GFP_KERNEL);
+    map->cpu_group = alloc_percpu(unsigned int);
+    if (!map->bh || !map->groups || !map->cpu_group)
+        return -ENOMEM;
+
+    // CPUs start out in different groups
+    for_each_possible_cpu(cpu)
+        *per_cpu_ptr(map->cpu_group, cpu) = cpu % blocks;
+
+    for (k = 0; k < blocks; k++)
+    {
+        map->bh[k] = vvsfs_bread(sb, start + k);
+        if (!map->bh[k])
+            return -EIO;
+        spin_lock_init(&map->groups[k].lock);
+        map->groups[k].free = -1;
+        if (free < 0)
+        {
+            map->groups[k].free = vvsfs_group_count(map, k);
+            total += map->groups[k].free;
+        }
+    }
+    percpu_counter_set(&map->free, free < 0 ? total : free);
+    return 0;
+}
+
+static inline int vvsfs_bitmap_test(struct vvsfs_bitmap *map, unsigned long bit)
+{
+    return test_bit_le(bit % map->per_block, map->bh[bit / map->per_block]->b_data);
+}
+
+// vvsfs_bitmap_write - write the bitmap blocks covering bits first..last back
+//                      to the device
+static void vvsfs_bitmap_write(struct super_block *sb, struct vvsfs_bitmap *map,
+                               unsigned long first, unsigned long last)
+{
+    unsigned long k;
+
+    for (k = first / map->per_block; k <= last / map->per_block; k++)
+        vvsfs_dirty_metadata(sb, map->bh[k]);
+}
+
+// vvsfs_bitmap_sync - write out the dirty blocks of a bitmap, waiting for
+//                     them if wait is set
+static int vvsfs_bitmap_sync(struct vvsfs_bitmap *map, int wait)
+{
+    unsigned long k;
+    int err = 0;
+
+    for (k = 0; k < map->blocks; k++)
+    {
+        if (!buffer_dirty(map->bh[k]))
+            continue;
+        if (!wait)
+        {
+            write_dirty_buffer(map->bh[k], 0);
+            continue;
+        }
+        if (sync_dirty_buffer(map->bh[k]))
+            err = -EIO;
+    }
+    return err;
+}
+
+// vvsfs_group_alloc - claim a run of up to *count clear bits in group g,
+//                     starting at goal (an offset in the group) if that bit
+//                     is free and otherwise at the group's first free bit.
+//                     Returns the first bit and sets *count, or returns
+//                     map->bits if the group is full.
+static unsigned long vvsfs_group_alloc(struct vvsfs_bitmap *map,
+                                       unsigned long g, unsigned long goal,
+                                       unsigned long *count)
+{
+    struct vvsfs_group *grp = &map->groups[g];
+    unsigned long nbits = vvsfs_group_bits(map, g);
+    void *data = map->bh[g]->b_data;
+    unsigned long first, len;
+
+    // full groups are passed over without taking their lock
+    if (!READ_ONCE(grp->free))
+        return map->bits;
+
+    spin_lock(&grp->lock);
+    if (grp->free < 0)
+        grp->free = vvsfs_group_count(map, g);
+    if (goal < nbits && !test_bit_le(goal, data))
+        first = goal;
+    else
+    {
+        first = find_next_zero_bit_le(data, nbits, grp->hint);
+        grp->hint = first;
+        if (first >= nbits)
+        {
+            spin_unlock(&grp->lock);
+            return map->bits;
+        }
+    }
+
+    for (len = 0; len < *count && first + len < nbits; len++)
+    {
+        if (test_bit_le(first + len, data))
+            break;
+        __set_bit_le(first + len, data);
+    }
+    if (first == grp->hint)
+        grp->hint = first + len;
+    grp->free -= len;
+    spin_unlock(&grp->lock);
+    percpu_counter_sub(&map->free, len);
+
+    *count = len;
+    return g * map->per_block + first;
+}
+
+// vvsfs_bitmap_alloc - claim a run of up to *count clear bits, starting at
+//                      goal if that bit is free and otherwise in goal's
+//                      allocation group. With no goal (goal >= map->bits),
+//                      or when that group is full, the search starts in the
+//                      group this CPU last allocated from, so CPUs spread
+//                      over the groups instead of contending for one. Runs
+//                      never cross a group. Returns the first bit and sets
+//                      *count to the run length, or returns map->bits when
+//                      the bitmap is full.
+static unsigned long vvsfs_bitmap_alloc(struct super_block *sb,
+                                        struct vvsfs_bitmap *map,
+                                        unsigned long goal,
+                                        unsigned long *count)
+{
+    unsigned long want = *count, bit = map->bits, start, g, k;
+
+    if (goal < map->bits)
+        bit = vvsfs_group_alloc(map, goal / map->per_block,
+                                goal % map->per_block, count);
+    if (bit >= map->bits)
+    {
+        start = this_cpu_read(*map->cpu_group);
+        for (k = 0; k < map->blocks; k++)
+        {
+            g = (start + k) % map->blocks;
+            *count = want;
+            bit = vvsfs_group_alloc(map, g, ~0UL, count);
+            if (bit < map->bits)
+            {
+                if (k)
+                    this_cpu_write(*map->cpu_group, g);
+                break;
+            }
+        }
+    }
+    if (bit >= map->bits)
+    {
+        vvsfs_stat_add(sb, VVSFS_STAT_ALLOC_FAIL, 1);
+        trace_vvsfs_alloc(sb, map == &VVSFS_SB(sb)->s_imap, goal, want,
+                          map->bits, 0);
+        return map->bits;
+    }
+
+    vvsfs_bitmap_write(sb, map, bit, bit + *count - 1);
+    trace_vvsfs_alloc(sb, map == &VVSFS_SB(sb)->s_imap, goal, want, bit, *count);
+    return bit;
+}
+
+// vvsfs_bitmap_clear - clear count bits starting at first, a group at a
+//                      time, in memory only
+static void vvsfs_bitmap_clear(struct vvsfs_bitmap *map, unsigned long first,
+                               unsigned long count)
+{
+    struct vvsfs_group *grp;
+    unsigned long g, off, n, k, freed;
+    void *data;
+
+    while (count)
+    {
+        g = first / map->per_block;
+        grp = &map->groups[g];
+        data = map->bh[g]->b_data;
+        off = first % map->per_block;
+        n = min(count, map->per_block - off);
+
+        spin_lock(&grp->lock);
+        if (grp->free < 0)
+            grp->free = vvsfs_group_count(map, g);
+        freed = 0;
+        for (k = off; k < off + n; k++)
+            if (__test_and_clear_bit_le(k, data))
+                freed++;
+        grp->free += freed;
+        if (off < grp->hint)
+            grp->hint = off;
+        spin_unlock(&grp->lock);
+        percpu_counter_add(&map->free, freed);
+        first += n;
+        count -= n;
+    }
+}
+
+// vvsfs_bitmap_free - clear count bits starting at first
+static void vvsfs_bitmap_free(struct super_block *sb, struct vvsfs_bitmap *map,
+                              unsigned long first, unsigned long count)
+{
+    vvsfs_bitmap_clear(map, first, count);
+    vvsfs_bitmap_write(sb, map, first, first + count - 1);
+}
+
+// vvsfs_empty_inode - claims a free inode for a new inode of type mode in
+//                     dir (returns -1 if unable to find one). Files go in
+//                     the allocation group of their directory; directories
+//                     are spread over the groups by the per-CPU hints.
+static int vvsfs_empty_inode(struct super_block *sb, const struct inode *dir,
+                             umode_t mode)
+{
+    struct vvsfs_bitmap *map = &VVSFS_SB(sb)->s_imap;
+    unsigned long count = 1;
+    unsigned long inum;
+
+    inum = vvsfs_bitmap_alloc(sb, map, S_ISDIR(mode) ? ~0UL : dir->i_ino, &count);
+    if (inum >= map->bits)
+        return -1;
+    return inum;
+}
+
+// vvsfs_free_inode - release an inode number back to the bitmap
+static void vvsfs_free_inode(struct super_block *sb, int inum)
+{
+    vvsfs_bitmap_free(sb, &VVSFS_SB(sb)->s_imap, inum, 1);
+}
+
+// vvsfs_new_blocks - allocate up to *count contiguous data blocks, preferring
+//                    to start at block goal (0 for none). Returns the first
+//                    block and sets *count, or returns 0 when the device is
+//                    full.
+static sector_t vvsfs_new_blocks(struct super_block *sb, sector_t goal,
+                                 unsigned long *count)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long bit;
+
+    bit = vvsfs_bitmap_alloc(sb, &sbi->s_bmap,
+                             goal >= sbi->s_data_start ? goal - sbi->s_data_start : ~0UL,
+                             count);
+    if (bit >= sbi->s_bmap.bits)
+        return 0;
+    return sbi->s_data_start + bit;
+}
+
+// vvsfs_data_goal - where the first block of inode ino should go: the data
+//                   group that lies as far through the data area as the
+//                   inode's group lies through the inode table
+static sector_t vvsfs_data_goal(struct super_block *sb, unsigned long ino)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long g;
+
+    g = ino / sbi->s_imap.per_block * sbi->s_bmap.blocks / sbi->s_imap.blocks;
+    return sbi->s_data_start + g * sbi->s_bmap.per_block;
+}
+
+// vvsfs_refcount_bread - read the refcount table block that holds the count
+//                        of data block block, and set *idx to its slot
+static struct buffer_head *vvsfs_refcount_bread(struct super_block *sb,
+                                                sector_t block,
+                                                unsigned long *idx)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long d = block - sbi->s_data_start;
+
+    *idx = d % VVSFS_COUNTS_PER_BLOCK(sb);
+    return vvsfs_bread(sb, sbi->s_refcount_start + d / VVSFS_COUNTS_PER_BLOCK(sb));
+}
+
+// vvsfs_refcount_run - how many of the count data blocks from block are
+//                      shared the same way as the first (*shared says how),
+//                      stopping at the end of a refcount table block. If
+//                      drop is set, shared blocks lose a reference. Returns
+//                      0 if the table cannot be read. The counts in a table
+//                      block are read and changed under its buffer lock.
+//                      The caller holds a handle if drop is set.
+static unsigned long vvsfs_refcount_run(struct super_block *sb, sector_t block,
+                                        unsigned long count, int drop,
+                                        int *shared)
+{
+    struct buffer_head *bh;
+    unsigned long idx, n;
+    __u16 *counts;
+
+    bh = vvsfs_refcount_bread(sb, block, &idx);
+    if (!bh)
+        return 0;
+    counts = (__u16 *)bh->b_data;
+    count = min(count, VVSFS_COUNTS_PER_BLOCK(sb) - idx);
+    lock_buffer(bh);
+    *shared = counts[idx] != 0;
+    for (n = 0; n < count && (counts[idx + n] != 0) == *shared; n++)
+        if (drop && *shared)
+            counts[idx + n]--;
+    unlock_buffer(bh);
+    if (drop && *shared)
+        vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+    return n;
+}
+
+// vvsfs_shared_blocks - how many of the count data blocks from block are
+//                       shared the same way as the first; *shared says how
+static unsigned long vvsfs_shared_blocks(struct super_block *sb, sector_t block,
+                                         unsigned long count, int *shared)
+{
+    unsigned long n;
+
+    n = vvsfs_refcount_run(sb, block, count, 0, shared);
+    // a block whose count cannot be read is treated as shared, so it is
+    // copied rather than written over
+    if (!n)
+    {
+        *shared = 1;
+        n = 1;
+    }
+    return n;
+}
+
+// vvsfs_share_blocks - add a reference to each of up to count data blocks
+//                      from block, stopping at the end of a refcount table
+//                      block, for a file that is about to map them too.
+//                      Returns the blocks that gained a reference. Nothing
+//                      changes if any of them is at VVSFS_REFCOUNT_MAX
+//                      (-EMLINK) or the table cannot be read (-EIO).
+static long vvsfs_share_blocks(struct super_block *sb, sector_t block,
+                               unsigned long count)
+{
+    struct buffer_head *bh;
+    unsigned long idx, k;
+    __u16 *counts;
+
+    bh = vvsfs_refcount_bread(sb, block, &idx);
+    if (!bh)
+        return -EIO;
+    counts = (__u16 *)bh->b_data;
+    count = min(count, VVSFS_COUNTS_PER_BLOCK(sb) - idx);
+    // check every count first, then raise them
+    lock_buffer(bh);
+    for (k = 0; k < count && counts[idx + k] < VVSFS_REFCOUNT_MAX; k++)
+        ;
+    if (k == count)
+        for (k = 0; k < count; k++)
+            counts[idx + k]++;
+    unlock_buffer(bh);
+    if (k < count)
+    {
+        brelse(bh);
+        return -EMLINK;
+    }
+    vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+    return count;
+}
+
+// vvsfs_free_blocks - release count data blocks starting at block. Blocks
+//                     still shared with another file only lose a reference.
+//                     The refcount table is only looked at if reflink is
+//                     set (the file has VVSFS_INODE_REFLINK), as blocks of
+//                     a file that has never been remapped are its own.
+static void vvsfs_free_blocks(struct super_block *sb, sector_t block,
+                              unsigned long count, int reflink)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long n;
+    int shared;
+
+    if (block < sbi->s_data_start ||
+        block - sbi->s_data_start + count > sbi->s_bmap.bits)
+    {
+        printk("vvsfs - freeing blocks outside the data area : %llu\n",
+               (unsigned long long)block);
+        return;
+    }
+    if (!reflink)
+    {
+        vvsfs_bitmap_free(sb, &sbi->s_bmap, block - sbi->s_data_start, count);
+        return;
+    }
+
+    for (; count; block += n, count -= n)
+    {
+        n = vvsfs_refcount_run(sb, block, count, 1, &shared);
+        if (!n)
+        {
+            // better to leak blocks than to free one another file uses
+            printk("vvsfs - unable to read the refcount of block %llu\n",
+                   (unsigned long long)block);
+            break;
+        }
+        if (!shared)
+            vvsfs_bitmap_free(sb, &sbi->s_bmap, block - sbi->s_data_start, n);
+    }
+}
+
+// vvsfs_free_meta - release count blocks that held metadata: directory
+//                   blocks or an extent block, which are never shared.
+//                   Their buffers are dropped unwritten. With a journal
+//                   they are revoked, and only become free for reuse once
+//                   the transaction freeing them has committed. The caller
+//                   holds a handle.
+static void vvsfs_free_meta(struct super_block *sb, sector_t block,
+                            unsigned long count)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_journal *j = sbi->s_journal;
+    struct buffer_head *bh;
+    unsigned long first = block - sbi->s_data_start, k;
+
+    if (block < sbi->s_data_start || first + count > sbi->s_bmap.bits)
+    {
+        printk("vvsfs - freeing blocks outside the data area : %llu\n",
+               (unsigned long long)block);
+        return;
+    }
+
+    for (k = 0; k < count; k++)
+    {
+        bh = sb_find_get_block(sb, block + k);
+        if (!bh)
+            continue;
+        if (j)
+            vvsfs_journal_forget(j, bh);
+        bforget(bh);
+    }
+    // the bitmap block joins the transaction, so that its commit can clear
+    // the blocks in its copy
+    if (j)
+    {
+        vvsfs_journal_defer_free(j, block, count);
+        vvsfs_bitmap_write(sb, &sbi->s_bmap, first, first + count - 1);
+    }
+    else
+        vvsfs_bitmap_free(sb, &sbi->s_bmap, first, count);
+}
+
+// vvsfs_free_file_blocks - release count blocks of inode ei from block; those
+//                          of a directory hold metadata
+static void vvsfs_free_file_blocks(struct super_block *sb,
+                                   struct vvsfs_inode_info *ei, sector_t block,
+                                   unsigned long count)
+{
+    if (S_ISDIR(ei->vfs_inode.i_mode))
+        vvsfs_free_meta(sb, block, count);
+    else
+        vvsfs_free_blocks(sb, block, count, ei->i_flags & VVSFS_INODE_REFLINK);
+}
+
+// vvsfs_getblk_zero - get the buffer of a freshly allocated block, zeroed
+static struct buffer_head *vvsfs_getblk_zero(struct super_block *sb,
+                                             sector_t block)
+{
+    struct buffer_head *bh = sb_getblk(sb, block);
+
+    if (!bh)
+        return NULL;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+// vvsfs_write_extent_block - store the extents that do not fit in the inode
+//                            in its chain of overflow blocks, filling each in
+//                            turn, and allocate or free overflow blocks as
+//                            the list grows and shrinks. Only blocks whose
+//                            contents change are rewritten, so an extent
+//                            added at the end of a long list costs one block.
+static int vvsfs_write_extent_block(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int per = VVSFS_EXTENTS_PER_BLOCK(sb->s_blocksize);
+    unsigned int have = 0, need = 0, k, n;
+    sector_t blocks[VVSFS_EXTENT_BLOCKS];
+    struct vvsfs_extent_block *eb;
+    struct vvsfs_extent *ext;
+    struct buffer_head *bh;
+    unsigned long one;
+    __u32 next;
+    int changed;
+
+    if (ei->i_extent_count > VVSFS_N_EXTENTS)
+        need = DIV_ROUND_UP(ei->i_extent_count - VVSFS_N_EXTENTS, per);
+
+    // the chain as it stands
+    for (next = ei->i_extent_block; next && have < VVSFS_EXTENT_BLOCKS; have++)
+    {
+        blocks[have] = next;
+        bh = vvsfs_bread(sb, next);
+        if (!bh)
+            return -EIO;
+        next = ((struct vvsfs_extent_block *)bh->b_data)->eb_next;
+        brelse(bh);
+    }
+
+    // the new blocks are all allocated before anything changes
+    for (k = have; k < need; k++)
+    {
+        one = 1;
+        blocks[k] = vvsfs_new_blocks(sb, k ? blocks[k - 1] :
+                                     ei->i_ext[VVSFS_N_EXTENTS - 1].e_pblk, &one);
+        if (!blocks[k])
+        {
+            while (k-- > have)
+                vvsfs_free_blocks(sb, blocks[k], 1, 0);
+            return -ENOSPC;
+        }
+        ei->i_blocks++;
+    }
+    if (need)
+        ei->i_extent_block = blocks[0];
+
+    for (k = 0; k < need; k++)
+    {
+        n = min_t(unsigned int, ei->i_extent_count - VVSFS_N_EXTENTS - k * per, per);
+        ext = ei->i_ext + VVSFS_N_EXTENTS + k * per;
+        next = k + 1 < need ? blocks[k + 1] : 0;
+        bh = k < have ? vvsfs_bread(sb, blocks[k]) : vvsfs_getblk_zero(sb, blocks[k]);
+        if (!bh)
+            return -EIO;
+        eb = (struct vvsfs_extent_block *)bh->b_data;
+        changed = k >= have || eb->eb_count != n || eb->eb_next != next ||
+                  memcmp(eb->eb_extents, ext, n * sizeof(struct vvsfs_extent));
+        if (changed)
+        {
+            eb->eb_count = n;
+            eb->eb_next = next;
+            memcpy(eb->eb_extents, ext, n * sizeof(struct vvsfs_extent));
+            vvsfs_dirty_metadata(sb, bh);
+        }
+        brelse(bh);
+    }
+
+    for (k = need; k < have; k++)
+    {
+        vvsfs_free_meta(sb, blocks[k], 1);
+        ei->i_blocks--;
+    }
+    if (!need)
+        ei->i_extent_block = 0;
+    return 0;
+}
+
+// vvsfs_commit_extents - write out a changed extent list and the inode
+static int vvsfs_commit_extents(struct inode *inode)
+{
+    int err;
+
+    err = vvsfs_write_extent_block(inode);
+    inode->i_blocks = vvsfs_sectors(inode->i_sb, VVSFS_I(inode)->i_blocks);
+    if (!err)
+        err = vvsfs_update_inode(inode);
+    return err;
+}
+
+// vvsfs_tail_check - whether bh holds a sane tail block. The caller holds
+//                    the buffer lock.
+static int vvsfs_tail_check(struct super_block *sb, struct buffer_head *bh)
+{
+    struct vvsfs_tail_block *tb = (struct vvsfs_tail_block *)bh->b_data;
+    struct vvsfs_tail_slot *ts;
+    unsigned int table = sizeof(struct vvsfs_tail_block), k;
+
+    if (tb->tb_magic == VVSFS_TAIL_MAGIC)
+    {
+        table += tb->tb_count * sizeof(struct vvsfs_tail_slot);
+        for (k = 0; k < tb->tb_count && table <= sb->s_blocksize; k++)
+        {
+            ts = &tb->tb_slots[k];
+            if (ts->ts_ino && (ts->ts_off < table || ts->ts_off + ts->ts_len > sb->s_blocksize))
+                break;
+        }
+        if (k == tb->tb_count && table <= sb->s_blocksize)
+            return 1;
+    }
+    printk("vvsfs - corrupt tail block %llu\n", (unsigned long long)bh->b_blocknr);
+    return 0;
+}
+
+// vvsfs_tail_slot - the slot of inode ino in tail block tb, or NULL
+static struct vvsfs_tail_slot *vvsfs_tail_slot(struct vvsfs_tail_block *tb,
+                                               unsigned long ino)
+{
+    int k;
+
+    for (k = 0; k < tb->tb_count; k++)
+        if (tb->tb_slots[k].ts_ino == ino)
+            return &tb->tb_slots[k];
+    return NULL;
+}
+
+// vvsfs_tail_pack - move the tails of a tail block up against its end, so
+//                   that its free space is in one piece
+static void vvsfs_tail_pack(struct super_block *sb, struct vvsfs_tail_block *tb)
+{
+    struct vvsfs_tail_slot *ts, *next;
+    unsigned int end = sb->s_blocksize, top = sb->s_blocksize;
+    int k;
+
+    // the tails go highest first, so each only moves up over free space
+    for (;;)
+    {
+        next = NULL;
+        for (k = 0; k < tb->tb_count; k++)
+        {
+            ts = &tb->tb_slots[k];
+            if (ts->ts_ino && ts->ts_off < top && (!next || ts->ts_off > next->ts_off))
+                next = ts;
+        }
+        if (!next)
+            break;
+        top = next->ts_off;
+        end -= next->ts_len;
+        memmove((char *)tb + end, (char *)tb + next->ts_off, next->ts_len);
+        next->ts_off = end;
+    }
+}
+
+// vvsfs_tail_fit - make room for len bytes of inode ino in tail block tb,
+//                  taking over any slot ino already has there, or return
+//                  NULL if they do not fit. The caller holds the buffer
+//                  lock and fills in the tail.
+static struct vvsfs_tail_slot *vvsfs_tail_fit(struct super_block *sb,
+                                              struct vvsfs_tail_block *tb,
+                                              unsigned long ino, unsigned int len)
+{
+    struct vvsfs_tail_slot *ts;
+    unsigned int table, used = 0, low = sb->s_blocksize;
+    int k, free = -1;
+
+    for (k = 0; k < tb->tb_count; k++)
+    {
+        ts = &tb->tb_slots[k];
+        if (ts->ts_ino && ts->ts_ino != ino)
+        {
+            used += ts->ts_len;
+            low = min_t(unsigned int, low, ts->ts_off);
+        }
+        else if (free < 0 || ts->ts_ino == ino)
+            free = k;
+    }
+    table = sizeof(struct vvsfs_tail_block) +
+            (tb->tb_count + (free < 0)) * sizeof(struct vvsfs_tail_slot);
+    if (table + used + len > sb->s_blocksize)
+        return NULL;
+
+    // the tails are packed before the table grows over the space below them
+    if (table + len > low)
+    {
+        if (free >= 0)
+            tb->tb_slots[free].ts_ino = 0;
+        vvsfs_tail_pack(sb, tb);
+        low = sb->s_blocksize - used;
+    }
+    if (free < 0)
+        free = tb->tb_count++;
+    ts = &tb->tb_slots[free];
+    ts->ts_ino = ino;
+    ts->ts_off = low - len;
+    ts->ts_len = len;
+    return ts;
+}
+
+// vvsfs_tail_read - copy the tail of inode into buf, zero filled to size
+//                   bytes. The caller holds i_meta_sem.
+static int vvsfs_tail_read(struct inode *inode, char *buf, size_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_tail_slot *ts = NULL;
+    struct buffer_head *bh;
+    size_t len = 0;
+
+    bh = vvsfs_bread(sb, VVSFS_I(inode)->i_extent_block);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    if (vvsfs_tail_check(sb, bh))
+        ts = vvsfs_tail_slot((struct vvsfs_tail_block *)bh->b_data, inode->i_ino);
+    if (ts)
+    {
+        len = min_t(size_t, ts->ts_len, size);
+        memcpy(buf, bh->b_data + ts->ts_off, len);
+    }
+    unlock_buffer(bh);
+    brelse(bh);
+    if (!ts)
+    {
+        printk("vvsfs - missing tail of inode %lu\n", inode->i_ino);
+        return -EIO;
+    }
+    memset(buf + len, 0, size - len);
+    return 0;
+}
+
+// vvsfs_tail_drop - free the slot of inode ino in tail block block, and the
+//                   block itself once it holds no tails. A missing slot is
+//                   not an error, so that freeing an orphan can be redone.
+//                   The caller holds a handle.
+static int vvsfs_tail_drop(struct super_block *sb, sector_t block, unsigned long ino)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_tail_block *tb;
+    struct vvsfs_tail_slot *ts;
+    struct buffer_head *bh;
+    int err = 0;
+
+    mutex_lock(&sbi->s_tail_mutex);
+    bh = vvsfs_bread(sb, block);
+    if (!bh)
+    {
+        err = -EIO;
+        goto out;
+    }
+    tb = (struct vvsfs_tail_block *)bh->b_data;
+    lock_buffer(bh);
+    if (!vvsfs_tail_check(sb, bh))
+    {
+        unlock_buffer(bh);
+        brelse(bh);
+        err = -EIO;
+        goto out;
+    }
+    ts = vvsfs_tail_slot(tb, ino);
+    if (ts)
+        ts->ts_ino = 0;
+    while (tb->tb_count && !tb->tb_slots[tb->tb_count - 1].ts_ino)
+        tb->tb_count--;
+    unlock_buffer(bh);
+
+    if (tb->tb_count)
+    {
+        if (ts)
+            vvsfs_dirty_metadata(sb, bh);
+        brelse(bh);
+        // a block with room again takes new tails if none has been chosen
+        if (ts && !sbi->s_tail)
+            sbi->s_tail = block;
+        goto out;
+    }
+    brelse(bh);
+    if (sbi->s_tail == block)
+        sbi->s_tail = 0;
+    vvsfs_free_meta(sb, block, 1);
+out:
+    mutex_unlock(&sbi->s_tail_mutex);
+    return err;
+}
+
+// vvsfs_tail_write - store the len bytes of data as the tail of inode, in
+//                    place in its tail block if they fit there, or else in
+//                    the tail block new tails go to, or a new one. The
+//                    caller holds a handle and i_meta_sem for writing.
+static int vvsfs_tail_write(struct inode *inode, const char *data, unsigned int len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct vvsfs_tail_block *tb;
+    struct vvsfs_tail_slot *ts = NULL;
+    struct buffer_head *bh;
+    unsigned long one = 1;
+    sector_t old = (ei->i_flags & VVSFS_INODE_TAIL) ? ei->i_extent_block : 0;
+    sector_t block;
+
+    if (len > VVSFS_MAXTAIL(sb->s_blocksize))
+        return -EFBIG;
+    // the slot is only written while this inode holds it, so the block
+    // cannot be freed under it
+    if (old)
+    {
+        bh = vvsfs_bread(sb, old);
+        if (!bh)
+            return -EIO;
+        lock_buffer(bh);
+        if (!vvsfs_tail_check(sb, bh))
+        {
+            unlock_buffer(bh);
+            brelse(bh);
+            return -EIO;
+        }
+        ts = vvsfs_tail_fit(sb, (struct vvsfs_tail_block *)bh->b_data, inode->i_ino, len);
+        if (ts)
+            memcpy(bh->b_data + ts->ts_off, data, len);
+        unlock_buffer(bh);
+        if (ts)
+            vvsfs_dirty_metadata(sb, bh);
+        brelse(bh);
+        if (ts)
+            return 0;
+    }
+
+    mutex_lock(&sbi->s_tail_mutex);
+    block = sbi->s_tail;
+    bh = block && block != old ? vvsfs_bread(sb, block) : NULL;
+    if (bh)
+    {
+        lock_buffer(bh);
+        if (vvsfs_tail_check(sb, bh))
+            ts = vvsfs_tail_fit(sb, (struct vvsfs_tail_block *)bh->b_data, inode->i_ino, len);
+        if (!ts)
+        {
+            unlock_buffer(bh);
+            brelse(bh);
+        }
+    }
+    if (!ts)
+    {
+        block = vvsfs_new_blocks(sb, vvsfs_data_goal(sb, inode->i_ino), &one);
+        bh = block ? vvsfs_getblk_zero(sb, block) : NULL;
+        if (!bh)
+        {
+            if (block)
+                vvsfs_free_meta(sb, block, 1);
+            mutex_unlock(&sbi->s_tail_mutex);
+            return block ? -EIO : -ENOSPC;
+        }
+        lock_buffer(bh);
+        tb = (struct vvsfs_tail_block *)bh->b_data;
+        tb->tb_magic = VVSFS_TAIL_MAGIC;
+        ts = vvsfs_tail_fit(sb, tb, inode->i_ino, len);
+        sbi->s_tail = block;
+    }
+    memcpy(bh->b_data + ts->ts_off, data, len);
+    unlock_buffer(bh);
+    vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+    mutex_unlock(&sbi->s_tail_mutex);
+
+    if (old)
+        vvsfs_tail_drop(sb, old, inode->i_ino);
+    ei->i_flags |= VVSFS_INODE_TAIL;
+    ei->i_extent_block = block;
+    return 0;
+}
+
+// vvsfs_tail_truncate - cut the tail of inode down to size bytes, moving it
+//                       back into the inode if it now fits there. The
+//                       caller holds a handle and i_meta_sem for writing.
+static int vvsfs_tail_truncate(struct inode *inode, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct vvsfs_tail_slot *ts = NULL;
+    struct buffer_head *bh;
+    int err;
+
+    if (size <= MAXINLINE)
+    {
+        err = vvsfs_tail_read(inode, ei->i_data, MAXINLINE);
+        if (err)
+            return err;
+        memset(ei->i_data + size, 0, MAXINLINE - size);
+        vvsfs_tail_drop(sb, ei->i_extent_block, inode->i_ino);
+        ei->i_flags &= ~VVSFS_INODE_TAIL;
+        ei->i_extent_block = 0;
+        return 0;
+    }
+
+    // the tail is zero filled past its length when read, so it need only
+    // be cut short
+    bh = vvsfs_bread(sb, ei->i_extent_block);
+    if (!bh)
+        return -EIO;
+    lock_buffer(bh);
+    if (vvsfs_tail_check(sb, bh))
+        ts = vvsfs_tail_slot((struct vvsfs_tail_block *)bh->b_data, inode->i_ino);
+    if (ts && ts->ts_len > size)
+        ts->ts_len = size;
+    unlock_buffer(bh);
+    if (ts)
+        vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+    return ts ? 0 : -EIO;
+}
+
+// vvsfs_map_extent - the device block that holds file block lblk, or 0 if
+//                    lblk is in a hole. *len is set to the number of blocks
+//                    from lblk to the end of the extent, or of the hole, and
+//                    *flags (if flags is not NULL) to the extent's e_flags.
+//                    Directories have no unwritten extents, and unwritten
+//                    blocks are never shared, so only readers and writers
+//                    of file data need the flags.
+static sector_t vvsfs_map_extent(struct vvsfs_inode_info *ei, u32 lblk, u32 *len,
+                                 u32 *flags)
+{
+    struct vvsfs_extent *e;
+    int k;
+
+    for (k = 0; k < ei->i_extent_count; k++)
+    {
+        e = &ei->i_ext[k];
+        if (lblk < e->e_lblk)
+            break;
+        if (lblk < e->e_lblk + e->e_len)
+        {
+            *len = e->e_len - (lblk - e->e_lblk);
+            if (flags)
+                *flags = e->e_flags;
+            return e->e_pblk + (lblk - e->e_lblk);
+        }
+    }
+    *len = (k < ei->i_extent_count ? ei->i_ext[k].e_lblk : U32_MAX) - lblk;
+    if (flags)
+        *flags = 0;
+    return 0;
+}
+
+// vvsfs_extent_goal - where a new block for file block lblk should go: just
+//                     after the extent before it, lined up as if that
+//                     extent ran on, or else the inode's data goal
+static sector_t vvsfs_extent_goal(struct super_block *sb,
+                                  struct vvsfs_inode_info *ei, u32 lblk)
+{
+    struct vvsfs_extent *prev = NULL;
+    int k;
+
+    for (k = 0; k < ei->i_extent_count && ei->i_ext[k].e_lblk < lblk; k++)
+        prev = &ei->i_ext[k];
+    if (prev)
+        return prev->e_pblk + (lblk - prev->e_lblk);
+    return vvsfs_data_goal(sb, ei->vfs_inode.i_ino);
+}
+
+// vvsfs_alloc_extent - allocate device blocks for up to *count file blocks
+//                      from lblk (which must be in a hole, and the run must
+//                      not pass its end), as an extent with e_flags flags.
+//                      The run is placed right after the preceding extent
+//                      where possible so that extent simply grows. Sets
+//                      *count to the blocks allocated and returns the
+//                      first, or 0 if no block is available.
+static sector_t vvsfs_alloc_extent(struct super_block *sb,
+                                   struct vvsfs_inode_info *ei, u32 lblk,
+                                   u32 *count, u32 flags)
+{
+    struct vvsfs_extent *prev = NULL;
+    unsigned long n = *count;
+    sector_t block;
+    int k;
+
+    for (k = 0; k < ei->i_extent_count && ei->i_ext[k].e_lblk < lblk; k++)
+        prev = &ei->i_ext[k];
+
+    block = vvsfs_new_blocks(sb, vvsfs_extent_goal(sb, ei, lblk), &n);
+    if (!block)
+        return 0;
+
+    if (prev && prev->e_lblk + prev->e_len == lblk &&
+        prev->e_pblk + prev->e_len == block && prev->e_flags == flags)
+    {
+        prev->e_len += n;
+    }
+    else
+    {
+        if (vvsfs_extent_room(sb, ei, 1))
+        {
+            vvsfs_free_blocks(sb, block, n, 0);
+            return 0;
+        }
+        memmove(&ei->i_ext[k + 1], &ei->i_ext[k],
+                (ei->i_extent_count - k) * sizeof(struct vvsfs_extent));
+        ei->i_ext[k].e_lblk = lblk;
+        ei->i_ext[k].e_pblk = block;
+        ei->i_ext[k].e_len = n;
+        ei->i_ext[k].e_flags = flags;
+        ei->i_extent_count++;
+    }
+    ei->i_blocks += n;
+    *count = n;
+    return block;
+}
+
+// vvsfs_free_step - how many of the len device blocks ending before block
+//                   end to free in one step: those whose counts share a
+//                   refcount table block. A table block covers part of one
+//                   bitmap block, so a step changes a block of each.
+static u32 vvsfs_free_step(struct super_block *sb, sector_t end, u32 len)
+{
+    unsigned long d = end - 1 - VVSFS_SB(sb)->s_data_start;
+
+    return min_t(unsigned long, len, d % VVSFS_COUNTS_PER_BLOCK(sb) + 1);
+}
+
+// vvsfs_trim_extents - free every block of the file at or past file block
+//                      from, a step at a time from the end. Once the handle
+//                      is running low on credits it stops with -EAGAIN,
+//                      having taken at least one step; the caller writes
+//                      the extents so far and calls again in a new handle.
+static int vvsfs_trim_extents(struct super_block *sb,
+                              struct vvsfs_inode_info *ei, u32 from)
+{
+    struct vvsfs_extent *e;
+    u32 keep, n;
+    int first = 1;
+
+    while (ei->i_extent_count > 0)
+    {
+        e = &ei->i_ext[ei->i_extent_count - 1];
+        if (e->e_lblk + e->e_len <= from)
+            break;
+        if (!first && vvsfs_journal_full(sb))
+            return -EAGAIN;
+        keep = e->e_lblk < from ? from - e->e_lblk : 0;
+        n = vvsfs_free_step(sb, e->e_pblk + e->e_len, e->e_len - keep);
+        vvsfs_free_file_blocks(sb, ei, e->e_pblk + e->e_len - n, n);
+        ei->i_blocks -= n;
+        e->e_len -= n;
+        if (!e->e_len)
+            ei->i_extent_count--;
+        first = 0;
+    }
+    return 0;
+}
+
+// vvsfs_punch_extents - unmap file blocks from..from+count-1, leaving a
+//                       hole, and free their blocks if free is set (the
+//                       caller maps them again otherwise). Punching out the
+//                       middle of an extent splits it, which needs a free
+//                       extent slot (-ENOSPC if there is none; nothing is
+//                       changed). The blocks are freed a step at a time
+//                       from the end, and as vvsfs_trim_extents, the punch
+//                       stops with -EAGAIN once the handle runs low; the
+//                       caller calls again with the same range, and only
+//                       the first step can split an extent.
+static int vvsfs_punch_extents(struct super_block *sb, struct vvsfs_inode_info *ei,
+                               u32 from, u32 count, int free)
+{
+    struct vvsfs_extent *e;
+    u32 end = from + count, pe, n, head, tail;
+    int k, err, first = 1;
+
+    while (end > from)
+    {
+        // the last extent with blocks left to punch
+        for (k = ei->i_extent_count - 1; k >= 0; k--)
+            if (ei->i_ext[k].e_lblk < end)
+                break;
+        if (k < 0)
+            break;
+        e = &ei->i_ext[k];
+        if (e->e_lblk + e->e_len <= from)
+            break;
+        pe = min(end, e->e_lblk + e->e_len);
+        n = pe - max(from, e->e_lblk);
+        if (free)
+        {
+            if (!first && vvsfs_journal_full(sb))
+                return -EAGAIN;
+            n = vvsfs_free_step(sb, e->e_pblk + (pe - e->e_lblk), n);
+        }
+        head = pe - n - e->e_lblk;
+        tail = e->e_lblk + e->e_len - pe;
+        if (head && tail)
+        {
+            err = vvsfs_extent_room(sb, ei, 1);
+            if (err)
+                return err;
+            e = &ei->i_ext[k];
+            memmove(&ei->i_ext[k + 1], &ei->i_ext[k],
+                    (ei->i_extent_count - k) * sizeof(struct vvsfs_extent));
+            ei->i_extent_count++;
+            ei->i_ext[k + 1].e_lblk = pe;
+            ei->i_ext[k + 1].e_pblk = e->e_pblk + (pe - e->e_lblk);
+            ei->i_ext[k + 1].e_len = tail;
+        }
+
+        if (free)
+            vvsfs_free_file_blocks(sb, ei, e->e_pblk + head, n);
+        ei->i_blocks -= n;
+        if (head)
+        {
+            e->e_len = head;
+        }
+        else if (tail)
+        {
+            e->e_pblk += e->e_len - tail;
+            e->e_lblk = pe;
+            e->e_len = tail;
+        }
+        else
+        {
+            memmove(&ei->i_ext[k], &ei->i_ext[k + 1],
+                    (ei->i_extent_count - k - 1) * sizeof(struct vvsfs_extent));
+            ei->i_extent_count--;
+        }
+        end = pe - n;
+        first = 0;
+    }
+    return 0;
+}
+
+// vvsfs_extents_restart - write out the extents and inode of a file part
+//                         way through a trim or punch that returned
+//                         -EAGAIN, and carry on in a new handle. The inode
+//                         block is written rather than left dirty, so that
+//                         it commits with the blocks freed so far. The
+//                         caller holds i_meta_sem for writing, which is
+//                         dropped while the handle changes.
+static int vvsfs_extents_restart(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    int err;
+
+    err = vvsfs_write_extent_block(inode);
+    inode->i_blocks = vvsfs_sectors(sb, ei->i_blocks);
+    if (!err)
+        err = vvsfs_write_inode_block(inode, 0);
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_restart(sb);
+    down_write(&ei->i_meta_sem);
+    return err;
+}
+
+// vvsfs_insert_extent - map file blocks lblk..lblk+len-1, which must be a
+//                       hole, to the device blocks from pblk, written or
+//                       with e_flags flags, growing a neighbouring extent
+//                       with the same flags where they line up. -ENOSPC if
+//                       a new extent is needed and there is no slot for it.
+static int vvsfs_insert_extent(struct vvsfs_inode_info *ei, u32 lblk,
+                               sector_t pblk, u32 len, u32 flags)
+{
+    struct vvsfs_extent *prev = NULL, *next = NULL;
+    int k;
+
+    for (k = 0; k < ei->i_extent_count && ei->i_ext[k].e_lblk < lblk; k++)
+        prev = &ei->i_ext[k];
+    if (k < ei->i_extent_count)
+        next = &ei->i_ext[k];
+
+    if (next && next->e_flags != flags)
+        next = NULL;
+    if (prev && prev->e_lblk + prev->e_len == lblk &&
+        prev->e_pblk + prev->e_len == pblk && prev->e_flags == flags)
+    {
+        prev->e_len += len;
+        if (next && lblk + len == next->e_lblk && pblk + len == next->e_pblk)
+        {
+            prev->e_len += next->e_len;
+            memmove(next, next + 1,
+                    (ei->i_extent_count - k - 1) * sizeof(struct vvsfs_extent));
+            ei->i_extent_count--;
+        }
+    }
+    else if (next && lblk + len == next->e_lblk && pblk + len == next->e_pblk)
+    {
+        next->e_lblk = lblk;
+        next->e_pblk = pblk;
+        next->e_len += len;
+    }
+    else
+    {
+        if (ei->i_extent_count == ei->i_extent_room)
+            return -ENOSPC;
+        memmove(&ei->i_ext[k + 1], &ei->i_ext[k],
+                (ei->i_extent_count - k) * sizeof(struct vvsfs_extent));
+        ei->i_ext[k].e_lblk = lblk;
+        ei->i_ext[k].e_pblk = pblk;
+        ei->i_ext[k].e_len = len;
+        ei->i_ext[k].e_flags = flags;
+        ei->i_extent_count++;
+    }
+    ei->i_blocks += len;
+    return 0;
+}
+
+// vvsfs_cow_extent - move up to *len file blocks from lblk, all mapped to
+//                    shared device blocks, to new blocks of their own, and
+//                    drop the file's references to the old ones. The data is
+//                    not copied; the caller either overwrites the blocks
+//                    whole or rewrites them from the page cache. The new
+//                    extent has e_flags flags: a direct write makes it
+//                    unwritten, so that a crash before its data lands
+//                    leaves zeros rather than whatever the blocks held.
+//                    Sets *len to the blocks moved and *block to the first
+//                    new one. The caller holds a handle and i_meta_sem for
+//                    writing.
+static int vvsfs_cow_extent(struct super_block *sb, struct vvsfs_inode_info *ei,
+                            u32 lblk, u32 *len, sector_t *block, u32 flags)
+{
+    unsigned long n = *len;
+    int err;
+
+    // a split by the punch and a new extent for the copy
+    err = vvsfs_extent_room(sb, ei, 2);
+    if (err)
+        return err;
+    *block = vvsfs_new_blocks(sb, vvsfs_extent_goal(sb, ei, lblk), &n);
+    if (!*block)
+        return -ENOSPC;
+    vvsfs_punch_extents(sb, ei, lblk, n, 1);
+    vvsfs_insert_extent(ei, lblk, *block, n, flags);
+    *len = n;
+    return 0;
+}
+
+// vvsfs_convert_extent - mark len file blocks from lblk, mapped to the
+//                        device blocks from block and all in one unwritten
+//                        extent, written, splitting the extent around them
+//                        unless they are the whole of it. The caller holds
+//                        a handle and i_meta_sem for writing.
+static int vvsfs_convert_extent(struct super_block *sb, struct vvsfs_inode_info *ei,
+                                u32 lblk, u32 len, sector_t block)
+{
+    int k, err;
+
+    for (k = 0; k < ei->i_extent_count; k++)
+    {
+        if (ei->i_ext[k].e_lblk == lblk && ei->i_ext[k].e_len == len)
+        {
+            ei->i_ext[k].e_flags = 0;
+            return 0;
+        }
+    }
+    err = vvsfs_extent_room(sb, ei, 2);
+    if (err)
+        return err;
+    vvsfs_punch_extents(sb, ei, lblk, len, 0);
+    vvsfs_insert_extent(ei, lblk, block, len, 0);
+    return 0;
+}
+
+// vvsfs_prealloc_check - clear VVSFS_INODE_PREALLOC once a file has no
+//                        unwritten extent left, so that its writeback goes
+//                        back to mpage. A buffer can only be unwritten while
+//                        the extent under it is. The caller holds i_meta_sem
+//                        for writing, and writes the inode.
+static void vvsfs_prealloc_check(struct vvsfs_inode_info *ei)
+{
+    int k;
+
+    for (k = 0; k < ei->i_extent_count; k++)
+        if (ei->i_ext[k].e_flags & VVSFS_EXTENT_UNWRITTEN)
+            return;
+    ei->i_flags &= ~VVSFS_INODE_PREALLOC;
+}
+
+// vvsfs_convert_range - mark whatever is unwritten among file blocks
+//                       lblk..lblk+count-1 written, once the data written
+//                       to them is on disk
+static int vvsfs_convert_range(struct inode *inode, u32 lblk, u32 count)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    sector_t block;
+    u32 n, flags;
+    int err = 0, changed = 0;
+
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    for (; count && !err; lblk += n, count -= n)
+    {
+        block = vvsfs_map_extent(ei, lblk, &n, &flags);
+        n = min(n, count);
+        if (!block || !(flags & VVSFS_EXTENT_UNWRITTEN))
+            continue;
+        err = vvsfs_convert_extent(sb, ei, lblk, n, block);
+        changed = 1;
+    }
+    if (changed)
+    {
+        int err2;
+
+        vvsfs_prealloc_check(ei);
+        err2 = vvsfs_commit_extents(inode);
+
+        if (!err)
+            err = err2;
+    }
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+    return err;
+}
+
+// vvsfs_dir_bread - read file block lblk of an indexed directory, allocating
+//                   a zeroed block for it when create is set
+static struct buffer_head *vvsfs_dir_bread(struct inode *dir, u32 lblk, int create)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(dir);
+    struct buffer_head *bh;
+    sector_t block;
+    u32 len;
+    int err = 0;
+
+    // blocks are only added under the directory's i_rwsem, held exclusively
+    if (create)
+    {
+        down_write(&ei->i_meta_sem);
+        block = vvsfs_map_extent(ei, lblk, &len, NULL);
+        if (!block)
+        {
+            len = 1;
+            block = vvsfs_alloc_extent(sb, ei, lblk, &len, 0);
+            if (!block)
+                err = -ENOSPC;
+            else
+                err = vvsfs_commit_extents(dir);
+            up_write(&ei->i_meta_sem);
+            if (err)
+                return ERR_PTR(err);
+            bh = vvsfs_getblk_zero(sb, block);
+            return bh ? bh : ERR_PTR(-EIO);
+        }
+        up_write(&ei->i_meta_sem);
+    }
+    else
+    {
+        down_read(&ei->i_meta_sem);
+        block = vvsfs_map_extent(ei, lblk, &len, NULL);
+        up_read(&ei->i_meta_sem);
+    }
+
+    // indexed directories have no holes
+    if (!block)
+        return ERR_PTR(-EIO);
+    bh = vvsfs_bread(sb, block);
+    return bh ? bh : ERR_PTR(-EIO);
+}
+
+// vvsfs_dx_hash - the hash a name is filed under in a directory index. This
+//                 is 32-bit FNV-1a, which unlike the dcache hash is the same
+//                 on every boot.
+static u32 vvsfs_dx_hash(const unsigned char *name, unsigned int len)
+{
+    u32 hash = 2166136261u;
+
+    while (len--)
+    {
+        hash ^= *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// vvsfs_dx_find - the slot of the index map whose hash range covers hash
+static int vvsfs_dx_find(struct vvsfs_dx_root *root, u32 hash)
+{
+    int lo = 1, hi = root->dx_count - 1, mid;
+
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if (root->dx_map[mid].dx_hash <= hash)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return lo - 1;
+}
+
+// vvsfs_dx_root - read and check the index root of a directory
+static struct buffer_head *vvsfs_dx_root(struct inode *dir)
+{
+    struct buffer_head *bh;
+    struct vvsfs_dx_root *root;
+
+    bh = vvsfs_dir_bread(dir, 0, 0);
+    if (IS_ERR(bh))
+        return bh;
+    root = (struct vvsfs_dx_root *)bh->b_data;
+    if (root->dx_magic != VVSFS_DX_MAGIC || root->dx_count == 0 ||
+        root->dx_count > VVSFS_DX_LIMIT(dir->i_sb->s_blocksize) || root->dx_levels > 1)
+    {
+        printk("vvsfs - corrupt directory index in inode %lu\n", dir->i_ino);
+        brelse(bh);
+        return ERR_PTR(-EIO);
+    }
+    return bh;
+}
+
+// vvsfs_dx_map - the index map of an index node
+static inline struct vvsfs_dx_root *vvsfs_dx_map(struct buffer_head *bh)
+{
+    return (struct vvsfs_dx_root *)(bh->b_data + VVSFS_DX_NODE_HEAD);
+}
+
+// vvsfs_dx_node - read and check the index node at file block lblk
+static struct buffer_head *vvsfs_dx_node(struct inode *dir, u32 lblk)
+{
+    struct buffer_head *bh;
+    struct vvsfs_dx_root *node;
+
+    bh = vvsfs_dir_bread(dir, lblk, 0);
+    if (IS_ERR(bh))
+        return bh;
+    node = vvsfs_dx_map(bh);
+    if (node->dx_magic != VVSFS_DX_NODE_MAGIC || node->dx_count == 0 ||
+        node->dx_count > VVSFS_DX_LIMIT(dir->i_sb->s_blocksize - VVSFS_DX_NODE_HEAD))
+    {
+        printk("vvsfs - corrupt directory index in inode %lu\n", dir->i_ino);
+        brelse(bh);
+        return ERR_PTR(-EIO);
+    }
+    return bh;
+}
+
+// vvsfs_dx_leaf - the file block of the leaf whose hash range covers hash
+static int vvsfs_dx_leaf(struct inode *dir, u32 hash, u32 *lblk)
+{
+    struct vvsfs_dx_root *root;
+    struct buffer_head *rbh, *nbh;
+
+    rbh = vvsfs_dx_root(dir);
+    if (IS_ERR(rbh))
+        return PTR_ERR(rbh);
+    root = (struct vvsfs_dx_root *)rbh->b_data;
+    *lblk = root->dx_map[vvsfs_dx_find(root, hash)].dx_block;
+    if (root->dx_levels)
+    {
+        nbh = vvsfs_dx_node(dir, *lblk);
+        if (IS_ERR(nbh))
+        {
+            brelse(rbh);
+            return PTR_ERR(nbh);
+        }
+        root = vvsfs_dx_map(nbh);
+        *lblk = root->dx_map[vvsfs_dx_find(root, hash)].dx_block;
+        brelse(nbh);
+    }
+    brelse(rbh);
+    return 0;
+}
+
+// vvsfs_check_entry - sanity check the entry at offset off of a run of
+//                     entries size bytes long
+static int vvsfs_check_entry(struct inode *dir, struct vvsfs_dir_entry *dent,
+                             unsigned int off, unsigned int size)
+{
+    if (dent->rec_len >= VVSFS_DIR_REC_LEN(dent->name_len) &&
+        !(dent->rec_len & 3) && off + dent->rec_len <= size)
+        return 1;
+    printk("vvsfs - corrupt directory entry in inode %lu at %u\n", dir->i_ino, off);
+    return 0;
+}
+
+static inline int vvsfs_match(struct vvsfs_dir_entry *dent, const struct qstr *name)
+{
+    return dent->inode_number && dent->name_len == name->len &&
+           memcmp(dent->name, name->name, name->len) == 0;
+}
+
+// vvsfs_set_entry - fill in an entry for inode (rec_len is left alone)
+static void vvsfs_set_entry(struct vvsfs_dir_entry *dent, const struct qstr *name,
+                            struct inode *inode)
+{
+    dent->inode_number = inode->i_ino;
+    dent->name_len = name->len;
+    // DT_* is the S_IFMT type shifted down
+    dent->file_type = (inode->i_mode & S_IFMT) >> 12;
+    memcpy(dent->name, name->name, name->len);
+}
+
+// vvsfs_find_entry - find name in a directory. Inline directories are
+//                    scanned in memory; indexed directories cost a read of
+//                    the index root (and index node, if any) and of the
+//                    one leaf that covers the hash of the name, which is
+//                    returned in *bhp (NULL for inline entries). Returns
+//                    NULL if there is no entry.
+static struct vvsfs_dir_entry *vvsfs_find_entry(struct inode *dir,
+                                                const struct qstr *name,
+                                                struct buffer_head **bhp)
+{
+    struct vvsfs_dir_entry *dent;
+    struct buffer_head *bh;
+    unsigned int off;
+    u32 lblk;
+    int err;
+
+    *bhp = NULL;
+    if (!(VVSFS_I(dir)->i_flags & VVSFS_INODE_INDEX))
+    {
+        for (off = 0; off < dir->i_size; off += dent->rec_len)
+        {
+            dent = (struct vvsfs_dir_entry *)(VVSFS_I(dir)->i_data + off);
+            if (!vvsfs_check_entry(dir, dent, off, dir->i_size))
+                return ERR_PTR(-EIO);
+            if (vvsfs_match(dent, name))
+                return dent;
+        }
+        return NULL;
+    }
+
+    err = vvsfs_dx_leaf(dir, vvsfs_dx_hash(name->name, name->len), &lblk);
+    if (err)
+        return ERR_PTR(err);
+
+    bh = vvsfs_dir_bread(dir, lblk, 0);
+    if (IS_ERR(bh))
+        return ERR_CAST(bh);
+    for (off = 0; off < dir->i_sb->s_blocksize; off += dent->rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(bh->b_data + off);
+        if (!vvsfs_check_entry(dir, dent, off, dir->i_sb->s_blocksize))
+        {
+            brelse(bh);
+            return ERR_PTR(-EIO);
+        }
+        if (vvsfs_match(dent, name))
+        {
+            *bhp = bh;
+            return dent;
+        }
+    }
+    brelse(bh);
+    return NULL;
+}
+
+// vvsfs_leaf_insert - put an entry for name in the first gap big enough for
+//                     it in a run of entries size bytes long (a leaf, or
+//                     the inline entries), or return -ENOSPC. Gaps are the
+//                     slack left by removed entries.
+static int vvsfs_leaf_insert(struct inode *dir, char *leaf, unsigned int size,
+                             const struct qstr *name, struct inode *inode)
+{
+    struct vvsfs_dir_entry *dent, *next;
+    unsigned int off, used, need = VVSFS_DIR_REC_LEN(name->len);
+
+    for (off = 0; off < size; off += dent->rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(leaf + off);
+        if (!vvsfs_check_entry(dir, dent, off, size))
+            return -EIO;
+        used = dent->inode_number ? VVSFS_DIR_REC_LEN(dent->name_len) : 0;
+        if (dent->rec_len - used < need)
+            continue;
+        if (used)
+        {
+            // split the slack off the end of this entry
+            next = (struct vvsfs_dir_entry *)(leaf + off + used);
+            next->rec_len = dent->rec_len - used;
+            dent->rec_len = used;
+            dent = next;
+        }
+        vvsfs_set_entry(dent, name, inode);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+// vvsfs_leaf_pack - append an entry to the packed entries of a leaf of size
+//                   bytes that end at off, the last of which starts at
+//                   *last. The new entry takes up the rest of the block.
+//                   Returns the new end.
+static unsigned int vvsfs_leaf_pack(char *leaf, unsigned int size, unsigned int off,
+                                    unsigned int *last, struct vvsfs_dir_entry *dent)
+{
+    unsigned int len = VVSFS_DIR_REC_LEN(dent->name_len);
+
+    // the previous entry now ends where this one starts
+    if (off)
+        ((struct vvsfs_dir_entry *)(leaf + *last))->rec_len = off - *last;
+    memcpy(leaf + off, dent, len);
+    ((struct vvsfs_dir_entry *)(leaf + off))->rec_len = size - off;
+    *last = off;
+    return off + len;
+}
+
+// vvsfs_dx_convert - turn a directory whose inline entries are full into an
+//                    indexed directory, with the old entries in its first leaf
+static int vvsfs_dx_convert(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(dir);
+    struct buffer_head *rbh = NULL, *lbh;
+    struct vvsfs_dir_entry *dent;
+    struct vvsfs_dx_root *root;
+    loff_t size = dir->i_size;
+    unsigned int off, last = 0;
+    char *old;
+    int err;
+
+    old = kmemdup(ei->i_data, MAXINLINE, GFP_KERNEL);
+    if (!old)
+        return -ENOMEM;
+
+    // the extents share their space with the inline entries
+    down_write(&ei->i_meta_sem);
+    ei->i_flags = (ei->i_flags & ~VVSFS_INODE_INLINE) | VVSFS_INODE_INDEX;
+    ei->i_extent_count = 0;
+    up_write(&ei->i_meta_sem);
+
+    rbh = vvsfs_dir_bread(dir, 0, 1);
+    if (IS_ERR(rbh))
+    {
+        err = PTR_ERR(rbh);
+        rbh = NULL;
+        goto undo;
+    }
+    lbh = vvsfs_dir_bread(dir, 1, 1);
+    if (IS_ERR(lbh))
+    {
+        err = PTR_ERR(lbh);
+        goto undo;
+    }
+
+    // the inline entries are packed, so only the last one needs stretching
+    // to the end of the block
+    memcpy(lbh->b_data, old, size);
+    for (off = 0; off < size; off += dent->rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(lbh->b_data + off);
+        last = off;
+    }
+    dent = (struct vvsfs_dir_entry *)(lbh->b_data + last);
+    if (size)
+        dent->rec_len = sb->s_blocksize - last;
+    else
+        dent->rec_len = sb->s_blocksize;
+    vvsfs_dirty_metadata(sb, lbh);
+    brelse(lbh);
+
+    root = (struct vvsfs_dx_root *)rbh->b_data;
+    root->dx_magic = VVSFS_DX_MAGIC;
+    root->dx_count = 1;
+    root->dx_levels = 0;
+    root->dx_map[0].dx_hash = 0;
+    root->dx_map[0].dx_block = 1;
+    vvsfs_dirty_metadata(sb, rbh);
+    brelse(rbh);
+    kfree(old);
+
+    down_write(&ei->i_meta_sem);
+    dir->i_size = 2 * sb->s_blocksize;
+    err = vvsfs_update_inode(dir);
+    up_write(&ei->i_meta_sem);
+    return err;
+
+undo:
+    brelse(rbh);
+    down_write(&ei->i_meta_sem);
+    // two blocks, which the handle has room for
+    while (vvsfs_trim_extents(sb, ei, 0) == -EAGAIN)
+        ;
+    vvsfs_write_extent_block(dir);
+    ei->i_flags = (ei->i_flags & ~VVSFS_INODE_INDEX) | VVSFS_INODE_INLINE;
+    memcpy(ei->i_data, old, MAXINLINE);
+    dir->i_blocks = vvsfs_sectors(sb, ei->i_blocks);
+    up_write(&ei->i_meta_sem);
+    kfree(old);
+    return err;
+}
+
+// An entry of a leaf being split, by hash
+struct vvsfs_dx_sort
+{
+    u32 hash;
+    unsigned int off;
+};
+
+static int vvsfs_cmp_hash(const void *a, const void *b)
+{
+    u32 x = ((const struct vvsfs_dx_sort *)a)->hash;
+    u32 y = ((const struct vvsfs_dx_sort *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+// vvsfs_dx_split - make room for an entry with the given hash by moving the
+//                  entries of the full leaf bh (slot at of the index map
+//                  root, held in pbh) with the upper half of the hashes,
+//                  counting the new one, to a new leaf. Both leaves are
+//                  repacked. bh is released.
+static int vvsfs_dx_split(struct inode *dir, struct buffer_head *pbh,
+                          struct vvsfs_dx_root *root, int at,
+                          struct buffer_head *bh, u32 hash)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_entry *dent;
+    struct vvsfs_dx_sort *ents = NULL;
+    struct buffer_head *nbh;
+    unsigned int off, lo, hi, lo_last = 0, hi_last = 0;
+    char *tmp = NULL;
+    u32 split, lblk;
+    int k, n, err = -ENOSPC;
+
+    if (root->dx_count >= VVSFS_DX_LIMIT(sb->s_blocksize - ((char *)root - pbh->b_data)))
+        goto out;
+
+    // gather the live entries plus the new one (off ~0) and split at the
+    // median hash, or failing that at the next larger one so that names
+    // with equal hashes stay together
+    ents = kmalloc_array(sb->s_blocksize / VVSFS_DIR_REC_LEN(1) + 1,
+                         sizeof(struct vvsfs_dx_sort), GFP_KERNEL);
+    if (!ents)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    n = 0;
+    for (off = 0; off < sb->s_blocksize; off += dent->rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(bh->b_data + off);
+        if (!vvsfs_check_entry(dir, dent, off, sb->s_blocksize))
+        {
+            err = -EIO;
+            goto out;
+        }
+        if (!dent->inode_number)
+            continue;
+        ents[n].hash = vvsfs_dx_hash(dent->name, dent->name_len);
+        ents[n++].off = off;
+    }
+    ents[n].hash = hash;
+    ents[n++].off = ~0U;
+    sort(ents, n, sizeof(struct vvsfs_dx_sort), vvsfs_cmp_hash, NULL);
+    for (k = n / 2; k < n; k++)
+        if (ents[k].hash != ents[0].hash)
+            break;
+    if (k == n)
+        goto out;
+    split = ents[k].hash;
+
+    tmp = kmalloc(sb->s_blocksize, GFP_KERNEL);
+    if (!tmp)
+    {
+        err = -ENOMEM;
+        goto out;
+    }
+    lblk = dir->i_size / sb->s_blocksize;
+    nbh = vvsfs_dir_bread(dir, lblk, 1);
+    if (IS_ERR(nbh))
+    {
+        err = PTR_ERR(nbh);
+        goto out;
+    }
+
+    // repack the lower hashes into tmp and the upper ones into the new leaf
+    memset(tmp, 0, sb->s_blocksize);
+    ((struct vvsfs_dir_entry *)tmp)->rec_len = sb->s_blocksize;
+    ((struct vvsfs_dir_entry *)nbh->b_data)->rec_len = sb->s_blocksize;
+    lo = hi = 0;
+    for (k = 0; k < n; k++)
+    {
+        if (ents[k].off == ~0U)
+            continue;
+        dent = (struct vvsfs_dir_entry *)(bh->b_data + ents[k].off);
+        if (ents[k].hash < split)
+            lo = vvsfs_leaf_pack(tmp, sb->s_blocksize, lo, &lo_last, dent);
+        else
+            hi = vvsfs_leaf_pack(nbh->b_data, sb->s_blocksize, hi, &hi_last, dent);
+    }
+    memcpy(bh->b_data, tmp, sb->s_blocksize);
+
+    memmove(&root->dx_map[at + 2], &root->dx_map[at + 1],
+            (root->dx_count - at - 1) * sizeof(struct vvsfs_dx_entry));
+    root->dx_map[at + 1].dx_hash = split;
+    root->dx_map[at + 1].dx_block = lblk;
+    root->dx_count++;
+
+    vvsfs_dirty_metadata(sb, nbh);
+    vvsfs_dirty_metadata(sb, bh);
+    vvsfs_dirty_metadata(sb, pbh);
+    brelse(nbh);
+    down_write(&VVSFS_I(dir)->i_meta_sem);
+    dir->i_size += sb->s_blocksize;
+    vvsfs_update_inode(dir);
+    up_write(&VVSFS_I(dir)->i_meta_sem);
+    err = 0;
+
+out:
+    if (err == -ENOSPC)
+        printk("vvsfs - directory index of inode %lu is full\n", dir->i_ino);
+    kfree(tmp);
+    kfree(ents);
+    brelse(bh);
+    return err;
+}
+
+// vvsfs_dx_new_node - add an index node holding the count entries of map at
+//                     the end of a directory, returning its file block
+static int vvsfs_dx_new_node(struct inode *dir, struct vvsfs_dx_entry *map,
+                             int count, u32 *lblk)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_entry *dent;
+    struct vvsfs_dx_root *node;
+    struct buffer_head *bh;
+
+    *lblk = dir->i_size / sb->s_blocksize;
+    bh = vvsfs_dir_bread(dir, *lblk, 1);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    dent = (struct vvsfs_dir_entry *)bh->b_data;
+    dent->inode_number = 0;
+    dent->rec_len = sb->s_blocksize;
+    node = vvsfs_dx_map(bh);
+    node->dx_magic = VVSFS_DX_NODE_MAGIC;
+    node->dx_count = count;
+    node->dx_levels = 0;
+    memcpy(node->dx_map, map, count * sizeof(struct vvsfs_dx_entry));
+    vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+
+    down_write(&VVSFS_I(dir)->i_meta_sem);
+    dir->i_size += sb->s_blocksize;
+    vvsfs_update_inode(dir);
+    up_write(&VVSFS_I(dir)->i_meta_sem);
+    return 0;
+}
+
+// vvsfs_dx_grow - move the map of a full single level root to an index
+//                 node, leaving the root with one entry for the node
+static int vvsfs_dx_grow(struct inode *dir, struct buffer_head *rbh)
+{
+    struct vvsfs_dx_root *root = (struct vvsfs_dx_root *)rbh->b_data;
+    u32 lblk;
+    int err;
+
+    err = vvsfs_dx_new_node(dir, root->dx_map, root->dx_count, &lblk);
+    if (err)
+        return err;
+    root->dx_count = 1;
+    root->dx_levels = 1;
+    root->dx_map[0].dx_block = lblk;
+    vvsfs_dirty_metadata(dir->i_sb, rbh);
+    return 0;
+}
+
+// vvsfs_dx_split_node - move the upper half of the full index node nbh (root
+//                       slot at) to a new index node
+static int vvsfs_dx_split_node(struct inode *dir, struct buffer_head *rbh, int at,
+                               struct buffer_head *nbh)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dx_root *root = (struct vvsfs_dx_root *)rbh->b_data;
+    struct vvsfs_dx_root *node = vvsfs_dx_map(nbh);
+    int half = node->dx_count / 2, err;
+    u32 lblk;
+
+    if (root->dx_count >= VVSFS_DX_LIMIT(sb->s_blocksize))
+    {
+        printk("vvsfs - directory index of inode %lu is full\n", dir->i_ino);
+        return -ENOSPC;
+    }
+    err = vvsfs_dx_new_node(dir, node->dx_map + half, node->dx_count - half, &lblk);
+    if (err)
+        return err;
+    memmove(&root->dx_map[at + 2], &root->dx_map[at + 1],
+            (root->dx_count - at - 1) * sizeof(struct vvsfs_dx_entry));
+    root->dx_map[at + 1].dx_hash = node->dx_map[half].dx_hash;
+    root->dx_map[at + 1].dx_block = lblk;
+    root->dx_count++;
+    node->dx_count = half;
+    vvsfs_dirty_metadata(sb, nbh);
+    vvsfs_dirty_metadata(sb, rbh);
+    return 0;
+}
+
+// vvsfs_inline_compact - squeeze the space of removed entries out of the
+//                        inline entries of a directory. The caller holds
+//                        i_meta_sem for writing and has checked the entries.
+static void vvsfs_inline_compact(struct inode *dir)
+{
+    char *data = VVSFS_I(dir)->i_data;
+    struct vvsfs_dir_entry *dent;
+    unsigned int off, rec_len, len, size = 0;
+
+    for (off = 0; off < dir->i_size; off += rec_len)
+    {
+        dent = (struct vvsfs_dir_entry *)(data + off);
+        rec_len = dent->rec_len;
+        if (!dent->inode_number)
+            continue;
+        len = VVSFS_DIR_REC_LEN(dent->name_len);
+        memmove(data + size, dent, len);
+        ((struct vvsfs_dir_entry *)(data + size))->rec_len = len;
+        size += len;
+    }
+    memset(data + size, 0, dir->i_size - size);
+    dir->i_size = size;
+}
+
+// vvsfs_add_entry - add an entry for inode to a directory, converting it to
+//                   an indexed directory once its inline entries are full
+static int vvsfs_add_entry(struct inode *dir, const struct qstr *name,
+                           struct inode *inode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct vvsfs_dir_entry *dent;
+    struct vvsfs_dx_root *root, *index;
+    struct buffer_head *rbh, *nbh, *pbh, *bh;
+    unsigned int len = VVSFS_DIR_REC_LEN(name->len);
+    u32 hash;
+    int top = 0, at, err;
+
+    if (name->len > MAXNAME)
+        return -ENAMETOOLONG;
+
+    if (!(VVSFS_I(dir)->i_flags & VVSFS_INODE_INDEX))
+    {
+        // reuse the space of a removed entry, or else append, squeezing
+        // out the removed entries first if that is what it takes
+        down_write(&VVSFS_I(dir)->i_meta_sem);
+        err = vvsfs_leaf_insert(dir, VVSFS_I(dir)->i_data, dir->i_size, name, inode);
+        if (err == -ENOSPC && dir->i_size + len > MAXINLINE)
+            vvsfs_inline_compact(dir);
+        if (err == -ENOSPC && dir->i_size + len <= MAXINLINE)
+        {
+            dent = (struct vvsfs_dir_entry *)(VVSFS_I(dir)->i_data + dir->i_size);
+            memset(dent, 0, len);
+            dent->rec_len = len;
+            vvsfs_set_entry(dent, name, inode);
+            dir->i_size += len;
+            err = 0;
+        }
+        if (!err)
+            err = vvsfs_update_inode(dir);
+        up_write(&VVSFS_I(dir)->i_meta_sem);
+        if (err != -ENOSPC)
+            return err;
+        err = vvsfs_dx_convert(dir);
+        if (err)
+            return err;
+    }
+
+    hash = vvsfs_dx_hash(name->name, name->len);
+    rbh = vvsfs_dx_root(dir);
+    if (IS_ERR(rbh))
+        return PTR_ERR(rbh);
+    root = (struct vvsfs_dx_root *)rbh->b_data;
+
+    // a split may leave the half the name belongs in still too full, in
+    // which case that half is split again; a full index map is first given
+    // room, by adding the second level or splitting an index node
+    for (;;)
+    {
+        index = root;
+        pbh = rbh;
+        nbh = NULL;
+        if (root->dx_levels)
+        {
+            top = vvsfs_dx_find(root, hash);
+            nbh = vvsfs_dx_node(dir, root->dx_map[top].dx_block);
+            if (IS_ERR(nbh))
+            {
+                err = PTR_ERR(nbh);
+                break;
+            }
+            index = vvsfs_dx_map(nbh);
+            pbh = nbh;
+        }
+        at = vvsfs_dx_find(index, hash);
+        bh = vvsfs_dir_bread(dir, index->dx_map[at].dx_block, 0);
+        if (IS_ERR(bh))
+        {
+            brelse(nbh);
+            err = PTR_ERR(bh);
+            break;
+        }
+        err = vvsfs_leaf_insert(dir, bh->b_data, dir->i_sb->s_blocksize, name, inode);
+        if (err != -ENOSPC)
+        {
+            if (!err)
+                vvsfs_dirty_metadata(sb, bh);
+            brelse(bh);
+            brelse(nbh);
+            break;
+        }
+        if (index->dx_count < VVSFS_DX_LIMIT(sb->s_blocksize - ((char *)index - pbh->b_data)))
+            err = vvsfs_dx_split(dir, pbh, index, at, bh, hash);
+        else
+        {
+            brelse(bh);
+            err = nbh ? vvsfs_dx_split_node(dir, rbh, top, nbh) : vvsfs_dx_grow(dir, rbh);
+        }
+        brelse(nbh);
+        if (err)
+            break;
+    }
+    brelse(rbh);
+    return err;
+}
+
+// vvsfs_delete_entry - remove the entry dent, found by vvsfs_find_entry.
+//                      Nothing is moved: the entry is folded into the one
+//                      before it, or left as a removed entry (inode_number
+//                      0) if it is the first, and later creates reuse the
+//                      space. Only the block holding the entry is written.
+static int vvsfs_delete_entry(struct inode *dir, struct vvsfs_dir_entry *dent,
+                              struct buffer_head *bh)
+{
+    struct vvsfs_dir_entry *prev = NULL, *de;
+    char *data = bh ? bh->b_data : VVSFS_I(dir)->i_data;
+    unsigned int off, size;
+
+    if (!bh)
+        down_write(&VVSFS_I(dir)->i_meta_sem);
+    size = bh ? dir->i_sb->s_blocksize : dir->i_size;
+    for (off = 0; off < size; off += de->rec_len)
+    {
+        de = (struct vvsfs_dir_entry *)(data + off);
+        if (de == dent)
+            break;
+        prev = de;
+    }
+
+    if (!bh && off + dent->rec_len == size)
+    {
+        // the last inline entry goes, along with a removed first entry
+        // that it leaves at the end
+        if (prev && !prev->inode_number)
+            off = 0;
+        memset(data + off, 0, size - off);
+        dir->i_size = off;
+    }
+    else if (prev)
+        prev->rec_len += dent->rec_len;
+    else
+        dent->inode_number = 0;
+
+    if (!bh)
+    {
+        vvsfs_update_inode(dir);
+        up_write(&VVSFS_I(dir)->i_meta_sem);
+        return 0;
+    }
+    vvsfs_dirty_metadata(dir->i_sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+// vvsfs_dir_empty - whether a directory has no entries left
+static int vvsfs_dir_empty(struct inode *dir)
+{
+    struct vvsfs_dir_entry *dent;
+    struct buffer_head *bh;
+    unsigned int off;
+    u32 lblk;
+
+    if (!(VVSFS_I(dir)->i_flags & VVSFS_INODE_INDEX))
+        return dir->i_size == 0;
+
+    for (lblk = 1; lblk < dir->i_size / dir->i_sb->s_blocksize; lblk++)
+    {
+        bh = vvsfs_dir_bread(dir, lblk, 0);
+        if (IS_ERR(bh))
+            return 0;
+        for (off = 0; off < dir->i_sb->s_blocksize; off += dent->rec_len)
+        {
+            dent = (struct vvsfs_dir_entry *)(bh->b_data + off);
+            if (!vvsfs_check_entry(dir, dent, off, dir->i_sb->s_blocksize) || dent->inode_number)
+            {
+                brelse(bh);
+                return 0;
+            }
+        }
+        brelse(bh);
+    }
+    return 1;
+}
+
+// vvsfs_release_inode - free the data blocks and the inode number of an
+//                       inode whose last link has gone
+static void vvsfs_release_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    if (!(ei->i_flags & VVSFS_INODE_INLINE))
+    {
+        while (vvsfs_trim_extents(sb, ei, 0) == -EAGAIN)
+            vvsfs_extents_restart(inode);
+        vvsfs_write_extent_block(inode);
+    }
+    else if (ei->i_flags & VVSFS_INODE_TAIL)
+        vvsfs_tail_drop(sb, ei->i_extent_block, inode->i_ino);
+
+    di = vvsfs_get_inode(sb, inode->i_ino, &bh);
+    if (di)
+    {
+        lock_buffer(bh);
+        memset(di, 0, sizeof(struct vvsfs_inode));
+        di->is_empty = true;
+        unlock_buffer(bh);
+        vvsfs_dirty_metadata(sb, bh);
+        brelse(bh);
+    }
+    vvsfs_free_inode(sb, inode->i_ino);
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+}
+
+// vvsfs_orphan_set_next - point the orphan link of inode ino (0 for the
+//                         head of the list) at inode next
+static int vvsfs_orphan_set_next(struct super_block *sb, unsigned long ino,
+                                 unsigned long next)
+{
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+
+    di = vvsfs_get_inode(sb, ino, &bh);
+    if (!di)
+        return -EIO;
+    lock_buffer(bh);
+    di->i_orphan_next = next;
+    unlock_buffer(bh);
+    vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+    return 0;
+}
+
+// vvsfs_orphan_add - put an inode whose last link has just gone on the
+//                    orphan list, in the handle that removed the link. If
+//                    that fails the inode is freed in place when evicted,
+//                    as it would be without the list.
+static void vvsfs_orphan_add(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_orphan *o;
+    unsigned long next = 0;
+
+    o = kmalloc(sizeof(struct vvsfs_orphan), GFP_NOFS);
+    if (!o)
+        return;
+    o->o_ino = inode->i_ino;
+    o->o_evicted = 0;
+
+    mutex_lock(&sbi->s_orphan_mutex);
+    if (!list_empty(&sbi->s_orphans))
+        next = list_first_entry(&sbi->s_orphans, struct vvsfs_orphan, o_list)->o_ino;
+    if (vvsfs_orphan_set_next(sb, inode->i_ino, next) ||
+        vvsfs_orphan_set_next(sb, 0, inode->i_ino))
+    {
+        mutex_unlock(&sbi->s_orphan_mutex);
+        kfree(o);
+        return;
+    }
+    list_add(&o->o_list, &sbi->s_orphans);
+    mutex_unlock(&sbi->s_orphan_mutex);
+    VVSFS_I(inode)->i_orphan = o;
+}
+
+// vvsfs_orphan_del - take an orphan off the list and free o
+static int vvsfs_orphan_del(struct super_block *sb, struct vvsfs_orphan *o)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    unsigned long prev = 0, next = 0;
+    int err;
+
+    mutex_lock(&sbi->s_orphan_mutex);
+    if (o->o_list.prev != &sbi->s_orphans)
+        prev = list_prev_entry(o, o_list)->o_ino;
+    if (o->o_list.next != &sbi->s_orphans)
+        next = list_next_entry(o, o_list)->o_ino;
+    err = vvsfs_orphan_set_next(sb, prev, next);
+    if (!err)
+        list_del(&o->o_list);
+    mutex_unlock(&sbi->s_orphan_mutex);
+    if (!err)
+        kfree(o);
+    return err;
+}
+
+// vvsfs_clear_disk_inode - free the blocks that the on-disk inode ino lists
+//                          and mark it empty, keeping its orphan link. An
+//                          inode that is already empty frees nothing, so a
+//                          free cut short by a crash can simply be redone.
+//                          The blocks are freed through an in-memory inode
+//                          that nothing else can find, a step at a time as
+//                          a truncate does, so a large file takes several
+//                          handles; the caller holds the first.
+static int vvsfs_clear_disk_inode(struct super_block *sb, unsigned long ino)
+{
+    struct vvsfs_inode_info *ei;
+    struct inode *inode;
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+    __u32 next;
+    int err;
+
+    inode = new_inode(sb);
+    if (!inode)
+        return -ENOMEM;
+    inode->i_ino = ino;
+    ei = VVSFS_I(inode);
+    err = vvsfs_read_inode(inode);
+    if (err)
+        goto out;
+
+    down_write(&ei->i_meta_sem);
+    if (!(ei->i_flags & VVSFS_INODE_INLINE))
+    {
+        while ((err = vvsfs_trim_extents(sb, ei, 0)) == -EAGAIN)
+        {
+            err = vvsfs_extents_restart(inode);
+            if (err)
+                break;
+        }
+        if (!err)
+            err = vvsfs_write_extent_block(inode);
+    }
+    else if (ei->i_flags & VVSFS_INODE_TAIL)
+        vvsfs_tail_drop(sb, ei->i_extent_block, ino);
+    up_write(&ei->i_meta_sem);
+    if (err)
+        goto out;
+
+    di = vvsfs_get_inode(sb, ino, &bh);
+    if (!di)
+    {
+        err = -EIO;
+        goto out;
+    }
+    lock_buffer(bh);
+    next = di->i_orphan_next;
+    memset(di, 0, sizeof(struct vvsfs_inode));
+    di->is_empty = true;
+    di->i_orphan_next = next;
+    unlock_buffer(bh);
+    vvsfs_dirty_metadata(sb, bh);
+    brelse(bh);
+out:
+    // still linked as far as the VFS knows, so eviction frees nothing
+    iput(inode);
+    return err;
+}
+
+// vvsfs_orphan_work - free the evicted orphans: their blocks, as recorded in
+//                     their inodes, then their place on the list and their
+//                     inode numbers, the last in the same handle as the end
+//                     of the blocks
+static void vvsfs_orphan_work(struct work_struct *work)
+{
+    struct vvsfs_sb_info *sbi = container_of(work, struct vvsfs_sb_info,
+                                             s_orphan_work);
+    struct super_block *sb = sbi->s_sb;
+    struct vvsfs_orphan *o, *found;
+    unsigned long ino;
+    int err;
+
+    for (;;)
+    {
+        found = NULL;
+        mutex_lock(&sbi->s_orphan_mutex);
+        list_for_each_entry(o, &sbi->s_orphans, o_list)
+            if (o->o_evicted)
+            {
+                found = o;
+                break;
+            }
+        mutex_unlock(&sbi->s_orphan_mutex);
+        if (!found)
+            return;
+
+        ino = found->o_ino;
+        vvsfs_journal_start(sb);
+        err = vvsfs_clear_disk_inode(sb, ino);
+        if (!err)
+            err = vvsfs_orphan_del(sb, found);
+        // the inode number is only reused once nothing can free it again
+        if (!err)
+            vvsfs_free_inode(sb, ino);
+        vvsfs_journal_stop(sb);
+        if (err)
+        {
+            // left on the list for the next mount
+            printk("vvsfs - unable to free orphan inode %lu\n", ino);
+            mutex_lock(&sbi->s_orphan_mutex);
+            found->o_evicted = 0;
+            mutex_unlock(&sbi->s_orphan_mutex);
+        }
+        cond_resched();
+    }
+}
+
+// vvsfs_orphan_queue - hand an evicted orphan to the orphan worker. Its
+//                      inode block is brought up to date first, as that is
+//                      what the worker frees the blocks from.
+static void vvsfs_orphan_queue(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+
+    vvsfs_journal_start(sb);
+    down_read(&ei->i_meta_sem);
+    vvsfs_write_inode_block(inode, 0);
+    up_read(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+
+    mutex_lock(&sbi->s_orphan_mutex);
+    ei->i_orphan->o_evicted = 1;
+    mutex_unlock(&sbi->s_orphan_mutex);
+    ei->i_orphan = NULL;
+    queue_work(sbi->s_orphan_wq, &sbi->s_orphan_work);
+}
+
+// vvsfs_orphan_recover - pick up the orphan list left on disk by a crash
+//                        and queue its inodes for freeing. A broken chain
+//                        is followed only as far as it is sound. If the
+//                        statistics were just recounted from the inode
+//                        table (uncount) the orphans are taken back out of
+//                        them, as they are never evicted.
+static void vvsfs_orphan_recover(struct super_block *sb, int uncount)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_orphan *o;
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+    unsigned long ino = 0, next, count = 0;
+
+    for (;;)
+    {
+        di = vvsfs_get_inode(sb, ino, &bh);
+        if (!di)
+            break;
+        next = di->i_orphan_next;
+        if (ino && uncount && !di->is_empty)
+        {
+            if (S_ISDIR(di->i_mode))
+                vvsfs_stat_add(sb, VVSFS_STAT_DIRS, -1);
+            else
+            {
+                vvsfs_stat_add(sb, VVSFS_STAT_FILES, -1);
+                vvsfs_stat_add(sb, VVSFS_STAT_BYTES, -di->size);
+            }
+        }
+        brelse(bh);
+        if (!next)
+            break;
+        if (next <= VVSFS_ROOT_INO || next >= sbi->s_imap.bits ||
+            !vvsfs_bitmap_test(&sbi->s_imap, next) || count == sbi->s_imap.bits)
+        {
+            printk("vvsfs - corrupt orphan list at inode %lu\n", ino);
+            break;
+        }
+        o = kmalloc(sizeof(struct vvsfs_orphan), GFP_KERNEL);
+        if (!o)
+            break;
+        o->o_ino = next;
+        o->o_evicted = 1;
+        list_add_tail(&o->o_list, &sbi->s_orphans);
+        ino = next;
+        count++;
+    }
+    if (count)
+    {
+        printk("vvsfs - freeing %lu orphan inodes\n", count);
+        queue_work(sbi->s_orphan_wq, &sbi->s_orphan_work);
+    }
+}
+
+// vvsfs_new_inode - find and construct a new inode.
+// Modified by Yutian Zhao, Hong Wang
+struct inode *vvsfs_new_inode(const struct inode *dir, umode_t mode)
+{
+    struct vvsfs_inode_info *ei;
+    struct super_block *sb;
+    struct inode *inode;
+    int newinodenumber;
+
+    if (!dir)
+        return NULL;
+    sb = dir->i_sb;
+
+    /* get an vfs inode */
+    inode = new_inode(sb);
+    if (!inode)
+        return NULL;
+
+    /* find a spare inode in the vvsfs */
+    newinodenumber = vvsfs_empty_inode(sb, dir, mode);
+    if (newinodenumber == -1)
+    {
+        printk("vvsfs - inode table is full.\n");
+        iput(inode);
+        return NULL;
+    }
+
+    inode_init_owner(inode, dir, mode);
+    inode->i_ino = newinodenumber;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+    inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
 #else
     inode->i_ctime = inode->i_mtime = inode->i_atime = current_time(inode);
 #endif
+    inode->i_op = NULL; //
+
+    // new inodes start out empty and inline
+    ei = VVSFS_I(inode);
+    ei->i_flags = VVSFS_INODE_INLINE;
+    ei->i_blocks = 0;
+    ei->i_extent_block = 0;
+    ei->i_extent_count = 0;
+    memset(ei->i_data, 0, MAXINLINE);
+
+    insert_inode_hash(inode);
+    down_write(&ei->i_meta_sem);
+    vvsfs_update_inode(inode);
+    up_write(&ei->i_meta_sem);
+
+    // counted back out in vvsfs_evict_inode
+    vvsfs_stat_add(sb, S_ISDIR(mode) ? VVSFS_STAT_DIRS : VVSFS_STAT_FILES, 1);
+    return inode;
+}
+
+/* vvsfs_remove_link - remove the entry of dentry from dir and drop the
+                      link it held; shared by unlink and rmdir
+    Author: Yutian Zhao
+    Reference: vvsfs_lookup
+    Modified: Hong Wang
+*/
+static int vvsfs_remove_link(struct inode *dir, struct dentry *dentry)
+{
+    struct inode *inode = d_inode(dentry);
+    struct vvsfs_dir_entry *dent;
+    struct buffer_head *bh;
+    int err;
+
+    dent = vvsfs_find_entry(dir, &dentry->d_name, &bh);
+    if (IS_ERR(dent))
+        return PTR_ERR(dent);
+    if (!dent)
+        return -ENOENT;
+
+    err = vvsfs_delete_entry(dir, dent, bh);
+    if (err)
+        return err;
+    mark_inode_dirty(dir);
+    inode->i_ctime = dir->i_ctime;
+    inode_dec_link_count(inode); // has mark dirty
+    if (!inode->i_nlink)
+        vvsfs_orphan_add(inode);
+    return 0;
+}
+
+static int vvsfs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    u64 start = vvsfs_lat_start(dir->i_sb);
+    int err;
+
+    vvsfs_journal_start(dir->i_sb);
+    err = vvsfs_remove_link(dir, dentry);
+    vvsfs_journal_stop(dir->i_sb);
+    trace_vvsfs_unlink(dir, dentry, d_inode(dentry)->i_ino, err);
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_UNLINK, start);
+    return err;
+}
+
+// vvsfs_inode_is_inline - whether the data of a file currently lives in its
+//                         inode (or its tail) rather than in data blocks
+static inline int vvsfs_inode_is_inline(struct inode *inode)
+{
+    return VVSFS_I(inode)->i_flags & VVSFS_INODE_INLINE;
+}
+
+// vvsfs_fits_inline - whether an inline file can be written up to byte end
+//                     and stay inline: in the inode, or for regular files
+//                     in a tail slot
+static inline int vvsfs_fits_inline(struct inode *inode, loff_t end)
+{
+    loff_t limit = MAXINLINE;
+
+    if (S_ISREG(inode->i_mode) && !(VVSFS_SB(inode->i_sb)->s_mount_opt & VVSFS_MOUNT_NOTAIL))
+        limit = max_t(loff_t, limit, VVSFS_MAXTAIL(inode->i_sb->s_blocksize));
+    return max(end, i_size_read(inode)) <= limit;
+}
+
+// vvsfs_set_prealloc - mark a file VVSFS_INODE_PREALLOC before page cache
+//                      buffers of it are mapped to unwritten blocks, once
+//                      no mpage writeback of it is running. Must not be
+//                      called with a page locked.
+static int vvsfs_set_prealloc(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    int err = 0;
+
+    if (ei->i_flags & VVSFS_INODE_PREALLOC)
+        return 0;
+    down_write(&ei->i_mpage_sem);
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    ei->i_flags |= VVSFS_INODE_PREALLOC;
+    err = vvsfs_update_inode(inode);
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+    up_write(&ei->i_mpage_sem);
+    return err;
+}
+
+// vvsfs_get_block - map file block iblock to a device block for the page
+//                   cache, allocating an unwritten block for a hole when
+//                   create is set. Lookups report the rest of the extent in
+//                   b_size so mpage can build one bio for a contiguous run;
+//                   unwritten blocks are left unmapped so they read as
+//                   zeros. A write maps an unwritten block as it is
+//                   (buffer_unwritten), and vvsfs_end_buffer_write marks it
+//                   written once the data is on disk, so a crash before
+//                   then never shows what a new block held before.
+static int vvsfs_get_block(struct inode *inode, sector_t iblock,
+                           struct buffer_head *bh_result, int create)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    sector_t block;
+    u32 len, flags;
+    int err = 0, write = 0;
+
+    if (iblock >= U32_MAX)
+        return -EFBIG;
+
+    // mapping a block only needs the extents to hold still, so readers of a
+    // file run in parallel; filling a hole retakes the lock for writing
+    down_read(&ei->i_meta_sem);
+again:
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+    {
+        // inline files are read and written through the inode
+        err = -EIO;
+        goto out;
+    }
+
+    block = vvsfs_map_extent(ei, iblock, &len, &flags);
+    if (!block && create && !write)
+    {
+        up_read(&ei->i_meta_sem);
+        vvsfs_journal_start(sb);
+        down_write(&ei->i_meta_sem);
+        write = 1;
+        goto again;
+    }
+    if (flags & VVSFS_EXTENT_UNWRITTEN)
+    {
+        if (!create)
+            goto out;
+        // the rest of the block is zeroed around the write, as for a hole
+        set_buffer_new(bh_result);
+        set_buffer_unwritten(bh_result);
+    }
+    if (!block && create)
+    {
+        len = 1;
+        block = vvsfs_alloc_extent(sb, ei, iblock, &len, VVSFS_EXTENT_UNWRITTEN);
+        if (!block)
+        {
+            err = -ENOSPC;
+            goto out;
+        }
+        err = vvsfs_commit_extents(inode);
+        if (err)
+            goto out;
+        set_buffer_new(bh_result);
+        set_buffer_unwritten(bh_result);
+    }
+    if (block)
+    {
+        map_bh(bh_result, sb, block);
+        bh_result->b_size = min_t(u64, bh_result->b_size, (u64)len << sb->s_blocksize_bits);
+    }
+out:
+    if (write)
+    {
+        up_write(&ei->i_meta_sem);
+        vvsfs_journal_stop(sb);
+    }
+    else
+        up_read(&ei->i_meta_sem);
+    return err;
+}
+
+// vvsfs_get_block_mpage - vvsfs_get_block for mpage writeback, which ends
+//                         its writes itself and so cannot mark unwritten
+//                         blocks written. A hole or an unwritten block is
+//                         refused, and mpage hands the page to
+//                         vvsfs_writepage instead.
+static int vvsfs_get_block_mpage(struct inode *inode, sector_t iblock,
+                                 struct buffer_head *bh_result, int create)
+{
+    int err;
+
+    err = vvsfs_get_block(inode, iblock, bh_result, 0);
+    if (!err && create && !buffer_mapped(bh_result))
+        return -EAGAIN;
+    return err;
+}
+
+// blocks that vvsfs_iomap_begin allocated for a write, as opposed to ones
+// that were there before; only the former are given back when the write
+// comes up short
+#define VVSFS_IOMAP_F_ALLOC IOMAP_F_PRIVATE
+
+// vvsfs_iomap_begin - map the file range at pos for iomap: the extent, or
+//                     the hole, that starts it. A write into a hole first
+//                     fills as much of the range as one run of free blocks
+//                     covers with an unwritten extent. A write into an
+//                     unwritten extent leaves it unwritten (IOMAP_UNWRITTEN,
+//                     which also zeroes around the write) until the data is
+//                     on disk: vvsfs_dio_write_end_io and
+//                     vvsfs_end_buffer_write mark the blocks written.
+//                     Written pages keep buffer heads (IOMAP_F_BUFFER_HEAD),
+//                     so writeback still goes through vvsfs_get_block; as
+//                     those buffers are left unwritten, a buffered write
+//                     first marks the file VVSFS_INODE_PREALLOC.
+static int vvsfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+                             unsigned flags, struct iomap *iomap)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int bits = inode->i_blkbits;
+    sector_t block;
+    u32 lblk, want, len, eflags;
+    int err = 0, write = 0, shared;
+
+    if (pos >> bits >= U32_MAX)
+        return -EFBIG;
+    lblk = pos >> bits;
+    want = min_t(u64, (pos + length - 1) >> bits, U32_MAX - 1) - lblk + 1;
+
+    // as in vvsfs_get_block, only filling a hole takes the lock for writing
+    down_read(&ei->i_meta_sem);
+again:
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+    {
+        err = -EIO;
+        goto out;
+    }
+
+    iomap->flags = 0;
+    block = vvsfs_map_extent(ei, lblk, &len, &eflags);
+    // a direct write covers whole blocks, so shared ones are replaced by
+    // new blocks without copying (buffered writes unshare beforehand).
+    // The new blocks are unwritten until the write completes.
+    if (block && (flags & IOMAP_DIRECT) && (flags & IOMAP_WRITE) &&
+        (ei->i_flags & VVSFS_INODE_REFLINK))
+    {
+        len = vvsfs_shared_blocks(sb, block, min(len, want), &shared);
+        if (shared && !write)
+        {
+            up_read(&ei->i_meta_sem);
+            vvsfs_journal_start(sb);
+            down_write(&ei->i_meta_sem);
+            write = 1;
+            goto again;
+        }
+        if (shared)
+        {
+            err = vvsfs_cow_extent(sb, ei, lblk, &len, &block,
+                                   VVSFS_EXTENT_UNWRITTEN);
+            if (!err)
+                err = vvsfs_commit_extents(inode);
+            if (err)
+                goto out;
+            eflags = VVSFS_EXTENT_UNWRITTEN;
+        }
+    }
+    if ((flags & IOMAP_WRITE) && !(flags & IOMAP_DIRECT) &&
+        (!block || (eflags & VVSFS_EXTENT_UNWRITTEN)) &&
+        !(ei->i_flags & VVSFS_INODE_PREALLOC))
+    {
+        // no page is locked yet, so mpage writeback can be waited for
+        if (write)
+        {
+            up_write(&ei->i_meta_sem);
+            vvsfs_journal_stop(sb);
+        }
+        else
+            up_read(&ei->i_meta_sem);
+        write = 0;
+        err = vvsfs_set_prealloc(inode);
+        if (err)
+            return err;
+        down_read(&ei->i_meta_sem);
+        goto again;
+    }
+    if (!block && (flags & IOMAP_WRITE) && !write)
+    {
+        up_read(&ei->i_meta_sem);
+        vvsfs_journal_start(sb);
+        down_write(&ei->i_meta_sem);
+        write = 1;
+        goto again;
+    }
+    if (!block && (flags & IOMAP_WRITE))
+    {
+        len = min(len, want);
+        block = vvsfs_alloc_extent(sb, ei, lblk, &len, VVSFS_EXTENT_UNWRITTEN);
+        if (!block)
+        {
+            err = -ENOSPC;
+            goto out;
+        }
+        err = vvsfs_commit_extents(inode);
+        if (err)
+            goto out;
+        eflags = VVSFS_EXTENT_UNWRITTEN;
+        iomap->flags |= IOMAP_F_NEW | VVSFS_IOMAP_F_ALLOC;
+    }
+
+    iomap->offset = (loff_t)lblk << bits;
+    iomap->length = (loff_t)min(len, want) << bits;
+    iomap->bdev = sb->s_bdev;
+    if (block)
+    {
+        iomap->type = (eflags & VVSFS_EXTENT_UNWRITTEN) ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
+        iomap->addr = (u64)block << bits;
+    }
+    else
+    {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+    }
+    // zeroing part of a block (fallocate, hole punching) writes through the
+    // page cache like a write
+    if (flags & (IOMAP_WRITE | IOMAP_ZERO))
+        iomap->flags |= IOMAP_F_BUFFER_HEAD;
+out:
+    if (write)
+    {
+        up_write(&ei->i_meta_sem);
+        vvsfs_journal_stop(sb);
+    }
+    else
+        up_read(&ei->i_meta_sem);
+    return err;
+}
+
+// vvsfs_iomap_end - give back the blocks that a short buffered write
+//                   allocated past the end of the file. Only the blocks
+//                   this mapping allocated go: blocks past the end that
+//                   were there before the write, such as those that
+//                   fallocate preallocated with FALLOC_FL_KEEP_SIZE, stay.
+//                   A direct write only moves the end of the file when its
+//                   I/O completes, so blocks past it may belong to earlier
+//                   parts of the same write that are still in flight;
+//                   those are left for the next truncate or eviction.
+static int vvsfs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+                           ssize_t written, unsigned flags, struct iomap *iomap)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int bits = inode->i_blkbits;
+    loff_t start, end = iomap->offset + iomap->length;
+    int err;
+
+    if (!(flags & IOMAP_WRITE) || (flags & IOMAP_DIRECT) ||
+        !(iomap->flags & VVSFS_IOMAP_F_ALLOC) || written >= length)
+        return 0;
+    start = round_up(max_t(loff_t, pos + written, i_size_read(inode)),
+                     sb->s_blocksize);
+    if (start >= end)
+        return 0;
+
+    truncate_pagecache_range(inode, start, end - 1);
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    while ((err = vvsfs_punch_extents(sb, ei, start >> bits,
+                                      (end - start) >> bits, 1)) == -EAGAIN)
+        vvsfs_extents_restart(inode);
+    if (!err)
+        vvsfs_commit_extents(inode);
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+    return 0;
+}
+
+static const struct iomap_ops vvsfs_iomap_ops = {
+    .iomap_begin = vvsfs_iomap_begin,
+    .iomap_end = vvsfs_iomap_end,
+};
+
+// vvsfs_iomap_reads - whether page cache reads of inode go through iomap.
+//                     When a block is smaller than a page, iomap keeps its
+//                     own state in page->private, where writeback expects
+//                     buffer heads, so those files read through mpage.
+static inline int vvsfs_iomap_reads(struct inode *inode)
+{
+    return inode->i_blkbits == PAGE_SHIFT;
+}
+
+// vvsfs_read_inline_page - fill a page of an inline file from the inode,
+//                          or from its tail
+static int vvsfs_read_inline_page(struct inode *inode, struct page *page)
+{
+    void *kaddr;
+    size_t size = 0;
+    int err = 0;
+
+    // the lock is taken outside the atomic kmap, as it may sleep
+    down_read(&VVSFS_I(inode)->i_meta_sem);
+    if (page->index == 0 && (VVSFS_I(inode)->i_flags & VVSFS_INODE_TAIL))
+    {
+        kaddr = kmap(page);
+        err = vvsfs_tail_read(inode, kaddr, PAGE_SIZE);
+        kunmap(page);
+        up_read(&VVSFS_I(inode)->i_meta_sem);
+        if (err)
+            return err;
+        goto out;
+    }
+    kaddr = kmap_atomic(page);
+    if (page->index == 0)
+    {
+        size = MIN(i_size_read(inode), MAXINLINE);
+        memcpy(kaddr, VVSFS_I(inode)->i_data, size);
+    }
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_atomic(kaddr);
+    up_read(&VVSFS_I(inode)->i_meta_sem);
+
+out:
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+    return 0;
+}
+
+// vvsfs_write_inline_page - copy a dirty page of an inline file back into
+//                           the inode, or into a tail slot if it has grown
+//                           too big for the inode
+static int vvsfs_write_inline_page(struct page *page,
+                                   struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    void *kaddr;
+    size_t size;
+    int err = 0;
+
+    set_page_writeback(page);
+    unlock_page(page);
+
+    vvsfs_journal_start(inode->i_sb);
+    down_write(&ei->i_meta_sem);
+    if (page->index == 0 && (ei->i_flags & VVSFS_INODE_INLINE))
+    {
+        size = i_size_read(inode);
+        if (size > MAXINLINE)
+        {
+            kaddr = kmap(page);
+            err = vvsfs_tail_write(inode, kaddr, size);
+            kunmap(page);
+            if (!err)
+                memset(ei->i_data, 0, MAXINLINE);
+        }
+        else
+        {
+            if (ei->i_flags & VVSFS_INODE_TAIL)
+            {
+                vvsfs_tail_drop(inode->i_sb, ei->i_extent_block, inode->i_ino);
+                ei->i_flags &= ~VVSFS_INODE_TAIL;
+                ei->i_extent_block = 0;
+            }
+            kaddr = kmap_atomic(page);
+            memcpy(ei->i_data, kaddr, size);
+            kunmap_atomic(kaddr);
+            memset(ei->i_data + size, 0, MAXINLINE - size);
+        }
+        if (!err)
+            err = vvsfs_update_inode(inode);
+    }
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(inode->i_sb);
+    if (err)
+        mapping_set_error(page->mapping, err);
+    end_page_writeback(page);
+    return err;
+}
+
+// vvsfs_uninline - move the data of an inline file out to a data block so
+//                  it can grow past the inline limit, giving up its tail
+//                  slot if it has one. The data is carried across in
+//                  page 0 of the page cache, which is pinned before the
+//                  inode is switched over and then left dirty so that
+//                  writeback allocates and fills block 0.
+static int vvsfs_uninline(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct page *page = NULL;
+    int err = 0;
+
+    if (i_size_read(inode) > 0)
+    {
+        page = read_mapping_page(inode->i_mapping, 0, NULL);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+    }
+
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+    {
+        if (ei->i_flags & VVSFS_INODE_TAIL)
+        {
+            vvsfs_tail_drop(sb, ei->i_extent_block, inode->i_ino);
+            ei->i_extent_block = 0;
+        }
+        memset(ei->i_data, 0, MAXINLINE);
+        ei->i_flags &= ~(VVSFS_INODE_INLINE | VVSFS_INODE_TAIL);
+        ei->i_extent_count = 0;
+        err = vvsfs_update_inode(inode);
+    }
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+
+    if (page)
+    {
+        lock_page(page);
+        if (!err)
+        {
+            if (!page_has_buffers(page))
+                create_empty_buffers(page, sb->s_blocksize, 0);
+            set_page_dirty(page);
+        }
+        unlock_page(page);
+        put_page(page);
+    }
+    return err;
+}
+
+// vvsfs_is_reflink - whether some blocks of a file may be shared
+static inline int vvsfs_is_reflink(struct inode *inode)
+{
+    return VVSFS_I(inode)->i_flags & VVSFS_INODE_REFLINK;
+}
+
+// vvsfs_page_shared - whether any block under page index is shared
+static int vvsfs_page_shared(struct inode *inode, pgoff_t index)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    u32 lblk = index << (PAGE_SHIFT - inode->i_blkbits);
+    u32 end = lblk + (PAGE_SIZE >> inode->i_blkbits), len;
+    sector_t block;
+    int shared = 0;
+
+    down_read(&ei->i_meta_sem);
+    while (lblk < end && !shared)
+    {
+        block = vvsfs_map_extent(ei, lblk, &len, NULL);
+        len = min(len, end - lblk);
+        if (block)
+            len = vvsfs_shared_blocks(sb, block, len, &shared);
+        lblk += len;
+    }
+    up_read(&ei->i_meta_sem);
+    return shared;
+}
+
+// vvsfs_unshare - give the blocks of a file under bytes pos..pos+len-1 that
+//                 are shared with other files copies of their own, before
+//                 they are written. Each page in the range that has shared
+//                 blocks is read in, its shared blocks are moved to new
+//                 ones, and the buffers over them are unmapped and dirtied
+//                 so that writeback puts the old data in the new blocks.
+static int vvsfs_unshare(struct inode *inode, loff_t pos, loff_t len)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int per_page = PAGE_SIZE >> inode->i_blkbits;
+    DECLARE_BITMAP(cowed, PAGE_SIZE / VVSFS_MIN_BLOCKSIZE);
+    struct buffer_head *bh, *head;
+    struct page *page;
+    pgoff_t index;
+    sector_t block, copy;
+    u32 first, lblk, n;
+    int shared, err = 0, err2;
+
+    for (index = pos >> PAGE_SHIFT; index <= (pos + len - 1) >> PAGE_SHIFT && !err; index++)
+    {
+        if (!vvsfs_page_shared(inode, index))
+            continue;
+        page = read_mapping_page(inode->i_mapping, index, NULL);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        lock_page(page);
+        wait_on_page_writeback(page);
+        if (page->mapping != inode->i_mapping)
+        {
+            // truncated under us
+            unlock_page(page);
+            put_page(page);
+            continue;
+        }
+
+        // the page lock is taken before a handle, as in writeback
+        first = index * per_page;
+        bitmap_zero(cowed, per_page);
+        vvsfs_journal_start(sb);
+        down_write(&ei->i_meta_sem);
+        for (lblk = first; lblk < first + per_page && !err; lblk += n)
+        {
+            block = vvsfs_map_extent(ei, lblk, &n, NULL);
+            n = min(n, first + per_page - lblk);
+            if (!block)
+                continue;
+            n = vvsfs_shared_blocks(sb, block, n, &shared);
+            if (!shared)
+                continue;
+            err = vvsfs_cow_extent(sb, ei, lblk, &n, &copy, 0);
+            if (!err)
+                bitmap_set(cowed, lblk - first, n);
+        }
+        if (!bitmap_empty(cowed, per_page))
+        {
+            err2 = vvsfs_commit_extents(inode);
+            if (!err)
+                err = err2;
+        }
+        up_write(&ei->i_meta_sem);
+        vvsfs_journal_stop(sb);
+
+        if (!bitmap_empty(cowed, per_page))
+        {
+            if (!page_has_buffers(page))
+                create_empty_buffers(page, sb->s_blocksize, 0);
+            bh = head = page_buffers(page);
+            lblk = 0;
+            do
+            {
+                if (test_bit(lblk, cowed))
+                {
+                    clear_buffer_mapped(bh);
+                    mark_buffer_dirty(bh);
+                }
+                lblk++;
+                bh = bh->b_this_page;
+            } while (bh != head);
+        }
+        unlock_page(page);
+        put_page(page);
+    }
+    return err;
+}
+
+// vvsfs_truncate - change the size of a file on disk (the page cache has
+//                  already been trimmed by truncate_setsize). Growing an
+//                  inline file past the inline limit moves it out to
+//                  extents, and the new space is a hole; shrinking frees
+//                  the blocks past the new end and zeroes the tail of the
+//                  last block so the old data cannot reappear if the file
+//                  grows again. A large file is freed in several
+//                  handles, and until the last the inode keeps its old
+//                  size on disk, cut down to the blocks it still has, so
+//                  that a crash part way leaves a longer file rather than
+//                  blocks past its end.
+static int vvsfs_truncate(struct inode *inode, loff_t old_size, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    struct vvsfs_extent *e;
+    int err = 0;
+
+    if (vvsfs_inode_is_inline(inode) && !vvsfs_fits_inline(inode, size))
+    {
+        err = vvsfs_uninline(inode);
+        if (err)
+            return err;
+    }
+    if (!vvsfs_inode_is_inline(inode))
+    {
+        // the tail of the last block is zeroed, so it must be the file's own
+        if (vvsfs_is_reflink(inode) && (size & (sb->s_blocksize - 1)))
+        {
+            err = vvsfs_unshare(inode, size, 1);
+            if (err)
+                return err;
+        }
+        err = block_truncate_page(inode->i_mapping, size, vvsfs_get_block);
+        if (err)
+            return err;
+    }
+
+    // the steps above lock pages, so they take their own handles
+    vvsfs_journal_start(sb);
+    down_write(&ei->i_meta_sem);
+    if (ei->i_flags & VVSFS_INODE_INLINE)
+    {
+        // empty shortened space
+        if (ei->i_flags & VVSFS_INODE_TAIL)
+            err = vvsfs_tail_truncate(inode, size);
+        else if (size < MAXINLINE)
+            memset(ei->i_data + size, 0, MAXINLINE - size);
+        if (!err)
+            err = vvsfs_update_inode(inode);
+    }
+    else
+    {
+        while (vvsfs_trim_extents(sb, ei, DIV_ROUND_UP(size, sb->s_blocksize)) == -EAGAIN)
+        {
+            e = &ei->i_ext[ei->i_extent_count - 1];
+            ei->i_trim_size = max(size, min(old_size,
+                                  (loff_t)(e->e_lblk + e->e_len) << sb->s_blocksize_bits));
+            err = vvsfs_extents_restart(inode);
+            if (err)
+                break;
+        }
+        ei->i_trim_size = 0;
+        if (!ei->i_extent_count)
+            ei->i_flags &= ~VVSFS_INODE_REFLINK;
+        vvsfs_prealloc_check(ei);
+        if (!err)
+            err = vvsfs_commit_extents(inode);
+    }
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(sb);
+    return err;
+}
+
+// vvsfs_write_failed - drop blocks that a failed write allocated past i_size
+static void vvsfs_write_failed(struct address_space *mapping, loff_t to)
+{
+    struct inode *inode = mapping->host;
+
+    if (to > inode->i_size)
+    {
+        truncate_pagecache(inode, inode->i_size);
+        vvsfs_truncate(inode, inode->i_size, inode->i_size);
+    }
+}
+
+static int vvsfs_readpage(struct file *file, struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+    int err;
+
+    if (vvsfs_inode_is_inline(inode))
+    {
+        err = vvsfs_read_inline_page(inode, page);
+        unlock_page(page);
+        return err;
+    }
+    vvsfs_stat_add(inode->i_sb, VVSFS_STAT_READS, PAGE_SIZE >> inode->i_blkbits);
+    if (vvsfs_iomap_reads(inode))
+        return iomap_readpage(page, &vvsfs_iomap_ops);
+    return mpage_readpage(page, vvsfs_get_block);
+}
+
+static int vvsfs_readpages(struct file *file, struct address_space *mapping,
+                           struct list_head *pages, unsigned nr_pages)
+{
+    // pages left unread here are read one at a time by vvsfs_readpage
+    if (vvsfs_inode_is_inline(mapping->host))
+        return 0;
+    vvsfs_stat_add(mapping->host->i_sb, VVSFS_STAT_READS,
+                   nr_pages * (PAGE_SIZE >> mapping->host->i_blkbits));
+    if (vvsfs_iomap_reads(mapping->host))
+        return iomap_readpages(mapping, pages, nr_pages, &vvsfs_iomap_ops);
+    return mpage_readpages(mapping, pages, nr_pages, vvsfs_get_block);
+}
+
+// vvsfs_end_buffer_write - finish the write of a page cache buffer. A
+//                          buffer over an unwritten block is handed to
+//                          vvsfs_end_io_work instead, as marking the block
+//                          written takes a handle, which cannot be done
+//                          from interrupt context.
+static void vvsfs_end_buffer_write(struct buffer_head *bh, int uptodate)
+{
+    struct vvsfs_sb_info *sbi;
+    unsigned long flags;
+
+    if (!uptodate || !buffer_unwritten(bh))
+    {
+        end_buffer_async_write(bh, uptodate);
+        return;
+    }
+    sbi = VVSFS_SB(bh->b_page->mapping->host->i_sb);
+    spin_lock_irqsave(&sbi->s_end_io_lock, flags);
+    bh->b_private = sbi->s_end_io;
+    sbi->s_end_io = bh;
+    spin_unlock_irqrestore(&sbi->s_end_io_lock, flags);
+    queue_work(sbi->s_end_io_wq, &sbi->s_end_io_work);
+}
+
+// vvsfs_end_io_work - mark the unwritten blocks under finished buffer
+//                     writes written, then end the writes. The pages stay
+//                     under writeback until then, so fsync and truncate
+//                     wait for the conversion as well as for the data.
+static void vvsfs_end_io_work(struct work_struct *work)
+{
+    struct vvsfs_sb_info *sbi = container_of(work, struct vvsfs_sb_info,
+                                             s_end_io_work);
+    struct buffer_head *bh, *next;
+    struct inode *inode;
+    int err;
 
-    inode->i_op = NULL; //
-    inode->i_uid.val = block.i_uid;
-    inode->i_gid.val = block.i_gid;
+    spin_lock_irq(&sbi->s_end_io_lock);
+    bh = sbi->s_end_io;
+    sbi->s_end_io = NULL;
+    spin_unlock_irq(&sbi->s_end_io_lock);
 
-    insert_inode_hash(inode);
-    vvsfs_info.size += inode->i_size;
-    return inode;
+    // one handle covers the batch, unless it is a long one
+    vvsfs_journal_start(sbi->s_sb);
+    for (; bh; bh = next)
+    {
+        if (vvsfs_journal_full(sbi->s_sb))
+            vvsfs_journal_restart(sbi->s_sb);
+        next = bh->b_private;
+        bh->b_private = NULL;
+        inode = bh->b_page->mapping->host;
+        err = vvsfs_convert_range(inode, (page_offset(bh->b_page) + bh_offset(bh)) >>
+                                  inode->i_blkbits, 1);
+        if (err)
+        {
+            printk("vvsfs - unable to mark a block of inode %lu written\n",
+                   inode->i_ino);
+            mapping_set_error(inode->i_mapping, err);
+        }
+        clear_buffer_unwritten(bh);
+        end_buffer_async_write(bh, 1);
+    }
+    vvsfs_journal_stop(sbi->s_sb);
 }
 
-/* unlink
-    Author: Yutian Zhao
-    Reference: vvsfs_lookup
-    Modified: Hong Wang
-*/
-static int vvsfs_unlink(struct inode *dir, struct dentry *dentry)
+// vvsfs_writepage - write back one page: block_write_full_page, but with
+//                   the buffer writes ended in vvsfs_end_buffer_write, as
+//                   the page may have unwritten blocks, or holes that
+//                   vvsfs_get_block fills with them.
+static int vvsfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-    int num_dirs;
-    int k;
-    int j;
-    struct vvsfs_inode dirdata;
-    struct inode *inode = NULL;
-    struct vvsfs_dir_entry *dent;
-    struct vvsfs_inode filedata;
+    struct inode *inode = page->mapping->host;
+    loff_t size = i_size_read(inode);
+    unsigned offset = size & (PAGE_SIZE - 1);
 
-    vvsfs_readblock(dir->i_sb, dir->i_ino, &dirdata);
-    // number of entries in the directory
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
+    if (vvsfs_inode_is_inline(inode))
+        return vvsfs_write_inline_page(page, wbc);
 
-    for (k = 0; k < num_dirs; k++)
+    // as block_write_full_page: a page past the end of the file is being
+    // truncated, and the end of the last one is zeroed
+    if (page->index >= size >> PAGE_SHIFT)
     {
-        dent = (struct vvsfs_dir_entry *)((dirdata.data) + k * sizeof(struct vvsfs_dir_entry));
-
-        if ((strlen(dent->name) == dentry->d_name.len) &&
-            strncmp(dent->name, dentry->d_name.name, dentry->d_name.len) == 0)
+        if (page->index > size >> PAGE_SHIFT || !offset)
         {
-            inode = vvsfs_iget(dir->i_sb, dent->inode_number);
+            block_invalidatepage(page, 0, PAGE_SIZE);
+            unlock_page(page);
+            return 0;
+        }
+        zero_user_segment(page, offset, PAGE_SIZE);
+    }
+    return __block_write_full_page(inode, page, vvsfs_get_block, wbc,
+                                   vvsfs_end_buffer_write);
+}
+
+// vvsfs_writepages - write back dirty pages, as large bios through mpage
+//                    unless the file may have unwritten blocks: mpage ends
+//                    its writes itself and would leave those unwritten, so
+//                    such files go a page at a time through
+//                    vvsfs_writepage. Pages of other files that mpage would
+//                    have to fill holes for go that way too.
+static int vvsfs_writepages(struct address_space *mapping,
+                            struct writeback_control *wbc)
+{
+    struct vvsfs_inode_info *ei = VVSFS_I(mapping->host);
+    long nr = wbc->nr_to_write;
+    int err;
+
+    if (vvsfs_inode_is_inline(mapping->host))
+        return generic_writepages(mapping, wbc);
+    // vvsfs_prealloc waits for this before making unwritten blocks
+    down_read(&ei->i_mpage_sem);
+    // pages written, including those mpage hands to vvsfs_writepage; the
+    // flag goes once no unwritten extent is left (vvsfs_prealloc_check)
+    if (ei->i_flags & VVSFS_INODE_PREALLOC)
+        err = generic_writepages(mapping, wbc);
+    else
+        err = mpage_writepages(mapping, wbc, vvsfs_get_block_mpage);
+    up_read(&ei->i_mpage_sem);
+    vvsfs_stat_add(mapping->host->i_sb, VVSFS_STAT_WRITES,
+                   (nr - wbc->nr_to_write) * (PAGE_SIZE >> mapping->host->i_blkbits));
+    return err;
+}
 
-            if (!inode)
-                return -EACCES;
+// vvsfs_write_begin - prepare a page for a write. Writes that keep an inline
+//                     file within the inline limit go to a page filled from
+//                     the inode (or its tail); anything larger first moves
+//                     the file to extents.
+static int vvsfs_write_begin(struct file *file, struct address_space *mapping,
+                             loff_t pos, unsigned len, unsigned flags,
+                             struct page **pagep, void **fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct page *page;
+    int err;
 
-            // copy and move the dir entry forward
-            for (j = k; j < num_dirs - 1; j++)
-            {
-                memcpy(dent, dent + 1, sizeof(struct vvsfs_dir_entry));
-                dent->inode_number = (dent + 1)->inode_number;
-                dent++;
-            }
-            // memmove(dent, dent + sizeof(struct vvsfs_dir_entry), (num_dirs - k - 1) * sizeof(struct vvsfs_dir_entry));
-
-            // update directory data size.
-            dirdata.size = (num_dirs - 1) * sizeof(struct vvsfs_dir_entry);
-            vvsfs_writeblock(dir->i_sb, dir->i_ino, &dirdata);
-            dir->i_size = dirdata.size;
-            mark_inode_dirty(dir);
-            inode->i_ctime = dir->i_ctime;
-            inode_dec_link_count(inode); // has mark dirty
-            if (inode->i_nlink == 0)
+    if (vvsfs_inode_is_inline(inode))
+    {
+        if (vvsfs_fits_inline(inode, pos + len))
+        {
+            page = grab_cache_page_write_begin(mapping, 0, flags);
+            if (!page)
+                return -ENOMEM;
+            if (!PageUptodate(page))
             {
-                vvsfs_readblock(inode->i_sb, inode->i_ino, &filedata);
-                // update proc info
-                vvsfs_info.size -= filedata.size;
-                vvsfs_info.file_count--;
-                // clear deleted file data.
-                filedata.is_empty = 1;
-                filedata.is_directory = 0;
-                filedata.size = 0;
-                filedata.i_uid = 0;
-                filedata.i_gid = 0;
-                filedata.i_mode = 0;
-                vvsfs_writeblock(inode->i_sb, inode->i_ino, &filedata);
-                mark_inode_dirty(inode);
+                err = vvsfs_read_inline_page(inode, page);
+                if (err)
+                {
+                    unlock_page(page);
+                    put_page(page);
+                    return err;
+                }
             }
+            *pagep = page;
             return 0;
         }
+        err = vvsfs_uninline(inode);
+        if (err)
+            return err;
+    }
+
+    // holes are filled with unwritten blocks, which mpage would leave so
+    err = vvsfs_set_prealloc(inode);
+    if (!err)
+        err = block_write_begin(mapping, pos, len, flags, pagep, vvsfs_get_block);
+    if (err < 0)
+        vvsfs_write_failed(mapping, pos + len);
+    return err;
+}
+
+static int vvsfs_write_end(struct file *file, struct address_space *mapping,
+                           loff_t pos, unsigned len, unsigned copied,
+                           struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    loff_t old_size = inode->i_size;
+    int ret;
+
+    // pages of inline files never get buffers
+    if (!page_has_buffers(page))
+        ret = simple_write_end(file, mapping, pos, len, copied, page, fsdata);
+    else
+        ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+    if (inode->i_size > old_size)
+    {
+        vvsfs_stat_add(inode->i_sb, VVSFS_STAT_BYTES, inode->i_size - old_size);
+        mark_inode_dirty(inode);
     }
-    return -ENOENT;
+    if (ret < len)
+        vvsfs_write_failed(mapping, pos + len);
+    return ret;
 }
 
+static sector_t vvsfs_bmap(struct address_space *mapping, sector_t block)
+{
+    return iomap_bmap(mapping, block, &vvsfs_iomap_ops);
+}
+
+static const struct address_space_operations vvsfs_aops = {
+    .readpage = vvsfs_readpage,
+    .readpages = vvsfs_readpages,
+    .writepage = vvsfs_writepage,
+    .writepages = vvsfs_writepages,
+    .write_begin = vvsfs_write_begin,
+    .write_end = vvsfs_write_end,
+    .bmap = vvsfs_bmap,
+    // direct I/O goes through iomap from read_iter and write_iter
+    .direct_IO = noop_direct_IO,
+};
+
 /* vvsfs_setattr - set attr for an inode
     Author: Yutian Zhao
     Modified: Hong Wang
@@ -390,15 +4769,11 @@ static int vvsfs_setattr(struct dentry *dentry, struct iattr *attr)
 {
     struct inode *inode = d_inode(dentry);
     int error;
-    //
-    struct vvsfs_inode filedata;
-    int k;
-    int size_o = inode->i_size;
+    loff_t size_o = inode->i_size;
 
     error = setattr_prepare(dentry, attr);
     if (error)
         return error;
-    printk("vvsfs - setattr : %s\n", dentry->d_name.name);
 
     // change size
     if ((attr->ia_valid & ATTR_SIZE) &&
@@ -408,43 +4783,25 @@ static int vvsfs_setattr(struct dentry *dentry, struct iattr *attr)
         if (error)
             return error;
 
-        // return error when size is larger then max file size
-        if (attr->ia_size > MAXFILESIZE)
-        {
-            return -1;
-        }
-        printk("vvsfs - setattr try to set size: %ld\n", inode->i_ino);
+        // direct I/O in flight may still be extending the file
+        inode_dio_wait(inode);
         truncate_setsize(inode, attr->ia_size);
-        printk("vvsfs - setattr try to set size: done");
-        vvsfs_readblock(inode->i_sb, inode->i_ino, &filedata);
-
-        // empty shortened space
-        if (filedata.size < attr->ia_size)
-        {
-            for (k = filedata.size; k < attr->ia_size; k++)
-            {
-                filedata.data[k] = '\0';
-            }
-        }
-        vvsfs_info.size += attr->ia_size - size_o;
-        filedata.size = attr->ia_size; // int  // check if is directory
-        vvsfs_writeblock(inode->i_sb, inode->i_ino, &filedata);
+        error = vvsfs_truncate(inode, size_o, attr->ia_size);
+        if (error)
+            return error;
+        vvsfs_stat_add(inode->i_sb, VVSFS_STAT_BYTES, attr->ia_size - size_o);
     }
 
+    // change uid/gid/mode; vvsfs_update_inode writes the inode or marks it
+    // dirty, not both
     setattr_copy(inode, attr);
-    mark_inode_dirty(inode);
-
-    // change uid/gid/mode
-    vvsfs_readblock(inode->i_sb, inode->i_ino, &filedata);
-    if (attr->ia_valid & ATTR_UID)
-        filedata.i_uid = inode->i_uid.val;
-    if (attr->ia_valid & ATTR_GID)
-        filedata.i_gid = inode->i_gid.val;
-    if (attr->ia_valid & ATTR_MODE)
-        filedata.i_mode = inode->i_mode;
-    vvsfs_writeblock(inode->i_sb, inode->i_ino, &filedata);
+    vvsfs_journal_start(inode->i_sb);
+    down_write(&VVSFS_I(inode)->i_meta_sem);
+    error = vvsfs_update_inode(inode);
+    up_write(&VVSFS_I(inode)->i_meta_sem);
+    vvsfs_journal_stop(inode->i_sb);
 
-    return 0;
+    return error;
 }
 
 // vvsfs_create - create a new directory in a directory
@@ -452,44 +4809,29 @@ static int vvsfs_setattr(struct dentry *dentry, struct iattr *attr)
 // Modified: Hone Wang
 static int vvsfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
-    struct vvsfs_inode dirdata;
-    int num_dirs;
-    struct vvsfs_dir_entry *dent;
-
+    u64 start = vvsfs_lat_start(dir->i_sb);
     struct inode *inode;
+    unsigned long ino = 0;
+    int err = -ENAMETOOLONG;
 
-    if (DEBUG)
-        printk("vvsfs - mkdir : %s\n", dentry->d_name.name);
-
-    inode = vvsfs_new_inode(dir, mode | S_IFDIR, 1);
+    if (dentry->d_name.len > MAXNAME)
+        goto out;
 
+    vvsfs_journal_start(dir->i_sb);
+    err = -ENOSPC;
+    inode = vvsfs_new_inode(dir, mode | S_IFDIR);
     if (!inode)
-        return -ENOSPC;
+        goto stop;
     inode->i_op = &vvsfs_dir_inode_operations;
     inode->i_fop = &vvsfs_dir_operations;
 
-    /* get an vfs inode */
-    if (!dir)
-        return -1;
-
-    vvsfs_readblock(dir->i_sb, dir->i_ino, &dirdata);
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
-    dent = (struct vvsfs_dir_entry *)((dirdata.data) +
-                                      num_dirs * sizeof(struct vvsfs_dir_entry));
-
-    strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
-    dent->name[dentry->d_name.len] = '\0';
-
-    dirdata.size = (num_dirs + 1) * sizeof(struct vvsfs_dir_entry);
-
-    // update i_size
-    dir->i_size = dirdata.size;
-
-    dent->inode_number = inode->i_ino;
-
-    vvsfs_writeblock(dir->i_sb, dir->i_ino, &dirdata);
-
-    vvsfs_info.dir_count++;
+    err = vvsfs_add_entry(dir, &dentry->d_name, inode);
+    if (err)
+    {
+        inode_dec_link_count(inode);
+        iput(inode);
+        goto stop;
+    }
 
     inode_inc_link_count(dir);
     inode_inc_link_count(inode);
@@ -497,45 +4839,199 @@ static int vvsfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
     mark_inode_dirty(inode);
 
     d_instantiate(dentry, inode);
+    ino = inode->i_ino;
 
-    printk("Dir created %ld\n", inode->i_ino);
-    return 0;
+stop:
+    vvsfs_journal_stop(dir->i_sb);
+out:
+    trace_vvsfs_create(dir, dentry, ino, err);
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_MKDIR, start);
+    return err;
 }
 
 // remove directory
 // Author: Yutian Zhao
 static int vvsfs_rmdir(struct inode *dir, struct dentry *dentry)
 {
+    u64 start = vvsfs_lat_start(dir->i_sb);
     struct inode *inode = d_inode(dentry);
     int err = -ENOTEMPTY;
-    struct vvsfs_inode dirdata;
-    vvsfs_readblock(inode->i_sb, inode->i_ino, &dirdata);
 
-    if (dirdata.size == 0)
+    if (vvsfs_dir_empty(inode))
     {
-        err = vvsfs_unlink(dir, dentry);
+        vvsfs_journal_start(dir->i_sb);
+        err = vvsfs_remove_link(dir, dentry);
         if (!err)
         {
             inode_dec_link_count(dir);
             inode_dec_link_count(inode);
-            if (inode->i_nlink == 0)
+            if (!inode->i_nlink)
+                vvsfs_orphan_add(inode);
+        }
+        vvsfs_journal_stop(dir->i_sb);
+    }
+    trace_vvsfs_unlink(dir, dentry, inode->i_ino, err);
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_RMDIR, start);
+    return err;
+}
+
+// vvsfs_set_link - point the entry dent, found by vvsfs_find_entry, at inode
+//                  under name. Nothing is moved, so only the block (or
+//                  inode) holding the entry is written.
+static void vvsfs_set_link(struct inode *dir, struct vvsfs_dir_entry *dent,
+                           struct buffer_head *bh, const struct qstr *name,
+                           struct inode *inode)
+{
+    if (!bh)
+    {
+        down_write(&VVSFS_I(dir)->i_meta_sem);
+        vvsfs_set_entry(dent, name, inode);
+        vvsfs_update_inode(dir);
+        up_write(&VVSFS_I(dir)->i_meta_sem);
+        return;
+    }
+    vvsfs_set_entry(dent, name, inode);
+    vvsfs_dirty_metadata(dir->i_sb, bh);
+    brelse(bh);
+}
+
+// vvsfs_rename_in_place - whether the entry dent of dir, named old, can be
+//                         renamed to new where it stands: the new name must
+//                         fit in its rec_len and, in an indexed directory,
+//                         hash to the same leaf
+static int vvsfs_rename_in_place(struct inode *dir, struct vvsfs_dir_entry *dent,
+                                 const struct qstr *old, const struct qstr *new)
+{
+    u32 old_leaf, new_leaf;
+
+    if (dent->rec_len < VVSFS_DIR_REC_LEN(new->len))
+        return 0;
+    if (!(VVSFS_I(dir)->i_flags & VVSFS_INODE_INDEX))
+        return 1;
+
+    if (vvsfs_dx_leaf(dir, vvsfs_dx_hash(old->name, old->len), &old_leaf) ||
+        vvsfs_dx_leaf(dir, vvsfs_dx_hash(new->name, new->len), &new_leaf))
+        return 0;
+    return old_leaf == new_leaf;
+}
+
+// vvsfs_rename - move an entry to a new name, replacing the entry already
+//                there (the VFS refuses that for RENAME_NOREPLACE), or swap
+//                two entries for RENAME_EXCHANGE. Entries are rewritten
+//                where they stand whenever they can be, so a rename within
+//                a directory writes one block and a move between
+//                directories two, all in one handle. There are no ".."
+//                entries on disk, so moving a directory only changes the
+//                link counts of its parents.
+static int vvsfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+                        struct inode *new_dir, struct dentry *new_dentry,
+                        unsigned int flags)
+{
+    u64 start = vvsfs_lat_start(old_dir->i_sb);
+    struct inode *old_inode = d_inode(old_dentry);
+    struct inode *new_inode = d_inode(new_dentry);
+    struct vvsfs_dir_entry *odent, *ndent;
+    struct buffer_head *obh, *nbh;
+    int err = -EINVAL;
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+        goto out;
+    err = -ENAMETOOLONG;
+    if (new_dentry->d_name.len > MAXNAME)
+        goto out;
+    err = -ENOTEMPTY;
+    if (new_inode && S_ISDIR(new_inode->i_mode) && !(flags & RENAME_EXCHANGE) &&
+        !vvsfs_dir_empty(new_inode))
+        goto out;
+
+    vvsfs_journal_start(old_dir->i_sb);
+    odent = vvsfs_find_entry(old_dir, &old_dentry->d_name, &obh);
+    err = IS_ERR(odent) ? PTR_ERR(odent) : -ENOENT;
+    if (IS_ERR_OR_NULL(odent))
+        goto stop;
+
+    if (new_inode)
+    {
+        // the new name keeps its entry, which now names old_inode
+        ndent = vvsfs_find_entry(new_dir, &new_dentry->d_name, &nbh);
+        err = IS_ERR(ndent) ? PTR_ERR(ndent) : -ENOENT;
+        if (IS_ERR_OR_NULL(ndent))
+        {
+            brelse(obh);
+            goto stop;
+        }
+        vvsfs_set_link(new_dir, ndent, nbh, &new_dentry->d_name, old_inode);
+        new_inode->i_ctime = current_time(new_inode);
+
+        if (flags & RENAME_EXCHANGE)
+        {
+            vvsfs_set_link(old_dir, odent, obh, &old_dentry->d_name, new_inode);
+            mark_inode_dirty(new_inode);
+            if (old_dir != new_dir && S_ISDIR(new_inode->i_mode))
+            {
+                inode_inc_link_count(old_dir);
+                inode_dec_link_count(new_dir);
+            }
+        }
+        else
+        {
+            vvsfs_delete_entry(old_dir, odent, obh);
+            if (S_ISDIR(new_inode->i_mode))
             {
-                if (DEBUG)
-                    printk("vvsfs - rmdir : %s\n", dentry->d_name.name);
-                // cleanup block
-                dirdata.is_empty = 1;
-                dirdata.is_directory = 0;
-                dirdata.i_mode = 0;
-                dirdata.i_uid = 0;
-                dirdata.i_gid = 0;
-                dirdata.size = 0;
-                vvsfs_writeblock(inode->i_sb, inode->i_ino, &dirdata);
-                mark_inode_dirty(inode);
+                inode_dec_link_count(new_dir);
+                inode_dec_link_count(new_inode);
             }
-            //update dir count
-            vvsfs_info.dir_count--;
+            inode_dec_link_count(new_inode);
+            if (!new_inode->i_nlink)
+                vvsfs_orphan_add(new_inode);
+        }
+    }
+    else if (old_dir == new_dir &&
+             vvsfs_rename_in_place(old_dir, odent, &old_dentry->d_name, &new_dentry->d_name))
+        vvsfs_set_link(old_dir, odent, obh, &new_dentry->d_name, old_inode);
+    else
+    {
+        // adding to the same directory may move the old entry (a leaf
+        // split or inline compaction), so it is looked up again after
+        if (old_dir == new_dir)
+        {
+            brelse(obh);
+            obh = NULL;
+        }
+        err = vvsfs_add_entry(new_dir, &new_dentry->d_name, old_inode);
+        if (err)
+        {
+            brelse(obh);
+            goto stop;
+        }
+        if (old_dir == new_dir)
+        {
+            odent = vvsfs_find_entry(old_dir, &old_dentry->d_name, &obh);
+            err = IS_ERR(odent) ? PTR_ERR(odent) : -ENOENT;
+            if (IS_ERR_OR_NULL(odent))
+                goto stop;
         }
+        vvsfs_delete_entry(old_dir, odent, obh);
+    }
+
+    if (old_dir != new_dir && S_ISDIR(old_inode->i_mode))
+    {
+        inode_inc_link_count(new_dir);
+        inode_dec_link_count(old_dir);
     }
+    old_inode->i_ctime = current_time(old_inode);
+    old_dir->i_ctime = old_dir->i_mtime = old_inode->i_ctime;
+    new_dir->i_ctime = new_dir->i_mtime = old_inode->i_ctime;
+    mark_inode_dirty(old_inode);
+    mark_inode_dirty(old_dir);
+    mark_inode_dirty(new_dir);
+    err = 0;
+
+stop:
+    vvsfs_journal_stop(old_dir->i_sb);
+out:
+    trace_vvsfs_rename(new_dir, new_dentry, old_inode->i_ino, err);
+    vvsfs_lat_end(old_dir->i_sb, VVSFS_OP_RENAME, start);
     return err;
 }
 
@@ -543,58 +5039,48 @@ static int vvsfs_rmdir(struct inode *dir, struct dentry *dentry)
 // Author: Yutian Zhao
 static int vvsfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t rdev)
 {
-    struct vvsfs_inode dirdata;
-    int num_dirs;
-    struct vvsfs_dir_entry *dent;
-
+    u64 start = vvsfs_lat_start(dir->i_sb);
     struct inode *inode;
+    unsigned long ino = 0;
+    int err = -ENAMETOOLONG;
 
-    if (DEBUG)
-        printk("vvsfs - mknod : %s\n", dentry->d_name.name);
+    if (dentry->d_name.len > MAXNAME)
+        goto out;
 
-    inode = vvsfs_new_inode(dir, S_IRUGO | S_IWUGO | S_IFREG, 0);
+    vvsfs_journal_start(dir->i_sb);
+    err = -ENOSPC;
+    inode = vvsfs_new_inode(dir, S_IRUGO | S_IWUGO | S_IFREG);
     if (!inode)
-        return -ENOSPC;
+        goto stop;
     inode->i_op = &vvsfs_file_inode_operations;
     inode->i_fop = &vvsfs_file_operations;
     inode->i_mode = mode;
     init_special_inode(inode, inode->i_mode, rdev);
 
-    if (DEBUG)
-        printk("vvsfs - mknod finish setting\n");
-
-    /* get an vfs inode */
-    if (!dir)
-        return -1;
-
-    vvsfs_readblock(dir->i_sb, dir->i_ino, &dirdata);
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
-    dent = (struct vvsfs_dir_entry *)((dirdata.data) +
-                                      num_dirs * sizeof(struct vvsfs_dir_entry));
-
-    strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
-    dent->name[dentry->d_name.len] = '\0';
-
-    dirdata.size = (num_dirs + 1) * sizeof(struct vvsfs_dir_entry);
+    down_write(&VVSFS_I(inode)->i_meta_sem);
+    vvsfs_update_inode(inode);
+    up_write(&VVSFS_I(inode)->i_meta_sem);
 
-    // update i_size
-    dir->i_size = dirdata.size;
-
-    dent->inode_number = inode->i_ino;
-
-    vvsfs_writeblock(dir->i_sb, dir->i_ino, &dirdata);
-    if (DEBUG)
-        printk("vvsfs - mknod finish writing to dir: %ld\n", inode->i_ino);
+    err = vvsfs_add_entry(dir, &dentry->d_name, inode);
+    if (err)
+    {
+        inode_dec_link_count(inode);
+        iput(inode);
+        goto stop;
+    }
 
     mark_inode_dirty(dir);
     mark_inode_dirty(inode);
-    if (DEBUG)
-        printk("vvsfs - mknod finish making dirty dentry: %s\n", dentry->d_name.name);
 
     d_instantiate(dentry, inode);
+    ino = inode->i_ino;
 
-    printk("Node created %ld\n", inode->i_ino);
-    return 0;
+stop:
+    vvsfs_journal_stop(dir->i_sb);
+out:
+    trace_vvsfs_create(dir, dentry, ino, err);
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_CREATE, start);
+    return err;
 }
 
 // vvsfs_create - create a new file in a directory
@@ -603,189 +5089,781 @@ static int vvsfs_create(struct inode *dir,
                         umode_t mode,
                         bool excl)
 {
-    struct vvsfs_inode dirdata;
-    int num_dirs;
-    struct vvsfs_dir_entry *dent;
-
+    u64 start = vvsfs_lat_start(dir->i_sb);
     struct inode *inode;
+    unsigned long ino = 0;
+    int err = -ENAMETOOLONG;
 
-    if (DEBUG)
-        printk("vvsfs - create : %s\n", dentry->d_name.name);
+    if (dentry->d_name.len > MAXNAME)
+        goto out;
 
-    inode = vvsfs_new_inode(dir, mode | S_IFREG, 0);
+    vvsfs_journal_start(dir->i_sb);
+    err = -ENOSPC;
+    inode = vvsfs_new_inode(dir, mode | S_IFREG);
     if (!inode)
-        return -ENOSPC;
+        goto stop;
     inode->i_op = &vvsfs_file_inode_operations;
     inode->i_fop = &vvsfs_file_operations;
+    inode->i_mapping->a_ops = &vvsfs_aops;
 
-    /* get an vfs inode */
-    if (!dir)
-        return -1;
+    err = vvsfs_add_entry(dir, &dentry->d_name, inode);
+    if (err)
+    {
+        inode_dec_link_count(inode);
+        iput(inode);
+        goto stop;
+    }
 
-    vvsfs_readblock(dir->i_sb, dir->i_ino, &dirdata);
-    num_dirs = dirdata.size / sizeof(struct vvsfs_dir_entry);
-    dent = (struct vvsfs_dir_entry *)((dirdata.data) +
-                                      num_dirs * sizeof(struct vvsfs_dir_entry));
+    mark_inode_dirty(dir);
+    mark_inode_dirty(inode);
 
-    strncpy(dent->name, dentry->d_name.name, dentry->d_name.len);
-    dent->name[dentry->d_name.len] = '\0';
+    d_instantiate(dentry, inode);
+    ino = inode->i_ino;
 
-    dirdata.size = (num_dirs + 1) * sizeof(struct vvsfs_dir_entry);
+stop:
+    vvsfs_journal_stop(dir->i_sb);
+out:
+    trace_vvsfs_create(dir, dentry, ino, err);
+    vvsfs_lat_end(dir->i_sb, VVSFS_OP_CREATE, start);
+    return err;
+}
 
-    // update i_size
-    dir->i_size = dirdata.size;
+// vvsfs_dio_read_end_io - account a finished direct read
+static int vvsfs_dio_read_end_io(struct kiocb *iocb, ssize_t size, int error,
+                                 unsigned flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
 
-    dent->inode_number = inode->i_ino;
+    if (error || size <= 0)
+        return error;
+    vvsfs_stat_add(inode->i_sb, VVSFS_STAT_READS, size >> inode->i_blkbits);
+    return 0;
+}
 
-    vvsfs_info.file_count++;
+static const struct iomap_dio_ops vvsfs_dio_read_ops = {
+    .end_io = vvsfs_dio_read_end_io,
+};
 
-    vvsfs_writeblock(dir->i_sb, dir->i_ino, &dirdata);
+// vvsfs_dio_write_end_io - account a finished direct write, mark any
+//                          unwritten blocks it wrote written, and move the
+//                          end of the file out past it if it extended it.
+//                          Asynchronous writes finish here (in process
+//                          context) without i_rwsem, so the size is changed
+//                          under i_meta_sem.
+static int vvsfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+                                  unsigned flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int bits = inode->i_blkbits;
+    loff_t old_size;
 
-    mark_inode_dirty(dir);
+    if (error || size <= 0)
+        return error;
+    if (flags & IOMAP_DIO_UNWRITTEN)
+    {
+        error = vvsfs_convert_range(inode, iocb->ki_pos >> bits,
+                                    DIV_ROUND_UP(size, inode->i_sb->s_blocksize));
+        if (error)
+            return error;
+    }
+
+    vvsfs_stat_add(inode->i_sb, VVSFS_STAT_WRITES, size >> inode->i_blkbits);
+    down_write(&ei->i_meta_sem);
+    old_size = i_size_read(inode);
+    if (iocb->ki_pos + size > old_size)
+    {
+        i_size_write(inode, iocb->ki_pos + size);
+        vvsfs_stat_add(inode->i_sb, VVSFS_STAT_BYTES, iocb->ki_pos + size - old_size);
+    }
+    up_write(&ei->i_meta_sem);
     mark_inode_dirty(inode);
+    return 0;
+}
 
-    d_instantiate(dentry, inode);
+static const struct iomap_dio_ops vvsfs_dio_write_ops = {
+    .end_io = vvsfs_dio_write_end_io,
+};
 
-    printk("File created %ld\n", inode->i_ino);
-    return 0;
+// vvsfs_direct_read - read straight into the caller's buffer. iomap checks
+//                     that it lines up with the device's sectors. Inline
+//                     files have no blocks to read from and return -ENOTBLK.
+static ssize_t vvsfs_direct_read(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!iov_iter_count(to))
+        return 0;
+    inode_lock_shared(inode);
+    if (vvsfs_inode_is_inline(inode))
+        ret = -ENOTBLK;
+    else
+    {
+        file_accessed(iocb->ki_filp);
+        ret = iomap_dio_rw(iocb, to, &vvsfs_iomap_ops, &vvsfs_dio_read_ops);
+    }
+    inode_unlock_shared(inode);
+    return ret;
 }
 
-// vvsfs_file_write - write to a file
-static ssize_t vvsfs_file_write(struct file *filp,
-                                const char *buf,
-                                size_t count,
-                                loff_t *ppos)
+// vvsfs_direct_write - write straight from the caller's buffer. Writes that
+//                      do not cover whole file system blocks, or that would
+//                      fit in an inline file, return -ENOTBLK to be written
+//                      through the page cache instead.
+static ssize_t vvsfs_direct_write(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct vvsfs_inode filedata;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
-    struct inode *inode = filp->f_dentry->d_inode;
-#else
-    struct inode *inode = filp->f_path.dentry->d_inode;
-#endif
-    ssize_t pos;
-    struct super_block *sb;
-    char *p;
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    ssize_t ret;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    if ((iocb->ki_pos | iov_iter_count(from)) & (inode->i_sb->s_blocksize - 1) ||
+        (vvsfs_inode_is_inline(inode) &&
+         vvsfs_fits_inline(inode, iocb->ki_pos + iov_iter_count(from))))
+    {
+        ret = -ENOTBLK;
+        goto out;
+    }
+    ret = file_remove_privs(file);
+    if (ret)
+        goto out;
+    ret = file_update_time(file);
+    if (ret)
+        goto out;
+    if (vvsfs_inode_is_inline(inode))
+    {
+        ret = vvsfs_uninline(inode);
+        if (ret)
+            goto out;
+    }
+    // iomap writes back and drops any cached pages in the range, and syncs
+    // the write when the file asks for it
+    ret = iomap_dio_rw(iocb, from, &vvsfs_iomap_ops, &vvsfs_dio_write_ops);
+out:
+    inode_unlock(inode);
+    return ret;
+}
 
-    if (DEBUG)
-        printk("vvsfs - file write - count : %zu ppos %Ld\n",
-               count, *ppos);
+// vvsfs_file_read_iter - direct or page cache reads, traced and timed
+static ssize_t vvsfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 start = vvsfs_lat_start(inode->i_sb);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    ssize_t ret = -ENOTBLK;
+
+    if (iocb->ki_flags & IOCB_DIRECT)
+        ret = vvsfs_direct_read(iocb, to);
+    if (ret == -ENOTBLK)
+    {
+        // the generic path would hand IOCB_DIRECT to noop_direct_IO
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        ret = generic_file_read_iter(iocb, to);
+    }
+    trace_vvsfs_read(inode, pos, count, ret);
+    vvsfs_lat_end(inode->i_sb, VVSFS_OP_READ, start);
+    return ret;
+}
 
-    if (!inode)
+// vvsfs_buffered_write - write to the page cache. Writes that keep an
+//                        inline file inline go through write_begin
+//                        and write_end; the rest go through iomap, which
+//                        maps (or allocates) a whole extent at a time rather
+//                        than a block per call to vvsfs_get_block.
+static ssize_t vvsfs_buffered_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    loff_t old_size;
+    ssize_t ret;
+
+    inode_lock(inode);
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    ret = file_remove_privs(file);
+    if (ret)
+        goto out;
+    ret = file_update_time(file);
+    if (ret)
+        goto out;
+
+    current->backing_dev_info = inode_to_bdi(inode);
+    old_size = i_size_read(inode);
+    if (vvsfs_inode_is_inline(inode) &&
+        vvsfs_fits_inline(inode, iocb->ki_pos + iov_iter_count(from)))
     {
-        printk("vvsfs - Problem with file inode\n");
-        return -EINVAL;
+        ret = generic_perform_write(file, from, iocb->ki_pos);
+    }
+    else
+    {
+        ret = vvsfs_inode_is_inline(inode) ? vvsfs_uninline(inode) : 0;
+        if (!ret && vvsfs_is_reflink(inode))
+            ret = vvsfs_unshare(inode, iocb->ki_pos, iov_iter_count(from));
+        if (!ret)
+            ret = iomap_file_buffered_write(iocb, from, &vvsfs_iomap_ops);
+        // vvsfs_write_end counts the growth of inline files
+        if (i_size_read(inode) > old_size)
+        {
+            vvsfs_stat_add(inode->i_sb, VVSFS_STAT_BYTES, i_size_read(inode) - old_size);
+            mark_inode_dirty(inode);
+        }
     }
+    current->backing_dev_info = NULL;
+    if (ret > 0)
+        iocb->ki_pos += ret;
+out:
+    inode_unlock(inode);
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    return ret;
+}
 
-    if (!(S_ISREG(inode->i_mode)))
+// vvsfs_file_write_iter - direct or page cache writes, traced and timed
+static ssize_t vvsfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 start = vvsfs_lat_start(inode->i_sb);
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    ssize_t ret = -ENOTBLK;
+    int err;
+
+    if (iocb->ki_flags & IOCB_DIRECT)
+        ret = vvsfs_direct_write(iocb, from);
+    if (ret == -ENOTBLK)
     {
-        printk("vvsfs - not regular file\n");
-        return -EINVAL;
+        ret = vvsfs_buffered_write(iocb, from);
+        // a direct write that fell back still leaves nothing cached
+        if (ret > 0 && (iocb->ki_flags & IOCB_DIRECT))
+        {
+            err = filemap_write_and_wait_range(inode->i_mapping, iocb->ki_pos - ret,
+                                               iocb->ki_pos - 1);
+            if (err)
+                ret = err;
+            else
+                invalidate_mapping_pages(inode->i_mapping,
+                                         (iocb->ki_pos - ret) >> PAGE_SHIFT,
+                                         (iocb->ki_pos - 1) >> PAGE_SHIFT);
+        }
+    }
+    trace_vvsfs_write(inode, pos, count, ret);
+    vvsfs_lat_end(inode->i_sb, VVSFS_OP_WRITE, start);
+    return ret;
+}
+
+// vvsfs_page_mkwrite - a shared page of a file is about to be written
+//                      through a mapping; give it blocks of its own first
+static vm_fault_t vvsfs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct page *page = vmf->page;
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    vm_fault_t ret = VM_FAULT_LOCKED;
+    int err = 0;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    if (vvsfs_is_reflink(inode))
+        err = vvsfs_unshare(inode, page_offset(page), PAGE_SIZE);
+    lock_page(page);
+    if (page->mapping != inode->i_mapping)
+    {
+        unlock_page(page);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
     }
-    if (*ppos > inode->i_size || count <= 0)
+    if (err)
     {
-        printk("vvsfs - attempting to write over the end of a file.\n");
-        return 0;
+        unlock_page(page);
+        ret = vmf_error(err);
+        goto out;
     }
-    sb = inode->i_sb;
+    set_page_dirty(page);
+    wait_for_stable_page(page);
+out:
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
 
-    vvsfs_readblock(sb, inode->i_ino, &filedata);
+static const struct vm_operations_struct vvsfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = vvsfs_page_mkwrite,
+};
 
-    if (filp->f_flags & O_APPEND)
-        pos = inode->i_size;
-    else
-        pos = *ppos;
+// vvsfs_file_mmap - generic_file_mmap, with copy on write of shared blocks
+static int vvsfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &vvsfs_file_vm_ops;
+    return 0;
+}
 
-    if (pos + count > MAXFILESIZE)
-        return -ENOSPC;
+// vvsfs_remap_blocks - map count file blocks of dst from dlblk to the device
+//                      blocks that hold file blocks of src from slblk, taking
+//                      a reference to each. Holes and unwritten blocks in src
+//                      leave holes in dst. Each source extent (or hole),
+//                      cut where the extents of dst it replaces end, is
+//                      remapped in a handle of its own, which shares its
+//                      blocks before it frees the blocks of dst they
+//                      replace, so a failure leaves the rest of dst as it
+//                      was.
+static int vvsfs_remap_blocks(struct inode *src, u32 slblk,
+                              struct inode *dst, u32 dlblk, u32 count)
+{
+    struct super_block *sb = dst->i_sb;
+    struct vvsfs_inode_info *si = VVSFS_I(src), *di = VVSFS_I(dst);
+    sector_t block, dblock;
+    long shared;
+    u32 n, dn, flags;
+    int err = 0;
+
+    for (; count && !err; slblk += n, dlblk += n, count -= n)
+    {
+        // the source is held still so that its blocks cannot be freed or
+        // copied away before they have the new reference
+        vvsfs_journal_start(sb);
+        if (src != dst)
+        {
+            down_read(&si->i_meta_sem);
+            down_write_nested(&di->i_meta_sem, SINGLE_DEPTH_NESTING);
+        }
+        else
+            down_write(&di->i_meta_sem);
+
+        // unwritten blocks read as zeros, so they are left as a hole
+        block = vvsfs_map_extent(si, slblk, &n, &flags);
+        n = min(n, count);
+        if (flags & VVSFS_EXTENT_UNWRITTEN)
+            block = 0;
+        // and the blocks of dst it replaces are freed in one step, so
+        // that the handle has room for them
+        dblock = vvsfs_map_extent(di, dlblk, &dn, NULL);
+        n = min(n, dn);
+        if (dblock)
+            n = min_t(unsigned long, n, VVSFS_COUNTS_PER_BLOCK(sb) -
+                      (dblock - VVSFS_SB(sb)->s_data_start) %
+                      VVSFS_COUNTS_PER_BLOCK(sb));
+        // a split by the punch, and a new extent for the shared blocks:
+        // with room for both, nothing can fail once the blocks are shared
+        err = vvsfs_extent_room(sb, di, block ? 2 : 1);
+        if (!err && block)
+        {
+            shared = vvsfs_share_blocks(sb, block, n);
+            if (shared < 0)
+                err = shared;
+            else
+                n = shared;
+        }
+        if (!err)
+        {
+            vvsfs_punch_extents(sb, di, dlblk, n, 1);
+            if (block)
+                vvsfs_insert_extent(di, dlblk, block, n, 0);
+            err = vvsfs_commit_extents(dst);
+        }
 
-    filedata.size = pos + count;
-    p = filedata.data + pos;
-    if (copy_from_user(p, buf, count))
-        return -ENOSPC;
-    *ppos = pos;
-    buf += count;
+        up_write(&di->i_meta_sem);
+        if (src != dst)
+            up_read(&si->i_meta_sem);
+        vvsfs_journal_stop(sb);
+    }
+    return err;
+}
 
-    vvsfs_info.size += count;
-    inode->i_size = filedata.size;
-    inode->i_mode = filedata.i_mode;
-    vvsfs_writeblock(sb, inode->i_ino, &filedata);
+// vvsfs_set_reflink - mark a file as possibly sharing blocks
+static int vvsfs_set_reflink(struct inode *inode)
+{
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    int err = 0;
 
-    if (DEBUG)
-        printk("vvsfs - file write done : %zu ppos %Ld\n", count, *ppos);
+    if (ei->i_flags & VVSFS_INODE_REFLINK)
+        return 0;
+    vvsfs_journal_start(inode->i_sb);
+    down_write(&ei->i_meta_sem);
+    ei->i_flags |= VVSFS_INODE_REFLINK;
+    err = vvsfs_update_inode(inode);
+    up_write(&ei->i_meta_sem);
+    vvsfs_journal_stop(inode->i_sb);
+    return err;
+}
 
-    return count;
+// vvsfs_remap_file_range - share the blocks under a range of file_in with
+//                          a range of file_out (FICLONE, FICLONERANGE,
+//                          cp --reflink), or with REMAP_FILE_DEDUP only if
+//                          the two ranges already hold the same data. No
+//                          data is copied: both files map the same blocks,
+//                          and whichever is written first gets copies of
+//                          the blocks it writes. Returns the bytes remapped.
+static loff_t vvsfs_remap_file_range(struct file *file_in, loff_t pos_in,
+                                     struct file *file_out, loff_t pos_out,
+                                     loff_t len, unsigned int remap_flags)
+{
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    struct super_block *sb = dst->i_sb;
+    unsigned int bits = sb->s_blocksize_bits;
+    loff_t old_size, ret;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN |
+                        REMAP_FILE_ADVISORY))
+        return -EINVAL;
+
+    lock_two_nondirectories(src, dst);
+    // only data in blocks can be shared
+    ret = vvsfs_inode_is_inline(src) ? vvsfs_uninline(src) : 0;
+    if (!ret && vvsfs_inode_is_inline(dst))
+        ret = vvsfs_uninline(dst);
+    if (ret)
+        goto out;
+
+    // checks the ranges, writes back both, and for a dedup compares them
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+                                        &len, remap_flags);
+    if (ret < 0 || len == 0)
+        goto out;
+    // a range ending at the source's EOF maps its whole last block, which
+    // would hide data of the destination past the end of the range
+    if (((pos_out + len) & (sb->s_blocksize - 1)) &&
+        pos_out + len < i_size_read(dst))
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = vvsfs_set_reflink(src);
+    if (!ret)
+        ret = vvsfs_set_reflink(dst);
+    if (ret)
+        goto out;
+
+    // whole pages go, as a partial one would only be zeroed; with blocks
+    // smaller than a page, the rest of it was written back by the prep
+    truncate_inode_pages_range(dst->i_mapping, round_down(pos_out, PAGE_SIZE),
+                               PAGE_ALIGN(pos_out + len) - 1);
+    ret = vvsfs_remap_blocks(src, pos_in >> bits, dst, pos_out >> bits,
+                             (len + sb->s_blocksize - 1) >> bits);
+    if (ret)
+        goto out;
+
+    old_size = i_size_read(dst);
+    if (pos_out + len > old_size)
+    {
+        i_size_write(dst, pos_out + len);
+        vvsfs_stat_add(sb, VVSFS_STAT_BYTES, pos_out + len - old_size);
+    }
+    mark_inode_dirty(dst);
+    ret = len;
+out:
+    unlock_two_nondirectories(src, dst);
+    return ret;
 }
 
-// vvsfs_file_read - read data from a file
-static ssize_t vvsfs_file_read(struct file *filp,
-                               char *buf,
-                               size_t count,
-                               loff_t *ppos)
+// vvsfs_prealloc - allocate unwritten blocks for the holes among file
+//                  blocks lblk..lblk+count-1, one run of free blocks per
+//                  handle. Blocks already mapped are left as they are. The
+//                  file is first marked VVSFS_INODE_PREALLOC.
+static int vvsfs_prealloc(struct inode *inode, u32 lblk, u32 count)
 {
-    struct vvsfs_inode filedata;
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
-    struct inode *inode = filp->f_dentry->d_inode;
-#else
-    struct inode *inode = filp->f_path.dentry->d_inode;
-#endif
-    char *start;
-    ssize_t offset, size;
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    u32 n;
+    int err;
 
-    struct super_block *sb;
+    err = vvsfs_set_prealloc(inode);
+
+    for (; count && !err; lblk += n, count -= n)
+    {
+        vvsfs_journal_start(sb);
+        down_write(&ei->i_meta_sem);
+        if (!vvsfs_map_extent(ei, lblk, &n, NULL))
+        {
+            n = min(n, count);
+            if (vvsfs_alloc_extent(sb, ei, lblk, &n, VVSFS_EXTENT_UNWRITTEN))
+                err = vvsfs_commit_extents(inode);
+            else
+                err = -ENOSPC;
+        }
+        n = min(n, count);
+        up_write(&ei->i_meta_sem);
+        vvsfs_journal_stop(sb);
+    }
+    return err;
+}
 
-    if (DEBUG)
-        printk("vvsfs - file read - count : %zu ppos %Ld\n", count, *ppos);
+// vvsfs_zero_partial - zero the partial blocks at either end of bytes
+//                      start..end-1 through the page cache, giving shared
+//                      blocks copies of their own first. Holes and unwritten
+//                      blocks already read as zeros and are skipped.
+static int vvsfs_zero_partial(struct inode *inode, loff_t start, loff_t end)
+{
+    loff_t bs = inode->i_sb->s_blocksize;
+    loff_t head = min_t(loff_t, round_up(start, bs), end);
+    loff_t tail = max_t(loff_t, round_down(end, bs), head);
+    int err = 0;
 
-    if (!inode)
+    if (vvsfs_is_reflink(inode))
     {
-        printk("vvsfs - Problem with file inode\n");
-        return -EINVAL;
+        if (start < head)
+            err = vvsfs_unshare(inode, start, head - start);
+        if (!err && tail < end)
+            err = vvsfs_unshare(inode, tail, end - tail);
     }
+    if (!err && start < head)
+        err = iomap_zero_range(inode, start, head - start, NULL, &vvsfs_iomap_ops);
+    if (!err && tail < end)
+        err = iomap_zero_range(inode, tail, end - tail, NULL, &vvsfs_iomap_ops);
+    return err;
+}
 
-    if (!(S_ISREG(inode->i_mode)))
+// vvsfs_fallocate - preallocate blocks, punch holes (FALLOC_FL_PUNCH_HOLE)
+//                   or zero ranges (FALLOC_FL_ZERO_RANGE) without writing
+//                   the data. Preallocated blocks are unwritten extents,
+//                   which read as zeros, so none of this costs more than
+//                   the metadata; only the partial blocks at the ends of a
+//                   punched or zeroed range are zeroed in the page cache.
+static long vvsfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    unsigned int bits = sb->s_blocksize_bits;
+    loff_t end = offset + len, start, stop, old_size;
+    long err;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP;
+    if (!S_ISREG(inode->i_mode))
+        return -EOPNOTSUPP;
+
+    inode_lock(inode);
+    old_size = i_size_read(inode);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > old_size)
     {
-        printk("vvsfs - not regular file\n");
-        return -EINVAL;
+        err = inode_newsize_ok(inode, end);
+        if (err)
+            goto out;
     }
-    if (*ppos > inode->i_size || count <= 0)
+    // only files in blocks have extents to work with
+    err = vvsfs_inode_is_inline(inode) ? vvsfs_uninline(inode) : 0;
+    if (err)
+        goto out;
+    // direct I/O in flight may still be writing the blocks
+    inode_dio_wait(inode);
+
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
     {
-        printk("vvsfs - attempting to write over the end of a file.\n");
-        return 0;
+        // nothing past the end of the file needs zeroing
+        if (offset < old_size)
+            err = vvsfs_zero_partial(inode, offset, min(end, old_size));
+        if (err)
+            goto out;
+
+        start = round_up(offset, sb->s_blocksize);
+        stop = round_down(end, sb->s_blocksize);
+        if (start < stop)
+        {
+            truncate_pagecache_range(inode, start, stop - 1);
+            vvsfs_journal_start(sb);
+            down_write(&ei->i_meta_sem);
+            // a hole punched part way by a crash is still a hole
+            while ((err = vvsfs_punch_extents(sb, ei, start >> bits,
+                                              (stop - start) >> bits, 1)) == -EAGAIN)
+            {
+                err = vvsfs_extents_restart(inode);
+                if (err)
+                    break;
+            }
+            if (!err)
+                err = vvsfs_commit_extents(inode);
+            up_write(&ei->i_meta_sem);
+            vvsfs_journal_stop(sb);
+            if (!err && (mode & FALLOC_FL_ZERO_RANGE))
+                err = vvsfs_prealloc(inode, start >> bits, (stop - start) >> bits);
+        }
     }
-    sb = inode->i_sb;
-
-    printk("r : readblock\n");
-    vvsfs_readblock(sb, inode->i_ino, &filedata);
-
-    start = buf;
-    printk("rr\n");
-    size = MIN(inode->i_size - *ppos, count);
+    else
+        err = vvsfs_prealloc(inode, offset >> bits,
+                             ((end + sb->s_blocksize - 1) >> bits) - (offset >> bits));
+    if (err)
+        goto out;
 
-    printk("readblock : %zu\n", size);
-    offset = *ppos;
-    *ppos += size;
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > old_size)
+    {
+        i_size_write(inode, end);
+        vvsfs_stat_add(sb, VVSFS_STAT_BYTES, end - old_size);
+    }
+    inode->i_ctime = inode->i_mtime = current_time(inode);
+    mark_inode_dirty(inode);
+out:
+    inode_unlock(inode);
+    return err;
+}
 
-    printk("r copy_to_user\n");
+// vvsfs_file_llseek - SEEK_HOLE and SEEK_DATA walk the extents, skipping
+//                     holes and unwritten blocks that have no data in the
+//                     page cache. An inline file is all data.
+static loff_t vvsfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file_inode(file);
 
-    if (copy_to_user(buf, filedata.data + offset, size))
-        return -EIO;
-    buf += size;
+    if (whence != SEEK_HOLE && whence != SEEK_DATA)
+        return generic_file_llseek(file, offset, whence);
 
-    printk("r return\n");
-    return size;
+    inode_lock_shared(inode);
+    if (vvsfs_inode_is_inline(inode))
+    {
+        offset = generic_file_llseek(file, offset, whence);
+        inode_unlock_shared(inode);
+        return offset;
+    }
+    if (whence == SEEK_HOLE)
+        offset = iomap_seek_hole(inode, offset, &vvsfs_iomap_ops);
+    else
+        offset = iomap_seek_data(inode, offset, &vvsfs_iomap_ops);
+    inode_unlock_shared(inode);
+    if (offset < 0)
+        return offset;
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
 }
 
 static struct file_operations vvsfs_file_operations =
     {
-        read : vvsfs_file_read,   /* read */
-        write : vvsfs_file_write, /* write */
-        mmap : generic_file_mmap,
+        .llseek = vvsfs_file_llseek,
+        .read_iter = vvsfs_file_read_iter,
+        .write_iter = vvsfs_file_write_iter,
+        .mmap = vvsfs_file_mmap,
+        .fsync = vvsfs_fsync,
+        // splice and sendfile move page cache pages to and from pipes
+        // through read_iter and write_iter; copy_file_range first tries to
+        // share the blocks with remap_file_range and otherwise splices
+        // from one file to the other in the kernel
+        .splice_read = generic_file_splice_read,
+        .splice_write = iter_file_splice_write,
+        .copy_file_range = generic_copy_file_range,
+        .remap_file_range = vvsfs_remap_file_range,
+        .fallocate = vvsfs_fallocate,
     };
 
 static struct inode_operations vvsfs_file_inode_operations = {
     .setattr = vvsfs_setattr,
 };
 
+// vvsfs_sync_block - write out a cached metadata block if it is dirty
+static int vvsfs_sync_block(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh;
+    int err = 0;
+
+    bh = sb_find_get_block(sb, block);
+    if (!bh)
+        return 0;
+    if (buffer_dirty(bh) && sync_dirty_buffer(bh))
+        err = -EIO;
+    brelse(bh);
+    return err;
+}
+
+// vvsfs_sync_extents - write out the metadata blocks an inode's extents lead
+//                      to: every block of an indexed directory (its index
+//                      root and nodes and its leaves), and, for a file that
+//                      shares blocks, the refcount table blocks holding the
+//                      counts of the blocks it maps
+static int vvsfs_sync_extents(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+    int dx = ei->i_flags & VVSFS_INODE_INDEX;
+    sector_t block, last = 0;
+    struct vvsfs_extent *e;
+    int k, err = 0, err2;
+    u32 n;
+
+    if (!dx && !vvsfs_is_reflink(inode))
+        return 0;
+    down_read(&ei->i_meta_sem);
+    for (k = 0; k < ei->i_extent_count; k++)
+    {
+        e = &ei->i_ext[k];
+        for (n = 0; n < e->e_len; n++)
+        {
+            if (dx)
+                block = e->e_pblk + n;
+            else
+                block = sbi->s_refcount_start + (e->e_pblk + n - sbi->s_data_start) /
+                        VVSFS_COUNTS_PER_BLOCK(sb);
+            // neighbouring blocks mostly share a table block
+            if (block == last)
+                continue;
+            last = block;
+            err2 = vvsfs_sync_block(sb, block);
+            if (!err)
+                err = err2;
+        }
+    }
+    up_read(&ei->i_meta_sem);
+    return err;
+}
+
+// vvsfs_fsync - make a file durable. Besides the data and the inode this
+//               writes the extent overflow block, the blocks of an indexed
+//               directory, the counts of shared blocks and the allocation
+//               bitmaps, which are left dirty in the buffer cache under
+//               writeback=async (with a journal, it commits the running
+//               transaction instead), and then flushes the device cache.
+static int vvsfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    u64 begin = vvsfs_lat_start(sb);
+    sector_t extent_block;
+    int err, err2;
+
+    err = __generic_file_fsync(file, start, end, datasync);
+    if (err)
+        goto out;
+
+    // with a journal the inode's blocks are in the running transaction
+    if (sbi->s_journal)
+    {
+        err = vvsfs_commit(sb);
+        goto flush;
+    }
+
+    err = vvsfs_sync_block(sb, vvsfs_inode_block(sb, inode->i_ino));
+    extent_block = VVSFS_I(inode)->i_extent_block;
+    if (extent_block)
+    {
+        err2 = vvsfs_sync_block(sb, extent_block);
+        if (!err)
+            err = err2;
+    }
+    err2 = vvsfs_bitmap_sync(&sbi->s_imap, 1);
+    if (!err)
+        err = err2;
+    err2 = vvsfs_bitmap_sync(&sbi->s_bmap, 1);
+    if (!err)
+        err = err2;
+    err2 = vvsfs_sync_extents(inode);
+    if (!err)
+        err = err2;
+
+flush:
+    err2 = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+    if (!err && err2 != -EOPNOTSUPP)
+        err = err2;
+
+out:
+    vvsfs_lat_end(sb, VVSFS_OP_FSYNC, begin);
+    return err;
+}
+
 static struct file_operations vvsfs_dir_operations =
     {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
@@ -794,7 +5872,7 @@ static struct file_operations vvsfs_dir_operations =
         .llseek = generic_file_llseek,
         .read = generic_read_dir,
         .iterate = vvsfs_readdir,
-        .fsync = generic_file_fsync,
+        .fsync = vvsfs_fsync,
 #endif
 };
 
@@ -804,6 +5882,7 @@ static struct inode_operations vvsfs_dir_inode_operations = {
     mkdir : vvsfs_mkdir,
     rmdir : vvsfs_rmdir,
     mknod : vvsfs_mknod,
+    rename : vvsfs_rename,
     setattr : vvsfs_setattr,
     lookup : vvsfs_lookup, /* lookup */
 };
@@ -813,13 +5892,7 @@ static struct inode_operations vvsfs_dir_inode_operations = {
 struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
 {
     struct inode *inode;
-    struct vvsfs_inode filedata;
-
-    if (DEBUG)
-    {
-        printk("vvsfs - iget - ino : %d", (unsigned int)ino);
-        printk(" super %p\n", sb);
-    }
+    int err;
 
     inode = iget_locked(sb, ino);
     if (!inode)
@@ -827,12 +5900,13 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     if (!(inode->i_state & I_NEW))
         return inode;
 
-    // get the uid/gid/mode data
-    vvsfs_readblock(inode->i_sb, inode->i_ino, &filedata);
-    i_uid_write(inode, filedata.i_uid);
-    i_gid_write(inode, filedata.i_gid);
-    inode->i_mode = filedata.i_mode;
-    inode->i_size = filedata.size;
+    // get the uid/gid/mode data and the block map
+    err = vvsfs_read_inode(inode);
+    if (err)
+    {
+        iget_failed(inode);
+        return ERR_PTR(err);
+    }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
     inode->i_ctime = inode->i_mtime = inode->i_atime = CURRENT_TIME;
@@ -840,7 +5914,7 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     inode->i_ctime = inode->i_mtime = inode->i_atime = current_time(inode);
 #endif
 
-    if (filedata.is_directory)
+    if (S_ISDIR(inode->i_mode))
     {
         inode->i_op = &vvsfs_dir_inode_operations;
         inode->i_fop = &vvsfs_dir_operations;
@@ -849,23 +5923,510 @@ struct inode *vvsfs_iget(struct super_block *sb, unsigned long ino)
     {
         inode->i_op = &vvsfs_file_inode_operations;
         inode->i_fop = &vvsfs_file_operations;
+        inode->i_mapping->a_ops = &vvsfs_aops;
     }
 
     unlock_new_inode(inode);
     return inode;
 }
 
-// vvsfs_fill_super - read the super block (this is simple as we do not
-//                    have one in this file system)
+enum
+{
+    Opt_writeback_sync,
+    Opt_writeback_async,
+    Opt_latency,
+    Opt_inode_readahead,
+    Opt_notail,
+    Opt_err
+};
+
+static const match_table_t vvsfs_tokens = {
+    {Opt_writeback_sync, "writeback=sync"},
+    {Opt_writeback_async, "writeback=async"},
+    {Opt_latency, "latency"},
+    {Opt_inode_readahead, "inode_readahead=%u"},
+    {Opt_notail, "notail"},
+    {Opt_err, NULL}};
+
+// vvsfs_parse_options - read the mount options. writeback=sync (the default)
+//                       writes each metadata block as it changes;
+//                       writeback=async leaves them to normal writeback,
+//                       with sync_fs and fsync providing durability.
+//                       latency keeps per-operation latency histograms.
+//                       inode_readahead=<blocks> sets the window of the
+//                       inode table read ahead on a miss; 0 turns off all
+//                       readahead, including that of the bitmaps at mount.
+//                       notail keeps files that outgrow their inode from
+//                       being packed into tail blocks.
+static int vvsfs_parse_options(char *options, struct vvsfs_sb_info *sbi)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int n;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL)
+    {
+        if (!*p)
+            continue;
+        switch (match_token(p, vvsfs_tokens, args))
+        {
+        case Opt_writeback_sync:
+            sbi->s_mount_opt &= ~VVSFS_MOUNT_ASYNC;
+            break;
+        case Opt_writeback_async:
+            sbi->s_mount_opt |= VVSFS_MOUNT_ASYNC;
+            break;
+        case Opt_latency:
+            sbi->s_mount_opt |= VVSFS_MOUNT_LATENCY;
+            break;
+        case Opt_inode_readahead:
+            if (match_int(&args[0], &n) || n < 0)
+                return -EINVAL;
+            sbi->s_inode_ra = n;
+            break;
+        case Opt_notail:
+            sbi->s_mount_opt |= VVSFS_MOUNT_NOTAIL;
+            break;
+        default:
+            printk("vvsfs - unrecognised mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+// vvsfs_journal_revoked - whether one of the revoke blocks in log blocks
+//                         from..to-1 names block; -EIO if one is unreadable
+static int vvsfs_journal_revoked(struct super_block *sb, struct vvsfs_journal *j,
+                                 unsigned int from, unsigned int to, u32 block)
+{
+    struct vvsfs_journal_revoke *revoke;
+    struct buffer_head *bh;
+    unsigned int pos, k;
+    int found = 0;
+
+    for (pos = from; pos < to && !found; pos++)
+    {
+        bh = vvsfs_bread(sb, j->j_start + pos);
+        if (!bh)
+            return -EIO;
+        revoke = (struct vvsfs_journal_revoke *)bh->b_data;
+        for (k = 0; k < revoke->r_header.h_count && !found; k++)
+            found = revoke->r_blocks[k] == block;
+        brelse(bh);
+    }
+    return found;
+}
+
+// vvsfs_journal_replay - copy a complete transaction in the log back to its
+//                        home blocks, except for those it revoked. A log
+//                        with no commit block for its descriptors (the
+//                        commit was cut short) is ignored.
+static int vvsfs_journal_replay(struct super_block *sb, struct vvsfs_journal *j)
+{
+    struct vvsfs_super_block *vs = VVSFS_SB(sb)->s_vs;
+    struct vvsfs_journal_header *hdr;
+    struct vvsfs_journal_desc *desc;
+    struct buffer_head *bh, *dbh, *home;
+    unsigned int pos = 0, total = 0, revokes = 0, end = 0, k, n;
+    u32 seq = 0, crc = ~0;
+    int valid = 0, revoked;
+
+    // check the descriptors, and find a commit block that matches them
+    while (pos < j->j_blocks)
+    {
+        bh = vvsfs_bread(sb, j->j_start + pos);
+        if (!bh)
+            return -EIO;
+        hdr = (struct vvsfs_journal_header *)bh->b_data;
+        if (hdr->h_magic != VVSFS_JOURNAL_MAGIC || (pos && hdr->h_seq != seq))
+        {
+            brelse(bh);
+            break;
+        }
+        seq = hdr->h_seq;
+        if (hdr->h_type == VVSFS_JOURNAL_COMMIT)
+        {
+            valid = pos && hdr->h_count == total &&
+                    ((struct vvsfs_journal_commit *)hdr)->c_crc == crc;
+            brelse(bh);
+            break;
+        }
+        n = hdr->h_count;
+        // the revoke blocks follow all of the descriptors and copies
+        if (hdr->h_type == VVSFS_JOURNAL_REVOKE && n && n <= j->j_tags &&
+            pos + 1 < j->j_blocks)
+        {
+            if (!revokes++)
+                end = pos;
+            crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+            brelse(bh);
+            pos++;
+            continue;
+        }
+        if (hdr->h_type != VVSFS_JOURNAL_DESC || revokes || !n ||
+            n > j->j_tags || pos + n + 1 >= j->j_blocks)
+        {
+            brelse(bh);
+            break;
+        }
+        crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+        brelse(bh);
+        for (k = 1; k <= n; k++)
+        {
+            bh = vvsfs_bread(sb, j->j_start + pos + k);
+            if (!bh)
+                return -EIO;
+            crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+            brelse(bh);
+        }
+        pos += n + 1;
+        total += n;
+    }
+    if (!valid)
+        return 0;
+    if (!revokes)
+        end = pos;
+    if (bdev_read_only(sb->s_bdev))
+    {
+        printk("vvsfs - the journal needs a replay, but the device is read-only\n");
+        return -EROFS;
+    }
+
+    for (pos = 0; pos < end; pos += n + 1)
+    {
+        dbh = vvsfs_bread(sb, j->j_start + pos);
+        if (!dbh)
+            return -EIO;
+        desc = (struct vvsfs_journal_desc *)dbh->b_data;
+        n = desc->d_header.h_count;
+        for (k = 0; k < n; k++)
+        {
+            // the log can only ever name metadata blocks outside itself
+            if (desc->d_blocks[k] == VVSFS_SUPER_BLOCK ||
+                desc->d_blocks[k] >= vs->s_block_count ||
+                (desc->d_blocks[k] >= j->j_start &&
+                 desc->d_blocks[k] < j->j_start + j->j_blocks))
+                continue;
+            revoked = vvsfs_journal_revoked(sb, j, end, end + revokes,
+                                            desc->d_blocks[k]);
+            if (revoked < 0)
+            {
+                brelse(dbh);
+                return revoked;
+            }
+            if (revoked)
+                continue;
+            bh = vvsfs_bread(sb, j->j_start + pos + 1 + k);
+            home = sb_getblk(sb, desc->d_blocks[k]);
+            if (!bh || !home)
+            {
+                brelse(bh);
+                brelse(home);
+                brelse(dbh);
+                return -EIO;
+            }
+            lock_buffer(home);
+            memcpy(home->b_data, bh->b_data, sb->s_blocksize);
+            set_buffer_uptodate(home);
+            unlock_buffer(home);
+            mark_buffer_dirty(home);
+            brelse(home);
+            brelse(bh);
+        }
+        brelse(dbh);
+    }
+    printk("vvsfs - replayed %u blocks from the journal\n", total);
+    return sync_blockdev(sb->s_bdev);
+}
+
+// vvsfs_journal_load - set up the journal of a file system that has one,
+//                      replaying the log first unless it was unmounted
+//                      cleanly
+static int vvsfs_journal_load(struct super_block *sb, struct vvsfs_sb_info *sbi)
+{
+    struct vvsfs_super_block *vs = sbi->s_vs;
+    struct vvsfs_journal_header *hdr;
+    struct vvsfs_journal *j;
+    unsigned int k;
+    int err;
+
+    if (!vs->s_journal_blocks)
+        return 0;
+    j = kzalloc(sizeof(struct vvsfs_journal), GFP_KERNEL);
+    if (!j)
+        return -ENOMEM;
+    sbi->s_journal = j;
+    j->j_sb = sb;
+    init_rwsem(&j->j_barrier);
+    mutex_init(&j->j_commit_mutex);
+    spin_lock_init(&j->j_lock);
+    INIT_DELAYED_WORK(&j->j_work, vvsfs_journal_work);
+    j->j_start = vs->s_journal_start;
+    j->j_blocks = vs->s_journal_blocks;
+    j->j_tags = VVSFS_JOURNAL_TAGS(sb->s_blocksize);
+
+    if (!(vs->s_state & VVSFS_STATE_CLEAN))
+    {
+        err = vvsfs_journal_replay(sb, j);
+        if (err)
+            return err;
+    }
+
+    // a journal made before operations reserved their room may be too
+    // small for even one; it is replayed above, but not used
+    j->j_room = vvsfs_journal_room(j);
+    if (j->j_room < VVSFS_HANDLE_BLOCKS)
+    {
+        printk("vvsfs - journal of %u blocks is too small, remake the file "
+               "system with at least %u\n", j->j_blocks, VVSFS_JOURNAL_MIN);
+        return -EINVAL;
+    }
+    // a transaction never outgrows j_room, so nothing here needs to grow
+    j->j_bh = kvmalloc_array(j->j_room, sizeof(struct buffer_head *), GFP_KERNEL);
+    j->j_ckpt = kvmalloc_array(j->j_room, sizeof(struct buffer_head *), GFP_KERNEL);
+    j->j_freed = kvmalloc_array(j->j_room, sizeof(struct vvsfs_freed), GFP_KERNEL);
+    j->j_ckpt_freed = kvmalloc_array(j->j_room, sizeof(struct vvsfs_freed),
+                                     GFP_KERNEL);
+    j->j_log = kcalloc(j->j_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    j->j_home = kcalloc(j->j_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!j->j_bh || !j->j_ckpt || !j->j_freed || !j->j_ckpt_freed ||
+        !j->j_log || !j->j_home)
+        return -ENOMEM;
+    for (k = 0; k < j->j_blocks; k++)
+    {
+        j->j_log[k] = sb_getblk(sb, j->j_start + k);
+        j->j_home[k] = alloc_buffer_head(GFP_KERNEL);
+        if (!j->j_log[k] || !j->j_home[k])
+            return -ENOMEM;
+        set_bh_page(j->j_home[k], j->j_log[k]->b_page, bh_offset(j->j_log[k]));
+        j->j_home[k]->b_size = sb->s_blocksize;
+        j->j_home[k]->b_bdev = sb->s_bdev;
+        set_buffer_mapped(j->j_home[k]);
+    }
+
+    // carry on the sequence from the log, so that no stale commit block
+    // left further along it can match a new transaction
+    j->j_seq = get_random_u32();
+    lock_buffer(j->j_log[0]);
+    if (bh_submit_read(j->j_log[0]) == 0)
+    {
+        hdr = (struct vvsfs_journal_header *)j->j_log[0]->b_data;
+        if (hdr->h_magic == VVSFS_JOURNAL_MAGIC)
+            j->j_seq = hdr->h_seq + 1;
+    }
+    return 0;
+}
+
+// vvsfs_count_inodes - rebuild the file, directory and byte counts from the
+//                      inode table, for a mount after an unclean shutdown.
+//                      The table is read ahead a window at a time.
+static int vvsfs_count_inodes(struct super_block *sb)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    s64 files = 0, dirs = 0, bytes = 0;
+    struct buffer_head *bh;
+    struct vvsfs_inode *di;
+    unsigned long ino;
+
+    for (ino = VVSFS_ROOT_INO + 1; ino < sbi->s_imap.bits; ino++)
+    {
+        if (!vvsfs_bitmap_test(&sbi->s_imap, ino))
+            continue;
+        vvsfs_inode_readahead(sb, ino);
+        di = vvsfs_get_inode(sb, ino, &bh);
+        if (!di)
+            return -EIO;
+        if (S_ISDIR(di->i_mode))
+            dirs++;
+        else if (!di->is_empty)
+        {
+            files++;
+            bytes += di->size;
+        }
+        brelse(bh);
+        cond_resched();
+    }
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_FILES], files);
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_DIRS], dirs);
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_BYTES], bytes);
+    return 0;
+}
+
+// vvsfs_load_super - read and check the on-disk super block and pin the
+//                    allocation bitmaps
+static int vvsfs_load_super(struct super_block *s, struct vvsfs_sb_info *sbi)
+{
+    struct vvsfs_super_block *vs;
+    struct blk_plug plug;
+    unsigned long k;
+    unsigned int bs;
+    int clean, err;
+
+    sbi->s_sbh = vvsfs_bread(s, VVSFS_SUPER_BLOCK);
+    if (!sbi->s_sbh)
+    {
+        printk("vvsfs - unable to read super block\n");
+        return -EIO;
+    }
+    vs = (struct vvsfs_super_block *)sbi->s_sbh->b_data;
+    sbi->s_vs = vs;
+
+    if (vs->s_magic != VVSFS_MAGIC)
+    {
+        printk("vvsfs - bad magic number\n");
+        return -EINVAL;
+    }
+    if (vs->s_version != VVSFS_VERSION)
+    {
+        printk("vvsfs - unsupported version %u\n", vs->s_version);
+        return -EINVAL;
+    }
+
+    // switch to the file system's block size; its first block still
+    // starts with the super block
+    bs = vs->s_block_size;
+    if (bs != s->s_blocksize)
+    {
+        brelse(sbi->s_sbh);
+        sbi->s_sbh = NULL;
+        if (bs < VVSFS_MIN_BLOCKSIZE || bs > VVSFS_MAX_BLOCKSIZE ||
+            !is_power_of_2(bs) || !sb_set_blocksize(s, bs))
+        {
+            printk("vvsfs - unsupported block size %u\n", bs);
+            return -EINVAL;
+        }
+        sbi->s_sbh = vvsfs_bread(s, VVSFS_SUPER_BLOCK);
+        if (!sbi->s_sbh)
+        {
+            printk("vvsfs - unable to read super block\n");
+            return -EIO;
+        }
+        vs = (struct vvsfs_super_block *)sbi->s_sbh->b_data;
+        sbi->s_vs = vs;
+        if (vs->s_magic != VVSFS_MAGIC || vs->s_block_size != bs)
+        {
+            printk("vvsfs - bad magic number\n");
+            return -EINVAL;
+        }
+    }
+    sbi->s_inodes_per_block = bs / VVSFS_INODE_SIZE;
+
+    if (vs->s_inode_count <= VVSFS_ROOT_INO ||
+        (u64)vs->s_imap_blocks * VVSFS_BITS_PER_BLOCK(s) < vs->s_inode_count ||
+        (u64)vs->s_itable_blocks * sbi->s_inodes_per_block < vs->s_inode_count ||
+        (u64)vs->s_bmap_blocks * VVSFS_BITS_PER_BLOCK(s) < vs->s_data_blocks ||
+        (u64)vs->s_refcount_blocks * VVSFS_COUNTS_PER_BLOCK(s) < vs->s_data_blocks ||
+        (u64)vs->s_refcount_start + vs->s_refcount_blocks > vs->s_data_start ||
+        vs->s_refcount_start <= vs->s_itable_start ||
+        (u64)vs->s_data_start + vs->s_data_blocks > vs->s_block_count ||
+        (vs->s_journal_blocks &&
+         (vs->s_journal_start <= vs->s_itable_start ||
+          (u64)vs->s_journal_start + vs->s_journal_blocks > vs->s_data_start)))
+    {
+        printk("vvsfs - corrupt super block geometry\n");
+        return -EINVAL;
+    }
+
+    sbi->s_itable_start = vs->s_itable_start;
+    sbi->s_data_start = vs->s_data_start;
+    sbi->s_refcount_start = vs->s_refcount_start;
+
+    // the bitmaps are read after any replay of the journal
+    err = vvsfs_journal_load(s, sbi);
+    if (err)
+    {
+        printk("vvsfs - unable to load the journal\n");
+        return err;
+    }
+
+    // the saved free counts are only exact after a clean unmount
+    clean = (vs->s_state & VVSFS_STATE_CLEAN) &&
+            vs->s_free_inodes <= vs->s_inode_count &&
+            vs->s_free_blocks <= vs->s_data_blocks;
+    if (sbi->s_inode_ra)
+    {
+        blk_start_plug(&plug);
+        for (k = 0; k < vs->s_imap_blocks; k++)
+            sb_breadahead(s, vs->s_imap_start + k);
+        for (k = 0; k < vs->s_bmap_blocks; k++)
+            sb_breadahead(s, vs->s_bmap_start + k);
+        blk_finish_plug(&plug);
+    }
+    err = vvsfs_bitmap_load(s, &sbi->s_imap, vs->s_imap_start,
+                            vs->s_imap_blocks, vs->s_inode_count,
+                            clean ? vs->s_free_inodes : -1);
+    if (!err)
+        err = vvsfs_bitmap_load(s, &sbi->s_bmap, vs->s_bmap_start,
+                                vs->s_bmap_blocks, vs->s_data_blocks,
+                                clean ? vs->s_free_blocks : -1);
+    if (err)
+    {
+        printk("vvsfs - unable to read allocation bitmaps\n");
+        return err;
+    }
+
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_FILES], vs->s_files);
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_DIRS], vs->s_dirs);
+    percpu_counter_set(&sbi->s_stats[VVSFS_STAT_BYTES], vs->s_bytes);
+    if (!clean && vvsfs_count_inodes(s))
+        printk("vvsfs - unable to recount the inodes, keeping the saved counts\n");
+
+    // until the clean unmount the saved counts may go stale
+    if (!sb_rdonly(s))
+    {
+        vs->s_state &= ~VVSFS_STATE_CLEAN;
+        mark_buffer_dirty(sbi->s_sbh);
+        sync_dirty_buffer(sbi->s_sbh);
+        vvsfs_orphan_recover(s, !clean);
+    }
+    return 0;
+}
+
+// vvsfs_stats_show - the statistics of one mount, one per line
+static int vvsfs_stats_show(struct seq_file *m, void *v)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(m->private);
+    int k;
+
+    for (k = 0; k < VVSFS_STAT_NR; k++)
+        seq_printf(m, "%s %lld\n", vvsfs_stat_names[k],
+                   percpu_counter_sum_positive(&sbi->s_stats[k]));
+    return 0;
+}
+
+// vvsfs_latency_show - the latency histograms of one mount, as a line per
+//                      operation and non-empty bucket: the operation, the
+//                      bucket's upper bound in ns and the calls in it
+static int vvsfs_latency_show(struct seq_file *m, void *v)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(m->private);
+    int op, k, cpu;
+    u64 n;
+
+    for (op = 0; op < VVSFS_OP_NR; op++)
+        for (k = 0; k < VVSFS_LAT_BUCKETS; k++)
+        {
+            n = 0;
+            for_each_possible_cpu(cpu)
+                n += per_cpu_ptr(sbi->s_lat, cpu)->count[op][k];
+            if (n)
+                seq_printf(m, "%s %llu %llu\n", vvsfs_op_names[op], 1ULL << k, n);
+        }
+    return 0;
+}
+
+// vvsfs_fill_super - read the super block and the inode bitmap, and set up
+//                    the root directory
 // Modified: Yutian Zhao
 static int vvsfs_fill_super(struct super_block *s, void *data, int silent)
 {
     struct inode *i;
-    int hblock;
-    struct vvsfs_inode dirdata;
-
-    if (DEBUG)
-        printk("vvsfs - fill super\n");
+    int err, k;
+    struct vvsfs_sb_info *sbi;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
     s->s_flags = MS_NOSUID | MS_NOEXEC;
@@ -874,40 +6435,231 @@ static int vvsfs_fill_super(struct super_block *s, void *data, int silent)
 #endif
     s->s_op = &vvsfs_ops;
 
-    i = new_inode(s);
-
-    i->i_sb = s;
-    i->i_ino = 0;
-    i->i_flags = 0;
-    i->i_op = &vvsfs_dir_inode_operations;
-    i->i_fop = &vvsfs_dir_operations;
-
-    vvsfs_readblock(i->i_sb, i->i_ino, &dirdata);
-    i_uid_write(i, dirdata.i_uid);
-    i_gid_write(i, dirdata.i_gid);
-    i->i_mode = dirdata.i_mode;
+    // the super block is read in the smallest block the device allows;
+    // vvsfs_load_super then moves to the size the file system was made with
+    if (!sb_min_blocksize(s, VVSFS_MIN_BLOCKSIZE))
+    {
+        printk("vvsfs - unable to set the block size\n");
+        return -EINVAL;
+    }
 
-    printk("inode %p\n", i);
+    sbi = kzalloc(sizeof(struct vvsfs_sb_info), GFP_KERNEL);
+    if (!sbi)
+        return -ENOMEM;
+    s->s_fs_info = sbi;
+    sbi->s_sb = s;
+    sbi->s_inode_ra = VVSFS_INODE_RA_DEFAULT;
+    mutex_init(&sbi->s_orphan_mutex);
+    mutex_init(&sbi->s_tail_mutex);
+    INIT_LIST_HEAD(&sbi->s_orphans);
+    INIT_WORK(&sbi->s_orphan_work, vvsfs_orphan_work);
+    spin_lock_init(&sbi->s_end_io_lock);
+    INIT_WORK(&sbi->s_end_io_work, vvsfs_end_io_work);
+    for (k = 0; k < VVSFS_STAT_NR; k++)
+    {
+        err = percpu_counter_init(&sbi->s_stats[k], 0, GFP_KERNEL);
+        if (err)
+            goto failed;
+    }
 
-    hblock = bdev_logical_block_size(s->s_bdev);
-    if (hblock > BLOCKSIZE)
+    err = vvsfs_parse_options(data, sbi);
+    if (err)
+        goto failed;
+    if (sbi->s_mount_opt & VVSFS_MOUNT_LATENCY)
     {
-        printk("device blocks are too small!!");
-        return -1;
+        err = -ENOMEM;
+        sbi->s_lat = alloc_percpu(struct vvsfs_latency);
+        if (!sbi->s_lat)
+            goto failed;
+    }
+    err = -ENOMEM;
+    sbi->s_orphan_wq = alloc_workqueue("vvsfs-orphan/%s", WQ_MEM_RECLAIM, 1, s->s_id);
+    if (!sbi->s_orphan_wq)
+        goto failed;
+    sbi->s_end_io_wq = alloc_workqueue("vvsfs-end-io/%s", WQ_MEM_RECLAIM, 0, s->s_id);
+    if (!sbi->s_end_io_wq)
+        goto failed;
+    err = vvsfs_load_super(s, sbi);
+    if (err)
+        goto failed;
+    s->s_magic = VVSFS_MAGIC;
+    s->s_maxbytes = (loff_t)U32_MAX << s->s_blocksize_bits;
+
+    i = vvsfs_iget(s, VVSFS_ROOT_INO);
+    if (IS_ERR(i))
+    {
+        err = PTR_ERR(i);
+        goto failed;
     }
 
-    set_blocksize(s->s_bdev, BLOCKSIZE);
-    s->s_blocksize = BLOCKSIZE;
-    s->s_blocksize_bits = BLOCKSIZE_BITS;
+    err = -ENOMEM;
     s->s_root = d_make_root(i);
+    if (!s->s_root)
+        goto failed;
+
+    // the statistics are optional, so a missing /proc entry is not an error
+    if (vvsfs_proc_root)
+        sbi->s_proc = proc_mkdir(s->s_id, vvsfs_proc_root);
+    if (sbi->s_proc)
+        proc_create_single_data("stats", 0444, sbi->s_proc, vvsfs_stats_show, s);
+    if (sbi->s_proc && sbi->s_lat)
+        proc_create_single_data("latency", 0444, sbi->s_proc, vvsfs_latency_show, s);
+
+    return 0;
+
+failed:
+    vvsfs_release_sbi(s, sbi);
+    s->s_fs_info = NULL;
+    return err;
+}
+
+// vvsfs_sync_fs - write out the super block and the allocation bitmaps. The
+//                 inode table and directory blocks are written back by the
+//                 caller along with the rest of the block device.
+static int vvsfs_sync_fs(struct super_block *sb, int wait)
+{
+    struct vvsfs_sb_info *sbi = VVSFS_SB(sb);
+    int err, err2;
+
+    vvsfs_save_stats(sb);
+    if (sbi->s_journal && wait)
+    {
+        err = vvsfs_commit(sb);
+        if (err)
+            return err;
+    }
+    else if (sbi->s_journal)
+        mod_delayed_work(system_wq, &sbi->s_journal->j_work, 0);
+    err = vvsfs_bitmap_sync(&sbi->s_imap, wait);
+    err2 = vvsfs_bitmap_sync(&sbi->s_bmap, wait);
+    if (!err)
+        err = err2;
+    if (buffer_dirty(sbi->s_sbh))
+    {
+        if (wait)
+            err2 = sync_dirty_buffer(sbi->s_sbh) ? -EIO : 0;
+        else
+            write_dirty_buffer(sbi->s_sbh, 0);
+        if (!err)
+            err = err2;
+    }
+    return err;
+}
 
+static int vvsfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    if (VVSFS_SB(root->d_sb)->s_mount_opt & VVSFS_MOUNT_ASYNC)
+        seq_puts(seq, ",writeback=async");
+    if (VVSFS_SB(root->d_sb)->s_mount_opt & VVSFS_MOUNT_LATENCY)
+        seq_puts(seq, ",latency");
+    if (VVSFS_SB(root->d_sb)->s_inode_ra != VVSFS_INODE_RA_DEFAULT)
+        seq_printf(seq, ",inode_readahead=%u", VVSFS_SB(root->d_sb)->s_inode_ra);
+    if (VVSFS_SB(root->d_sb)->s_mount_opt & VVSFS_MOUNT_NOTAIL)
+        seq_puts(seq, ",notail");
     return 0;
 }
 
+// vvsfs_write_inode - write the in-memory inode back to its inode block
+static int vvsfs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct super_block *sb = inode->i_sb;
+    int err;
+
+    // the inode block is released along with the inode
+    if (!inode->i_nlink)
+        return 0;
+
+    vvsfs_journal_start(sb);
+    down_read(&VVSFS_I(inode)->i_meta_sem);
+    err = vvsfs_write_inode_block(inode, wbc->sync_mode == WB_SYNC_ALL);
+    up_read(&VVSFS_I(inode)->i_meta_sem);
+    vvsfs_journal_stop(sb);
+    // a sync(2) commits once, from sync_fs, rather than once per inode
+    if (!err && wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync)
+        err = vvsfs_commit(sb);
+    return err;
+}
+
+// vvsfs_evict_inode - drop the cached pages of an inode, and free its blocks
+//                     and inode number once the last link has gone. An
+//                     inode on the orphan list is freed by the orphan
+//                     worker, so the final iput of a large file (the one
+//                     in unlink, usually) does not wait for that.
+static void vvsfs_evict_inode(struct inode *inode)
+{
+    truncate_inode_pages_final(&inode->i_data);
+    if (!inode->i_nlink)
+    {
+        if (S_ISDIR(inode->i_mode))
+            vvsfs_stat_add(inode->i_sb, VVSFS_STAT_DIRS, -1);
+        else
+        {
+            vvsfs_stat_add(inode->i_sb, VVSFS_STAT_FILES, -1);
+            vvsfs_stat_add(inode->i_sb, VVSFS_STAT_BYTES, -inode->i_size);
+        }
+        if (VVSFS_I(inode)->i_orphan)
+            vvsfs_orphan_queue(inode);
+        else
+            vvsfs_release_inode(inode);
+    }
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
+}
+
+static struct inode *vvsfs_alloc_inode(struct super_block *sb)
+{
+    struct vvsfs_inode_info *ei;
+
+    ei = kmem_cache_alloc(vvsfs_inode_cachep, GFP_KERNEL);
+    if (!ei)
+        return NULL;
+    ei->i_flags = 0;
+    ei->i_blocks = 0;
+    ei->i_extent_block = 0;
+    ei->i_extent_count = 0;
+    ei->i_extent_room = ARRAY_SIZE(ei->i_ext_small);
+    ei->i_ext = ei->i_ext_small;
+    ei->i_orphan = NULL;
+    ei->i_trim_size = 0;
+    return &ei->vfs_inode;
+}
+
+static void vvsfs_i_callback(struct rcu_head *head)
+{
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+    struct vvsfs_inode_info *ei = VVSFS_I(inode);
+
+    if (ei->i_ext != ei->i_ext_small)
+        kvfree(ei->i_ext);
+    kmem_cache_free(vvsfs_inode_cachep, ei);
+}
+
+// vvsfs_destroy_inode - free the inode once RCU path walks can no longer
+//                       see it
+static void vvsfs_destroy_inode(struct inode *inode)
+{
+    call_rcu(&inode->i_rcu, vvsfs_i_callback);
+}
+
+static void vvsfs_init_once(void *foo)
+{
+    struct vvsfs_inode_info *ei = foo;
+
+    init_rwsem(&ei->i_meta_sem);
+    init_rwsem(&ei->i_mpage_sem);
+    inode_init_once(&ei->vfs_inode);
+}
+
 static struct super_operations vvsfs_ops =
     {
+        alloc_inode : vvsfs_alloc_inode,
+        destroy_inode : vvsfs_destroy_inode,
         statfs : vvsfs_statfs,
         put_super : vvsfs_put_super,
+        write_inode : vvsfs_write_inode,
+        evict_inode : vvsfs_evict_inode,
+        sync_fs : vvsfs_sync_fs,
+        show_options : vvsfs_show_options,
     };
 
 static struct dentry *vvsfs_mount(struct file_system_type *fs_type,
@@ -927,44 +6679,38 @@ static struct file_system_type vvsfs_type =
         .fs_flags = FS_REQUIRES_DEV,
 };
 
-// simply show the total file size
-// author: Hong Wang
-static int vvsfs_proc_show(struct seq_file *m, void *v)
+static int __init vvsfs_init(void)
 {
-    printk("vvsfs - proc show\n");
-    seq_printf(m, "File Size: %i, File Count: %i, Directory Count: %i\n",
-               vvsfs_info.size,
-               vvsfs_info.file_count,
-               vvsfs_info.dir_count);
-    return 0;
-}
+    int err;
 
-static int vvsfs_proc_open(struct inode *inode, struct file *file)
-{
-    return single_open(file, vvsfs_proc_show, NULL);
-}
+    BUILD_BUG_ON(sizeof(struct vvsfs_inode) != VVSFS_INODE_SIZE);
 
-static const struct file_operations vvsfs_proc_fops = {
-    .open = vvsfs_proc_open,
-    .read = seq_read,
-    .llseek = seq_lseek,
-    .release = single_release};
+    vvsfs_inode_cachep = kmem_cache_create("vvsfs_inode_cache",
+                                           sizeof(struct vvsfs_inode_info), 0,
+                                           SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD,
+                                           vvsfs_init_once);
+    if (!vvsfs_inode_cachep)
+        return -ENOMEM;
 
-static int __init vvsfs_init(void)
-{
-    vvsfs_info.file_count = 0;
-    vvsfs_info.size = 0;
-    vvsfs_info.dir_count = 0;
     printk("Registering vvsfs\n");
-    proc_create("vvsfs", 0, NULL, &vvsfs_proc_fops);
-    return register_filesystem(&vvsfs_type);
+    vvsfs_proc_root = proc_mkdir("fs/vvsfs", NULL);
+    err = register_filesystem(&vvsfs_type);
+    if (err)
+    {
+        remove_proc_entry("fs/vvsfs", NULL);
+        kmem_cache_destroy(vvsfs_inode_cachep);
+    }
+    return err;
 }
 
 static void __exit vvsfs_exit(void)
 {
     printk("Unregistering the vvsfs.\n");
-    remove_proc_entry("vvsfs", NULL);
     unregister_filesystem(&vvsfs_type);
+    remove_proc_entry("fs/vvsfs", NULL);
+    // wait for the inodes freed through call_rcu
+    rcu_barrier();
+    kmem_cache_destroy(vvsfs_inode_cachep);
 }
 
 module_init(vvsfs_init);
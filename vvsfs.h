@@ -1,9 +1,20 @@
-#define BLOCKSIZE       512
-#define BLOCKSIZE_BITS  8
-#define NUMBLOCKS       100
-#define MAXNAME         15
+#include <linux/types.h>
 
-#define MAXFILESIZE     (BLOCKSIZE - 4*sizeof(int) - sizeof(uid_t) - sizeof(gid_t))
+// Block sizes mkfs.vvsfs can choose; the super block records the choice.
+// The super block itself is found by reading the first VVSFS_MIN_BLOCKSIZE
+// bytes of the device.
+#define VVSFS_MIN_BLOCKSIZE     512
+#define VVSFS_MAX_BLOCKSIZE     4096
+#define VVSFS_DEFAULT_BLOCKSIZE 4096
+#define MAXNAME         255
+
+#define VVSFS_INODE_SIZE    512     // bytes per on-disk inode; a block holds
+                                    // block size / VVSFS_INODE_SIZE of them
+#define VVSFS_N_EXTENTS     8       // extents held in the inode itself
+
+// bytes of file data (or directory entries) that fit in the inode itself
+#define MAXINLINE       (VVSFS_INODE_SIZE - 4*sizeof(int) - sizeof(uid_t) - sizeof(gid_t) \
+                         - sizeof(__u64) - 4*sizeof(__u32))
 
 #define MIN(a,b)        (((a)<(b))?(a):(b))
 
@@ -11,20 +22,262 @@
 #define true 1
 #define false 0
 
+// On-disk layout, all offsets in blocks:
+//   block 0                      super block
+//   s_imap_start .. +imap_blocks inode allocation bitmap, one bit per inode
+//   s_itable_start ..            inode table, packed VVSFS_INODE_SIZE bytes
+//                                to an inode
+//   s_bmap_start .. +bmap_blocks data block bitmap, one bit per data block
+//   s_refcount_start .. +blocks  data block reference counts, a __u16 per
+//                                data block
+//   s_journal_start .. +blocks   metadata journal (absent if s_journal_blocks
+//                                is 0)
+//   s_data_start ..              data blocks
+// Inode 0 is reserved so that a zero inode_number marks an unused
+// directory entry; the root directory is inode 1.
+//
+// Inodes whose last link has gone but whose blocks are not yet freed are
+// chained through i_orphan_next, starting from the i_orphan_next of the
+// reserved inode 0, so that a mount after a crash can finish freeing them.
+//
+// A data block can be shared by several files after a reflink. Its entry in
+// the reference count table holds the number of files sharing it beyond
+// the first, so the table is all zeroes until a block is shared, and a
+// block is only freed in the bitmap once its count is back to zero.
+#define VVSFS_MAGIC         0x56565346  // "VVSF"
+#define VVSFS_VERSION       9
+#define VVSFS_SUPER_BLOCK   0
+#define VVSFS_ROOT_INO      1
+
+struct vvsfs_super_block
+{
+    __u32 s_magic;
+    __u32 s_version;
+    __u32 s_block_size;     // bytes per block, VVSFS_MIN_BLOCKSIZE to
+                            // VVSFS_MAX_BLOCKSIZE
+    __u32 s_block_count;    // blocks in the file system
+    __u32 s_inode_count;    // inode slots, including the reserved inode 0
+    __u32 s_imap_start;     // first block of the inode bitmap
+    __u32 s_imap_blocks;
+    __u32 s_itable_start;   // first block of the inode table
+    __u32 s_itable_blocks;
+    __u32 s_bmap_start;     // first block of the data block bitmap
+    __u32 s_bmap_blocks;
+    __u32 s_data_start;     // first data block
+    __u32 s_data_blocks;
+    // statistics, saved by sync_fs and at unmount
+    __u32 s_files;          // files other than directories
+    __u32 s_dirs;           // directories other than the root
+    __u32 s_pad;
+    __u64 s_bytes;          // bytes of file data
+    __u32 s_free_inodes;    // free inode slots
+    __u32 s_free_blocks;    // free data blocks
+    __u32 s_state;          // VVSFS_STATE_*
+    __u32 s_journal_start;  // first block of the journal
+    __u32 s_journal_blocks; // 0 if the file system has no journal
+    __u32 s_refcount_start; // first block of the reference count table
+    __u32 s_refcount_blocks;
+};
+
+// most files that can share one data block, beyond the first
+#define VVSFS_REFCOUNT_MAX  0xffff
+
+// s_state: set when the file system was unmounted cleanly, so that the free
+// counts can be trusted; cleared while it is mounted read-write
+#define VVSFS_STATE_CLEAN   0x1
+
+// A run of e_len file blocks starting at file block e_lblk, stored in the
+// contiguous device blocks starting at e_pblk. Extents are kept sorted by
+// e_lblk; file blocks that no extent covers are holes and read as zeros.
+// An unwritten extent has its blocks allocated (by fallocate) but reads as
+// zeros too, until a write into it turns those blocks into written ones.
+struct vvsfs_extent
+{
+    __u32 e_lblk;
+    __u32 e_pblk;
+    __u32 e_len;
+    __u32 e_flags;          // VVSFS_EXTENT_*
+};
+
+// e_flags
+#define VVSFS_EXTENT_UNWRITTEN  0x1
+
+// i_flags
+#define VVSFS_INODE_INLINE  0x1     // data lives in the inode, not in extents
+#define VVSFS_INODE_INDEX   0x2     // directory kept as a hashed index
+#define VVSFS_INODE_REFLINK 0x4     // some extents may be shared with other
+                                    // files, and are copied before a write
+#define VVSFS_INODE_PREALLOC 0x8    // some extents may be unwritten, and are
+                                    // marked written as writes to them finish
+#define VVSFS_INODE_TAIL    0x10    // inline file whose data is in a slot of
+                                    // the tail block i_extent_block rather
+                                    // than in the inode
 
 struct vvsfs_inode
 {
     int is_empty;
     int is_directory;
-    int size;
     int i_mode;
+    int i_flags;
     uid_t i_uid;
     gid_t i_gid;
-    char data[MAXFILESIZE];
+    __u64 size;
+    __u32 i_blocks;         // data blocks in use, including i_extent_block
+    __u32 i_extent_count;   // extents in use
+    __u32 i_extent_block;   // block holding extents past VVSFS_N_EXTENTS, or 0
+    __u32 i_orphan_next;    // next inode on the orphan list, or 0
+    union
+    {
+        struct vvsfs_extent i_extents[VVSFS_N_EXTENTS];
+        char data[MAXINLINE];
+    };
 };
 
+// Overflow blocks for files with more than VVSFS_N_EXTENTS extents, chained
+// from i_extent_block through eb_next. Each is filled in turn with as many
+// extents as a block holds, and a file has at most VVSFS_EXTENT_BLOCKS of
+// them, so the most extents a file can have grows with the block size.
+struct vvsfs_extent_block
+{
+    __u32 eb_count;         // extents in this block
+    __u32 eb_next;          // next overflow block, or 0
+    struct vvsfs_extent eb_extents[];
+};
+
+#define VVSFS_EXTENT_BLOCKS     8
+#define VVSFS_EXTENTS_PER_BLOCK(bs) (((bs) - sizeof(struct vvsfs_extent_block)) / \
+                                     sizeof(struct vvsfs_extent))
+#define VVSFS_MAX_EXTENTS(bs)   (VVSFS_N_EXTENTS + VVSFS_EXTENT_BLOCKS * \
+                                 VVSFS_EXTENTS_PER_BLOCK(bs))
+
+// Regular files too big for the inode but no bigger than VVSFS_MAXTAIL are
+// packed, several to a block, into shared tail blocks. A tail block starts
+// with a table of slots naming the inode, offset and length of each tail;
+// the tails themselves are packed down from the end of the block. A slot
+// with ts_ino 0 is free.
+#define VVSFS_TAIL_MAGIC    0x5656544C  // "VVTL"
+
+struct vvsfs_tail_slot
+{
+    __u32 ts_ino;           // inode owning the tail, or 0
+    __u16 ts_off;           // where the tail starts in the block
+    __u16 ts_len;
+};
+
+struct vvsfs_tail_block
+{
+    __u32 tb_magic;
+    __u16 tb_count;         // slots in tb_slots, free or not
+    __u16 tb_unused;
+    struct vvsfs_tail_slot tb_slots[];
+};
+
+// largest tail, so that a block of bs bytes holds at least two; with 512-byte
+// blocks this is below MAXINLINE, and no tails are made
+#define VVSFS_MAXTAIL(bs)   (((bs) - sizeof(struct vvsfs_tail_block)) / 2 - \
+                             sizeof(struct vvsfs_tail_slot))
+
+// A directory entry. Entries are variable length: rec_len is the distance to
+// the next entry and is at least VVSFS_DIR_REC_LEN(name_len). Inline entries
+// are packed back to back; in a leaf block the last entry's rec_len runs to
+// the end of the block, and free space is either the slack at the end of an
+// entry or an entry whose inode_number is 0.
 struct vvsfs_dir_entry
 {
-    char name[MAXNAME+1];
-    int inode_number;
+    __u32 inode_number;
+    __u16 rec_len;          // bytes from this entry to the next
+    __u8 name_len;
+    __u8 file_type;         // DT_* type of the inode
+    char name[];            // name_len bytes, not NUL terminated
+};
+
+#define VVSFS_DIR_REC_LEN(name_len) ((sizeof(struct vvsfs_dir_entry) + (name_len) + 3) & ~3)
+
+// A directory starts out with its entries inline. Once they no longer fit it
+// becomes an indexed directory: file block 0 holds a vvsfs_dx_root that maps
+// ranges of name hashes, sorted by dx_hash, to leaf blocks of entries. Names
+// with the same hash always share a leaf. Once the root is full its map moves
+// to an index node and the root maps hash ranges to index nodes instead
+// (dx_levels 1), each of which maps its range to leaves.
+#define VVSFS_DX_MAGIC      0x56564458  // "VVDX"
+#define VVSFS_DX_NODE_MAGIC 0x5656444E  // "VVDN"
+
+struct vvsfs_dx_entry
+{
+    __u32 dx_hash;          // lowest hash stored under the entry
+    __u32 dx_block;         // file block of the leaf or index node
+};
+
+struct vvsfs_dx_root
+{
+    __u32 dx_magic;
+    __u16 dx_count;         // entries in dx_map; dx_map[0].dx_hash is 0
+    __u8 dx_levels;         // index nodes between the root and the leaves
+    __u8 dx_unused;
+    struct vvsfs_dx_entry dx_map[];
+};
+
+// An index node starts with a removed directory entry spanning the whole
+// block, so walks over the leaves pass over it, and then holds a
+// vvsfs_dx_root with VVSFS_DX_NODE_MAGIC and dx_levels 0.
+#define VVSFS_DX_NODE_HEAD  8
+
+// index entries that fit in a root block of bs bytes; a node has room for
+// VVSFS_DX_LIMIT(bs - VVSFS_DX_NODE_HEAD)
+#define VVSFS_DX_LIMIT(bs)  (((bs) - sizeof(struct vvsfs_dx_root)) / \
+                             sizeof(struct vvsfs_dx_entry))
+
+// The journal holds the last committed transaction, written from the start
+// of the journal area: a descriptor block naming up to VVSFS_JOURNAL_TAGS
+// home blocks, followed by copies of those blocks, repeated for larger
+// transactions, then revoke blocks naming the metadata blocks the
+// transaction freed, and then a commit block. The transaction is only
+// complete if the commit block has the descriptors' sequence number and its
+// checksum matches; mount copies a complete transaction back to the home
+// blocks, except for any block it revoked.
+//
+// Each operation reserves room in the log for VVSFS_HANDLE_BLOCKS blocks
+// before it starts, and long ones (truncating a big file, say) are split
+// into steps that stay within it. The smallest journal holds two
+// operations, with their descriptor and commit blocks.
+#define VVSFS_JOURNAL_MAGIC 0x56564A4C  // "VVJL"
+#define VVSFS_HANDLE_BLOCKS 64
+#define VVSFS_JOURNAL_MIN   (2 * VVSFS_HANDLE_BLOCKS + 8)
+
+// h_type
+#define VVSFS_JOURNAL_DESC      1
+#define VVSFS_JOURNAL_COMMIT    2
+#define VVSFS_JOURNAL_REVOKE    3
+
+struct vvsfs_journal_header
+{
+    __u32 h_magic;
+    __u32 h_type;
+    __u32 h_seq;            // transaction sequence number
+    __u32 h_count;          // blocks named (descriptor, revoke) or logged
+                            // (commit)
+};
+
+// home blocks named by a descriptor block of bs bytes
+#define VVSFS_JOURNAL_TAGS(bs)  (((bs) - sizeof(struct vvsfs_journal_header)) / \
+                                 sizeof(__u32))
+
+struct vvsfs_journal_desc
+{
+    struct vvsfs_journal_header d_header;
+    __u32 d_blocks[];       // home block of each copy that follows
+};
+
+// A freed block may be reused for file data, which is never logged, so a
+// replay must not write an older copy of it back.
+struct vvsfs_journal_revoke
+{
+    struct vvsfs_journal_header r_header;
+    __u32 r_blocks[];       // up to VVSFS_JOURNAL_TAGS blocks
+};
+
+struct vvsfs_journal_commit
+{
+    struct vvsfs_journal_header c_header;
+    __u32 c_crc;            // crc32 of the descriptors and copies
 };
@@ -0,0 +1,206 @@
+/*
+ * Tracepoints for the vvsfs. These cost a not-taken branch each when
+ * tracing is off; turn them on with
+ *    echo 1 > /sys/kernel/debug/tracing/events/vvsfs/enable
+ * or record them with perf (perf record -e 'vvsfs:*').
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vvsfs
+
+#if !defined(_VVSFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VVSFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// directory operations: the directory, the name, the inode it names (0 if
+// none) and the result
+DECLARE_EVENT_CLASS(vvsfs_dirop_class,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino, int ret),
+    TP_ARGS(dir, dentry, ino, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(int, ret)
+        __string(name, dentry->d_name.name)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->ret = ret;
+        __assign_str(name, dentry->d_name.name);
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->dir, __get_str(name), __entry->ino, __entry->ret)
+);
+
+DEFINE_EVENT(vvsfs_dirop_class, vvsfs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino, int ret),
+    TP_ARGS(dir, dentry, ino, ret)
+);
+
+DEFINE_EVENT(vvsfs_dirop_class, vvsfs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino, int ret),
+    TP_ARGS(dir, dentry, ino, ret)
+);
+
+DEFINE_EVENT(vvsfs_dirop_class, vvsfs_unlink,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino, int ret),
+    TP_ARGS(dir, dentry, ino, ret)
+);
+
+DEFINE_EVENT(vvsfs_dirop_class, vvsfs_rename,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino, int ret),
+    TP_ARGS(dir, dentry, ino, ret)
+);
+
+// file reads and writes: where, how much was asked for, and the result
+DECLARE_EVENT_CLASS(vvsfs_rw_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d ino %lu pos %lld count %zu ret %zd",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->pos, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(vvsfs_rw_class, vvsfs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+DEFINE_EVENT(vvsfs_rw_class, vvsfs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+// a metadata block read through vvsfs_bread; hit if it was already cached
+TRACE_EVENT(vvsfs_readblock,
+    TP_PROTO(struct super_block *sb, sector_t block, int hit),
+    TP_ARGS(sb, block, hit),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(sector_t, block)
+        __field(int, hit)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->block = block;
+        __entry->hit = hit;
+    ),
+
+    TP_printk("dev %d,%d block %llu %s",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long)__entry->block,
+              __entry->hit ? "hit" : "miss")
+);
+
+// a metadata block dirtied, and written now if sync is set
+TRACE_EVENT(vvsfs_writeblock,
+    TP_PROTO(struct super_block *sb, sector_t block, int sync),
+    TP_ARGS(sb, block, sync),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(sector_t, block)
+        __field(int, sync)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->block = block;
+        __entry->sync = sync;
+    ),
+
+    TP_printk("dev %d,%d block %llu %s",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              (unsigned long long)__entry->block,
+              __entry->sync ? "sync" : "async")
+);
+
+// an inode or data block allocation: the goal, the run asked for and what
+// was found (first is the bitmap size on failure)
+TRACE_EVENT(vvsfs_alloc,
+    TP_PROTO(struct super_block *sb, int inode, unsigned long goal,
+             unsigned long want, unsigned long first, unsigned long len),
+    TP_ARGS(sb, inode, goal, want, first, len),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, inode)
+        __field(unsigned long, goal)
+        __field(unsigned long, want)
+        __field(unsigned long, first)
+        __field(unsigned long, len)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->inode = inode;
+        __entry->goal = goal;
+        __entry->want = want;
+        __entry->first = first;
+        __entry->len = len;
+    ),
+
+    TP_printk("dev %d,%d %s goal %lu want %lu got %lu+%lu",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->inode ? "inode" : "block", __entry->goal,
+              __entry->want, __entry->first, __entry->len)
+);
+
+// a journal commit: the transaction, the blocks in it and the result
+TRACE_EVENT(vvsfs_commit,
+    TP_PROTO(struct super_block *sb, u32 seq, unsigned int count, int ret),
+    TP_ARGS(sb, seq, count, ret),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u32, seq)
+        __field(unsigned int, count)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->seq = seq;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("dev %d,%d seq %u blocks %u ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->seq, __entry->count, __entry->ret)
+);
+
+#endif /* _VVSFS_TRACE_H */
+
+// this part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vvsfs_trace
+#include <trace/define_trace.h>